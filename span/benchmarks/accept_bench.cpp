@@ -0,0 +1,103 @@
+#include <sys/resource.h>
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "span/Timer.hh"
+#include "span/fibers/Scheduler.hh"
+#include "span/io/IOManager.hh"
+#include "span/io/Socket.hh"
+
+using span::TimerManager;
+using span::fibers::Scheduler;
+using span::io::Address;
+using span::io::IOManager;
+using span::io::Socket;
+
+// Wakeups and latency accepting on one listening socket shared by many single threaded IOManagers, with
+// and without EPOLLEXCLUSIVE (Socket::listen(backlog, true)).
+//
+// Every IOManager waits in accept() on its share() of the listener, while a client makes `connections`
+// connections one after another, each only once the last was accepted, so all of them are idle for every
+// one. Wakeups are voluntary context switches across the whole process.
+static const size_t kConnections = 20000;
+static const size_t kThreads = 16;
+
+struct Result {
+  double wakeups;
+  double latencyUs;
+};
+
+static uint64 contextSwitches() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw;
+}
+
+static Result run(bool exclusive, size_t connections, size_t threads) {
+  IOManager client;
+  std::vector<std::unique_ptr<IOManager>> acceptors;
+  for (size_t i = 0; i < threads; ++i) {
+    acceptors.emplace_back(new IOManager(1, false));
+  }
+  Address::ptr address = Address::lookup("127.0.0.1").front();
+  Socket::ptr listener = address->createSocket(acceptors.front().get(), SOCK_STREAM);
+  listener->bind(address);
+  listener->listen(SOMAXCONN, exclusive);
+  address = listener->localAddress();
+
+  std::atomic<size_t> accepted(0);
+  std::atomic<uint64> connectedAt(0), totalLatency(0);
+  // All of them before any accept loop starts reading the vector.
+  std::vector<Socket::ptr> listeners;
+  for (size_t i = 0; i < threads; ++i) {
+    listeners.push_back(i ? listener->share(acceptors[i].get()) : listener);
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    acceptors[i]->schedule([&, i]() {
+      try {
+        while (true) {
+          listeners[i]->accept();
+          totalLatency += TimerManager::now() - connectedAt;
+          ++accepted;
+        }
+      } catch (std::runtime_error &) {}
+    });
+  }
+
+  uint64 switches = 0;
+  client.schedule([&]() {
+    uint64 start = contextSwitches();
+    for (size_t i = 0; i < connections; ++i) {
+      Socket::ptr connect = address->createSocket(&client, SOCK_STREAM);
+      connectedAt = TimerManager::now();
+      connect->connect(address);
+      while (accepted <= i) {
+        Scheduler::yield();
+      }
+    }
+    switches = contextSwitches() - start;
+  });
+  client.dispatch();
+  for (Socket::ptr &socket : listeners) {
+    socket->cancelAccept();
+  }
+  return {static_cast<double>(switches) / connections, static_cast<double>(totalLatency) / connections};
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t connections = argc > 1 ? std::stoul(argv[1]) : kConnections;
+  size_t threads = argc > 2 ? std::stoul(argv[2]) : kThreads;
+
+  std::cout << connections << " connections, " << threads << " accepting threads" << std::endl;
+  for (bool exclusive : {false, true}) {
+    Result result = run(exclusive, connections, threads);
+    std::cout << (exclusive ? "EPOLLEXCLUSIVE: " : "shared:         ") << result.wakeups
+      << " wakeups/connection, " << result.latencyUs << "us to accept" << std::endl;
+  }
+  return 0;
+}
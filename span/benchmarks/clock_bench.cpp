@@ -0,0 +1,43 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "span/Timer.hh"
+
+using span::TimerManager;
+
+// Cost of a timestamp from each of TimerManager's clocks (and std::chrono's, for reference), over `reads`
+// reads apiece. Build with `--define clock=tsc` for preciseNow() to read the TSC.
+static const size_t kReads = 10000000;
+
+template<class Clock>
+static void measure(const char *name, size_t reads, Clock clock) {
+  uint64 sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < reads; ++i) {
+    sum += clock();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / reads;
+  // Printing sum keeps the reads from being optimised away.
+  std::cout << name << ns << " ns/read (" << (sum & 1) << ")" << std::endl;
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t reads = argc > 1 ? std::stoul(argv[1]) : kReads;
+
+  // Let preciseNow() finish calibrating, if it's going to.
+  uint64 start = TimerManager::now();
+  while (TimerManager::now() - start < 200000) {
+    TimerManager::preciseNow();
+  }
+  TimerManager::updateLoopTime();
+
+  measure("steady_clock: ", reads, []() {
+    return static_cast<uint64>(std::chrono::steady_clock::now().time_since_epoch().count());
+  });
+  measure("now():        ", reads, &TimerManager::now);
+  measure("preciseNow(): ", reads, &TimerManager::preciseNow);
+  measure("coarseNow():  ", reads, &TimerManager::coarseNow);
+  return 0;
+}
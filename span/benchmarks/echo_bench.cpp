@@ -0,0 +1,103 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "span/io/IOManager.hh"
+#include "span/io/Socket.hh"
+
+using span::io::Address;
+using span::io::IOManager;
+using span::io::IPAddress;
+using span::io::Socket;
+
+// Loopback echo throughput, waiting for readiness through epoll versus completions through io_uring.
+//
+// Opens `connections` TCP connections to ourselves; each client fiber sends a `size` byte message and
+// waits for it to come back, `messages` times over, while a server fiber per connection echoes.
+static const size_t kConnections = 16;
+static const size_t kMessages = 20000;
+static const size_t kSize = 64;
+
+static void receiveAll(Socket *sock, char *buf, size_t len) {
+  while (len) {
+    size_t got = sock->receive(buf, len);
+    if (!got) {
+      throw std::runtime_error("connection closed");
+    }
+    buf += got;
+    len -= got;
+  }
+}
+
+static void sendAll(Socket *sock, const char *buf, size_t len) {
+  while (len) {
+    size_t sent = sock->send(buf, len);
+    buf += sent;
+    len -= sent;
+  }
+}
+
+static double run(bool completionIO, size_t threads, size_t connections, size_t messages, size_t size) {
+  IOManager ioManager(threads, true, true, completionIO);
+  if (completionIO && !ioManager.completionIO()) {
+    std::cout << "  (no usable io_uring, this is epoll again)" << std::endl;
+  }
+
+  IPAddress::ptr address = std::dynamic_pointer_cast<IPAddress>(Address::lookup("127.0.0.1").front());
+  Socket::ptr listen = address->createSocket(&ioManager, SOCK_STREAM);
+  listen->bind(address);
+  listen->listen();
+  address = std::dynamic_pointer_cast<IPAddress>(listen->localAddress());
+
+  std::vector<Socket::ptr> clients, servers;
+  for (size_t i = 0; i < connections; ++i) {
+    clients.push_back(address->createSocket(&ioManager, SOCK_STREAM));
+    ioManager.schedule([&listen, &servers]() { servers.push_back(listen->accept()); });
+    clients.back()->connect(address);
+    ioManager.dispatch();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < connections; ++i) {
+    Socket *server = servers[i].get();
+    ioManager.schedule([server, messages, size]() {
+      std::vector<char> buf(size);
+      for (size_t j = 0; j < messages; ++j) {
+        receiveAll(server, &buf[0], size);
+        sendAll(server, &buf[0], size);
+      }
+    });
+    Socket *client = clients[i].get();
+    ioManager.schedule([client, messages, size]() {
+      std::vector<char> buf(size, 'x');
+      for (size_t j = 0; j < messages; ++j) {
+        sendAll(client, &buf[0], size);
+        receiveAll(client, &buf[0], size);
+      }
+    });
+  }
+  ioManager.dispatch();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t connections = argc > 1 ? std::stoul(argv[1]) : kConnections;
+  size_t messages = argc > 2 ? std::stoul(argv[2]) : kMessages;
+  size_t size = argc > 3 ? std::stoul(argv[3]) : kSize;
+  size_t threads = argc > 4 ? std::stoul(argv[4]) : 1;
+
+  std::cout << connections << " connections x " << messages << " round trips of " << size << " bytes, "
+    << threads << " thread(s)" << std::endl;
+  for (bool completionIO : {false, true}) {
+    double seconds = run(completionIO, threads, connections, messages, size);
+    double roundTrips = static_cast<double>(connections * messages);
+    std::cout << (completionIO ? "io_uring: " : "epoll:    ") << static_cast<uint64>(roundTrips / seconds)
+      << " round trips/sec, " << static_cast<uint64>(roundTrips * size * 2 / seconds / (1 << 20)) << " MiB/s"
+      << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "span/fibers/Fiber.hh"
+
+using span::fibers::Fiber;
+
+// Measures the cost of a single Fiber context switch.
+//
+// Each iteration of the loop is a call() into the fiber, and a yield() back
+// out, i.e. two switches. Build with `--define fibers=ucontext` to measure the
+// getcontext/setjmp fallback instead of the assembly backend.
+static const uint64 kIterations = 10000000;
+
+static void pingPong() {
+  while (true) {
+    Fiber::yield();
+  }
+}
+
+int main(int argc, const char * const argv[]) {
+  uint64 iterations = argc > 1 ? std::stoull(argv[1]) : kIterations;
+  Fiber::ptr mainFiber = Fiber::getThis();
+  Fiber::ptr fiber(new Fiber(&pingPong));
+
+  // Warm up, and fault in the top of the stack.
+  for (int i = 0; i < 1000; ++i) {
+    fiber->call();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64 i = 0; i < iterations; ++i) {
+    fiber->call();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << "backend: " << span::fibers::base::FiberBase::backend() << std::endl;
+  std::cout << "switches: " << iterations * 2 << std::endl;
+  std::cout << "ns/switch: " << ns / (iterations * 2) << std::endl;
+
+  // Let the fiber unwind cleanly before it is destroyed.
+  try {
+    throw std::runtime_error("done");
+  } catch (...) {
+    try {
+      fiber->inject(std::current_exception());
+    } catch (...) {}
+  }
+  return 0;
+}
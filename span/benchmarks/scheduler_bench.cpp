@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "span/fibers/WorkerPool.hh"
+
+using span::fibers::Scheduler;
+using span::fibers::WorkerPool;
+
+// Measures Scheduler throughput with many threads scheduling small tasks.
+//
+// Each producer task schedules `kChildren` no-op children onto the scheduler it is
+// running on, the way a server fans out work per connection. Reported as tasks/sec
+// for pools of 1, 2, 4 ... up to the given thread count.
+static const size_t kProducers = 256;
+static const size_t kChildren = 2000;
+
+static std::atomic<size_t> completed;
+
+static void child() {
+  completed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void producer() {
+  Scheduler *scheduler = Scheduler::getThis();
+  for (size_t i = 0; i < kChildren; ++i) {
+    scheduler->schedule(&child, std::thread::id(), Scheduler::TINY_STACK);
+  }
+  completed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static double run(size_t threads) {
+  const size_t total = kProducers * (kChildren + 1);
+  completed = 0;
+  WorkerPool pool(threads, false);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kProducers; ++i) {
+    pool.schedule(&producer, std::thread::id(), Scheduler::TINY_STACK);
+  }
+  while (completed.load(std::memory_order_relaxed) < total) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  auto end = std::chrono::steady_clock::now();
+  pool.stop();
+  return total / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t maxThreads = argc > 1 ? std::stoul(argv[1]) :
+    std::max<size_t>(1, std::thread::hardware_concurrency());
+  std::cout << "threads\ttasks/sec" << std::endl;
+  for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+    std::cout << threads << "\t" << static_cast<uint64>(run(threads)) << std::endl;
+  }
+  return 0;
+}
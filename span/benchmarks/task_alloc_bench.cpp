@@ -0,0 +1,64 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "span/fibers/WorkerPool.hh"
+
+using span::fibers::Scheduler;
+using span::fibers::WorkerPool;
+
+// Counts heap allocations per scheduled functor.
+//
+// Schedules `kTasks` lambdas capturing a few pointers (too big for std::function's
+// own small buffer) on a hijacking WorkerPool, then dispatches them, counting every
+// operator new along the way.
+static const size_t kTasks = 1000000;
+
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  std::free(p);
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t tasks = argc > 1 ? std::stoul(argv[1]) : kTasks;
+  size_t a = 0, b = 0, c = 0;
+  WorkerPool pool(1, true, 64);
+
+  // Warm up; lets the queues and fibers reach their steady state size.
+  for (size_t i = 0; i < 1000; ++i) {
+    pool.schedule([&a, &b, &c]() { ++a; ++b; ++c; }, std::thread::id(), Scheduler::TINY_STACK);
+  }
+  pool.dispatch();
+
+  size_t before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tasks; ++i) {
+    pool.schedule([&a, &b, &c]() { ++a; ++b; ++c; }, std::thread::id(), Scheduler::TINY_STACK);
+  }
+  pool.dispatch();
+  auto end = std::chrono::steady_clock::now();
+  size_t after = allocations;
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "tasks: " << tasks << " (ran " << a << ")" << std::endl;
+  std::cout << "allocations/task: " << static_cast<double>(after - before) / tasks << std::endl;
+  std::cout << "tasks/sec: " << static_cast<uint64>(tasks / seconds) << std::endl;
+  return 0;
+}
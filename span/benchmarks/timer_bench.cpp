@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "span/Timer.hh"
+
+using span::Timer;
+using span::TimerManager;
+
+// The pattern Socket timeouts produce: `timers` long lived timers, each repeatedly cancelled and
+// re-registered `rounds` times, with expired ones processed every so often. Compares TimerManager's sorted
+// set with a 1ms timing wheel, and with deadlines (Timer::arm() and disarm(), as Socket uses). Then has
+// several threads do the same to one wheel, with and without TimerManager::shardByThread().
+static const size_t kTimers = 500000;
+static const size_t kRounds = 4;
+
+static double run(uint64 tickUs, size_t timers, size_t rounds) {
+  TimerManager manager;
+  if (tickUs) {
+    manager.useTimingWheel(tickUs);
+  }
+  std::mt19937 random(1);
+  std::vector<Timer::ptr> live(timers);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < timers; ++i) {
+      if (live[i]) {
+        live[i]->cancel();
+      }
+      // 10 to 40 seconds out, so none of them fire.
+      live[i] = manager.registerTimer(10000000 + random() % 30000000, []() {});
+      if (i % 1024 == 0) {
+        manager.executeTimers();
+        manager.nextTimer();
+      }
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  for (Timer::ptr &timer : live) {
+    timer->cancel();
+  }
+  return std::chrono::duration<double>(end - start).count();
+}
+
+static double runDeadlines(size_t timers, size_t rounds) {
+  TimerManager manager;
+  std::mt19937 random(1);
+  std::vector<Timer::ptr> live;
+  for (size_t i = 0; i < timers; ++i) {
+    live.push_back(manager.createDeadline([]() {}));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < rounds; ++round) {
+    for (size_t i = 0; i < timers; ++i) {
+      live[i]->disarm();
+      live[i]->arm(10000000 + random() % 30000000);
+      if (i % 1024 == 0) {
+        manager.executeTimers();
+        manager.nextTimer();
+      }
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  for (Timer::ptr &timer : live) {
+    timer->disarm();
+  }
+  return std::chrono::duration<double>(end - start).count();
+}
+
+static double runThreads(bool sharded, size_t threads, size_t timers, size_t rounds) {
+  TimerManager manager;
+  manager.useTimingWheel(1000);
+  if (sharded) {
+    manager.shardByThread();
+  }
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&manager, t, threads, timers, rounds]() {
+      manager.attachThread();
+      std::mt19937 random(t + 1);
+      std::vector<Timer::ptr> live(timers / threads);
+      for (size_t round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < live.size(); ++i) {
+          if (live[i]) {
+            live[i]->cancel();
+          }
+          live[i] = manager.registerTimer(10000000 + random() % 30000000, []() {});
+          if (i % 1024 == 0) {
+            manager.executeTimers();
+            manager.nextTimer();
+          }
+        }
+      }
+      for (Timer::ptr &timer : live) {
+        timer->cancel();
+      }
+      manager.detachThread();
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t timers = argc > 1 ? std::stoul(argv[1]) : kTimers;
+  size_t rounds = argc > 2 ? std::stoul(argv[2]) : kRounds;
+  size_t threads = argc > 3 ? std::stoul(argv[3]) : std::max(2u, std::thread::hardware_concurrency());
+
+  std::cout << timers << " timers, re-armed " << rounds << " times" << std::endl;
+  for (uint64 tickUs : {0, 1000}) {
+    double seconds = run(tickUs, timers, rounds);
+    std::cout << (tickUs ? "wheel: " : "set:   ") << static_cast<uint64>(timers * rounds / seconds)
+      << " cancel+register/sec" << std::endl;
+  }
+  double seconds = runDeadlines(timers, rounds);
+  std::cout << "deadlines: " << static_cast<uint64>(timers * rounds / seconds) << " disarm+arm/sec" << std::endl;
+  for (bool sharded : {false, true}) {
+    seconds = runThreads(sharded, threads, timers, rounds);
+    std::cout << threads << " threads, " << (sharded ? "sharded: " : "one lock: ")
+      << static_cast<uint64>(timers / threads * threads * rounds / seconds) << " cancel+register/sec" << std::endl;
+  }
+  return 0;
+}
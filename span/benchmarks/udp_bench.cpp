@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "span/fibers/Fiber.hh"
+#include "span/fibers/Scheduler.hh"
+#include "span/io/IOManager.hh"
+#include "span/io/Socket.hh"
+
+using span::fibers::Fiber;
+using span::fibers::Scheduler;
+using span::io::Address;
+using span::io::IOManager;
+using span::io::Socket;
+
+// Loopback UDP throughput, a syscall per datagram (sendTo() and receiveFrom()) versus batches of them
+// (sendBatch() and receiveBatch()).
+//
+// A sender fiber sends `datagrams` datagrams of `size` bytes, `window` at a time, waiting after each
+// window for the receiver fiber to take them all.
+static const size_t kDatagrams = 1000000;
+static const size_t kSize = 64;
+static const size_t kWindow = 64;
+
+static double run(bool batch, size_t datagrams, size_t size, size_t window, size_t *received) {
+  IOManager ioManager;
+  Address::ptr address = Address::lookup("127.0.0.1").front();
+  Socket::ptr receiver = address->createSocket(&ioManager, SOCK_DGRAM);
+  receiver->bind(address);
+  // Should a datagram get dropped, rather than waiting forever for it.
+  receiver->receiveTimeout(1000000);
+  Address::ptr to = receiver->localAddress();
+  Socket::ptr sender = address->createSocket(&ioManager, SOCK_DGRAM);
+
+  std::vector<char> out(size * window, 'x'), in(size * window);
+  std::vector<iovec> outBuffers(window), inBuffers(window);
+  std::vector<Socket::Datagram> outgoing(window), incoming(window);
+  for (size_t i = 0; i < window; ++i) {
+    outBuffers[i].iov_base = &out[i * size];
+    outBuffers[i].iov_len = size;
+    outgoing[i] = {&outBuffers[i], 1, to.get(), 0, 0};
+    inBuffers[i].iov_base = &in[i * size];
+    inBuffers[i].iov_len = size;
+    incoming[i] = {&inBuffers[i], 1, NULL, 0, 0};
+  }
+
+  *received = 0;
+  size_t sent = 0;
+  bool failed = false;
+  Fiber::ptr senderFiber;
+  auto start = std::chrono::steady_clock::now();
+  ioManager.schedule([&]() {
+    senderFiber = Fiber::getThis();
+    while (sent < datagrams && !failed) {
+      size_t count = std::min(window, datagrams - sent);
+      for (size_t i = 0; i < count;) {
+        if (batch) {
+          i += sender->sendBatch(&outgoing[i], count - i);
+        } else {
+          sender->sendTo(&out[i * size], size, 0, *to);
+          ++i;
+        }
+      }
+      sent += count;
+      // Until the receiver has them all, or the socket buffer overflows.
+      Scheduler::yieldTo();
+    }
+  });
+  ioManager.schedule([&]() {
+    try {
+      while (*received < datagrams) {
+        if (batch) {
+          *received += receiver->receiveBatch(&incoming[0], window);
+        } else {
+          receiver->receive(&in[0], size);
+          ++*received;
+        }
+        if (*received == sent) {
+          ioManager.schedule(senderFiber);
+        }
+      }
+    } catch (std::runtime_error &) {
+      failed = true;
+      ioManager.schedule(senderFiber);
+    }
+  });
+  ioManager.dispatch();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, const char * const argv[]) {
+  size_t datagrams = argc > 1 ? std::stoul(argv[1]) : kDatagrams;
+  size_t size = argc > 2 ? std::stoul(argv[2]) : kSize;
+  size_t window = argc > 3 ? std::stoul(argv[3]) : kWindow;
+
+  std::cout << datagrams << " datagrams of " << size << " bytes, " << window << " at a time" << std::endl;
+  for (bool batch : {false, true}) {
+    size_t received;
+    double seconds = run(batch, datagrams, size, window, &received);
+    std::cout << (batch ? "batched:       " : "one at a time: ") << static_cast<uint64>(received / seconds)
+      << " datagrams/sec";
+    if (received < datagrams) {
+      std::cout << " (" << datagrams - received << " dropped)";
+    }
+    std::cout << std::endl;
+  }
+  return 0;
+}
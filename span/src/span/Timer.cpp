@@ -1,12 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <memory>
 #include <set>
 #include <stdexcept>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "span/Timer.hh"
+#include "span/TimingWheel.hh"
 #include "span/exceptions/Assert.hh"
 
+#include "absl/base/call_once.h"
 #include "glog/logging.h"
 
 #if PLATFORM == PLATFORM_DARWIN || UNIX_FLAVOUR == UNIX_FLAVOUR_OSX
@@ -18,6 +23,12 @@
 #include <time.h>
 #endif
 
+#if defined(SPAN_TSC_CLOCK) && (defined(__x86_64__) || defined(__i386__))
+#define SPAN_TSC_CLOCK_X86
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 namespace span {
 
   std::function<uint64()> TimerManager::clockDg;
@@ -64,10 +75,7 @@ namespace span {
   mach_timebase_info_data_t globalTimebase = queryTimebase();
 #endif
 
-  uint64 TimerManager::now() {
-    if (clockDg) {
-      return clockDg();
-    }
+  static uint64 systemNow() {
 #if PLATFORM == PLATFORM_WIN32
     LARGE_INTEGER count;
     if (!QueryPerformanceCounter(&count)) {
@@ -97,111 +105,695 @@ namespace span {
 #endif
   }
 
-  Timer::Timer(uint64 us, std::function<void()> dg, bool recurring, TimerManager *manager) : recurring(recurring),
-    us(us), dg(dg), manager(manager) {
+  uint64 TimerManager::now() {
+    if (clockDg) {
+      return clockDg();
+    }
+    return systemNow();
+  }
+
+  static thread_local uint64 loopTime = 0;
+
+  uint64 TimerManager::coarseNow() {
+    return loopTime ? loopTime : now();
+  }
+
+  uint64 TimerManager::updateLoopTime() {
+    return loopTime = now();
+  }
+
+  void TimerManager::clearLoopTime() {
+    loopTime = 0;
+  }
+
+#ifdef SPAN_TSC_CLOCK_X86
+  // systemNow() extrapolated from the TSC. Until it has seen the TSC run for long enough to know its rate,
+  // it hands out systemNow() itself.
+  class TscClock {
+  public:
+    TscClock() : usable(invariant()), startTsc(__rdtsc()), startUs(systemNow()), tscBase(0), usBase(0), mult(0) {
+      LOG(INFO) << "TSC clock " << (usable ? "calibrating" : "unusable, TSC isn't invariant");
+    }
+
+    uint64 now() {
+      uint64 m = mult.load(std::memory_order_acquire);
+      if (m) {
+        return usBase + static_cast<uint64>((static_cast<unsigned __int128>(__rdtsc() - tscBase) * m) >> 32);
+      }
+      uint64 us = systemNow();
+      if (usable && us - startUs >= kCalibrationUs) {
+        absl::call_once(calibrated, [this]() { calibrate(); });
+      }
+      return us;
+    }
+
+  private:
+    static const uint64 kCalibrationUs = 100000;
+
+    // Ticks at a constant rate whatever the power state, and (on anything that has this) in step across cores.
+    static bool invariant() {
+      unsigned eax, ebx, ecx, edx;
+      return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8));
+    }
+
+    void calibrate() {
+      usBase = systemNow();
+      tscBase = __rdtsc();
+      uint64 m = static_cast<uint64>((static_cast<unsigned __int128>(usBase - startUs) << 32) / (tscBase - startTsc));
+      LOG(INFO) << "TSC clock calibrated at " << (tscBase - startTsc) / (usBase - startUs) << " ticks/us";
+      mult.store(m, std::memory_order_release);
+    }
+
+    const bool usable;
+    const uint64 startTsc, startUs;
+    absl::once_flag calibrated;
+    uint64 tscBase, usBase;
+    // Microseconds per tick, as a 32.32 fixed point number; 0 until calibrated.
+    std::atomic<uint64> mult;
+  };
+#endif
+
+  uint64 TimerManager::preciseNow() {
+    if (clockDg) {
+      return clockDg();
+    }
+#ifdef SPAN_TSC_CLOCK_X86
+    static TscClock tsc;
+    return tsc.now();
+#else
+    return systemNow();
+#endif
+  }
+
+  // One thread's share of a TimerManager's timers, or (TimerManager::shared) those of threads without one. Its
+  // structures are guarded by mutex, which in a thread's own shard only its owner takes, short of a timer being
+  // moved out by TimerManager::relink(); other threads post changes to the mailbox, which the owner goes through
+  // each time it works out how long to sleep and before expiring anything.
+  class TimerShard {
+  public:
+    TimerShard(uint64 wheelTickUs, uint64 nowUs) : tickled(false), attached(false), mailbox(nullptr),
+      wakeDeadline(~0ull), previousTime(0ull) {
+      if (wheelTickUs) {
+        wheel.reset(new TimingWheel(wheelTickUs, nowUs));
+      }
+    }
+
+    ~TimerShard() {
+      // Drop anything posted after the owner detached.
+      Timer *timer = mailbox.exchange(nullptr);
+      while (timer) {
+        Timer *next = timer->mailNext;
+        Timer::ptr ref = std::move(timer->mailRef);
+        timer->mailed.store(false);
+        timer = next;
+      }
+    }
+
+    // The rest with mutex held. insert() returns whether timer is now the first due.
+    bool insert(const Timer::ptr &timer, uint64 nowUs);
+    void erase(Timer *timer);
+    bool empty() const;
+    uint64 nextDeadline() const;
+    // Works out when a RESETTING timer is due now, returning false if it's been cancelled or someone else already
+    // did. It's left out of any structure either way.
+    bool apply(Timer *timer);
+    // Catches up with everything posted.
+    void drain(uint64 nowUs);
+    // Appends to @p deferred the due times of timers that fired late because of their slack, and sets @p onTime if
+    // any others fired.
+    void expire(uint64 nowUs, std::vector<span::fibers::Task> *result, std::vector<uint64> *deferred,
+      bool *onTime);
+    void clear(std::vector<Timer::ptr> *all);
+
+    // From any thread, without locking: asks the owner to look at timer again.
+    void post(Timer *timer);
+
+    absl::Mutex mutex;
+    bool tickled;
+    // Guarded by TimerManager::shardsMutex.
+    bool attached;
+    std::atomic<Timer *> mailbox;
+    // When the owner will next look at its timers, as of the last time it went to sleep; ~0ull if never.
+    std::atomic<uint64> wakeDeadline;
+
+  private:
+    bool detectClockRollover(uint64 nowUs);
+    TimingWheel *deadlineWheel(uint64 nowUs);
+
+    std::set<Timer::ptr, Timer::Comparator> timers;
+    std::unique_ptr<TimingWheel> wheel;
+    // Where deadlines go when there's no wheel.
+    std::unique_ptr<TimingWheel> deadlines;
+    uint64 previousTime;
+  };
+
+  TimingWheel *TimerShard::deadlineWheel(uint64 nowUs) {
+    if (wheel) {
+      return wheel.get();
+    }
+    if (!deadlines) {
+      deadlines.reset(new TimingWheel(TimerManager::DEADLINE_TICK_US, nowUs));
+    }
+    return deadlines.get();
+  }
+
+  bool TimerShard::insert(const Timer::ptr &timer, uint64 nowUs) {
+    SPAN_ASSERT(!timer->linked);
+    timer->home.store(this);
+    timer->linked = true;
+    if (timer->deadline || wheel) {
+      (timer->deadline ? deadlineWheel(nowUs) : wheel.get())->insert(timer, nowUs);
+      return timer->next < wakeDeadline.load();
+    }
+    return timers.insert(timer).first == timers.begin();
+  }
+
+  void TimerShard::erase(Timer *timer) {
+    if (!timer->linked) {
+      return;
+    }
+    timer->linked = false;
+    if (wheel) {
+      wheel->erase(timer);
+    } else if (timer->deadline) {
+      deadlines->erase(timer);
+    } else {
+      Timer::ptr key(timer, &nop<Timer *>);
+      std::set<Timer::ptr, Timer::Comparator>::iterator it = timers.find(key);
+      SPAN_ASSERT(it != timers.end());
+      timers.erase(it);
+    }
+  }
+
+  bool TimerShard::empty() const {
+    return timers.empty() && (!wheel || wheel->empty()) && (!deadlines || deadlines->empty());
+  }
+
+  uint64 TimerShard::nextDeadline() const {
+    uint64 deadline;
+    if (wheel) {
+      deadline = wheel->nextDeadline();
+    } else {
+      deadline = timers.empty() ? ~0ull : (*timers.begin())->next;
+    }
+    if (deadlines) {
+      deadline = std::min(deadline, deadlines->nextDeadline());
+    }
+    return deadline;
+  }
+
+  bool TimerShard::apply(Timer *timer) {
+    int state = Timer::RESETTING;
+    if (!timer->state.compare_exchange_strong(state, Timer::ARMED)) {
+      if (state == Timer::CANCELLED || state == Timer::DISARMED) {
+        erase(timer);
+      }
+      return false;
+    }
+    erase(timer);
+    // Read after the exchange, so a reset claimed since gets applied in turn rather than lost.
+    uint64 us, start;
+    {
+      absl::MutexLock lock(&timer->pendingMutex);
+      us = timer->pendingUs;
+      start = timer->pendingStart;
+    }
+    if (start == ~0ull) {
+      start = timer->due - timer->us;
+    }
+    if (us != ~0ull) {
+      timer->us = us;
+    }
+    timer->setDue(start + timer->us);
+    return true;
+  }
+
+  void TimerShard::post(Timer *timer) {
+    if (timer->mailed.exchange(true)) {
+      // Already queued, and not looked at yet.
+      return;
+    }
+    timer->mailRef = timer->shared_from_this();
+    Timer *head = mailbox.load();
+    do {
+      timer->mailNext = head;
+    } while (!mailbox.compare_exchange_weak(head, timer));
+  }
+
+  void TimerShard::drain(uint64 nowUs) {
+    Timer *timer = mailbox.exchange(nullptr);
+    while (timer) {
+      Timer *next = timer->mailNext;
+      // Taken before clearing mailed, which frees it to be posted again.
+      Timer::ptr ref = std::move(timer->mailRef);
+      timer->mailed.store(false);
+      TimerShard *home = timer->home.load();
+      if (home != this) {
+        // Moved since it was posted.
+        if (home) {
+          home->post(timer);
+        }
+      } else {
+        int state = timer->state.load();
+        if (state == Timer::RESETTING) {
+          if (apply(timer)) {
+            insert(ref, nowUs);
+          }
+        } else if (state == Timer::CANCELLED || state == Timer::DISARMED) {
+          erase(timer);
+        }
+      }
+      timer = next;
+    }
+  }
+
+  bool TimerShard::detectClockRollover(uint64 nowUs) {
+    // If the time jumps backward, expire timers (rather than have them expire in distant future or not at all).
+    // We check this way because now() will not roll from 0xffff... to zero since the underlying hardware counter
+    // doesn't count microseconds. Use a threshold value so we don't overreact to minor clock jitter.
+    bool rollover = false;
+    if (nowUs < previousTime && nowUs < previousTime - clockRolloverThreshold) {
+      LOG(INFO) << this << " clock has rolled back from " << previousTime << " to " << nowUs << " expiring all timers";
+      rollover = true;
+    }
+    previousTime = nowUs;
+    return rollover;
+  }
+
+  static void expireWheel(std::unique_ptr<TimingWheel> *wheel, bool rollover, uint64 nowUs,
+    std::vector<Timer::ptr> *expired) {
+    if (rollover) {
+      (*wheel)->clear(expired);
+      wheel->reset(new TimingWheel((*wheel)->tickUs(), nowUs));
+    } else {
+      (*wheel)->advance(nowUs, expired);
+    }
+  }
+
+  void TimerShard::expire(uint64 nowUs, std::vector<span::fibers::Task> *result, std::vector<uint64> *deferred,
+    bool *onTime) {
+    if (empty()) {
+      return;
+    }
+    std::vector<Timer::ptr> expired;
+    bool rollover = detectClockRollover(nowUs);
+    if (wheel) {
+      expireWheel(&wheel, rollover, nowUs, &expired);
+    } else if (!timers.empty() && (rollover || (*timers.begin())->next <= nowUs)) {
+      Timer nowTimer(nowUs);
+      Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+
+      // Find all expired timers
+      std::set<Timer::ptr, Timer::Comparator>::iterator it = rollover ? timers.end() :
+        timers.lower_bound(nowTimerPtr);
+      while (it != timers.end() && (*it)->next == nowUs) {
+        ++it;
+      }
+
+      // Copy to expired, remove from timers.
+      expired.insert(expired.begin(), timers.begin(), it);
+      timers.erase(timers.begin(), it);
+    }
+    if (deadlines) {
+      expireWheel(&deadlines, rollover, nowUs, &expired);
+    }
+    result->reserve(result->size() + expired.size());
+
+    // Look at expired timers and re-register recurring timers (while under the same lock)
+    for (std::vector<Timer::ptr>::iterator it2(expired.begin()); it2 != expired.end(); ++it2) {
+      Timer::ptr &timer = *it2;
+      timer->linked = false;
+      if (timer->state.load() == Timer::ARMED) {
+        if (timer->next != timer->due) {
+          deferred->push_back(timer->due);
+        } else {
+          *onTime = true;
+        }
+      }
+      int state = Timer::ARMED;
+      if (timer->recurring) {
+        if (timer->state.compare_exchange_strong(state, Timer::FIRING)) {
+          LOG(INFO) << timer << " expired and refreshed";
+          result->push_back(timer->dg);
+          timer->setDue(nowUs + timer->us);
+          insert(timer, nowUs);
+          timer->state.store(Timer::ARMED);
+          continue;
+        }
+      } else if (timer->deadline) {
+        if (timer->state.compare_exchange_strong(state, Timer::FIRING)) {
+          LOG(INFO) << timer << " deadline expired";
+          // Stays ready to be armed again.
+          result->push_back(timer->dg);
+          timer->state.store(Timer::DISARMED);
+          continue;
+        }
+      } else if (timer->state.compare_exchange_strong(state, Timer::FIRED)) {
+        LOG(INFO) << timer << " expired";
+        // Last time this runs, so hand over the functor rather than copying it.
+        std::function<void()> dg;
+        dg.swap(timer->dg);
+        result->push_back(std::move(dg));
+        continue;
+      }
+      // Reset since it was due (in which case it goes back in), or cancelled or disarmed.
+      if (state == Timer::RESETTING && apply(timer.get())) {
+        insert(timer, nowUs);
+      }
+    }
+  }
+
+  void TimerShard::clear(std::vector<Timer::ptr> *all) {
+    size_t from = all->size();
+    if (wheel) {
+      wheel->clear(all);
+    }
+    if (deadlines) {
+      deadlines->clear(all);
+    }
+    all->insert(all->end(), timers.begin(), timers.end());
+    timers.clear();
+    for (size_t i = from; i < all->size(); ++i) {
+      (*all)[i]->linked = false;
+    }
+  }
+
+  // This thread's shards, by TimerManager::id.
+  static thread_local std::vector<std::pair<uint64, TimerShard *>> attachedShards;
+  static std::atomic<uint64> nextManagerId(0);
+
+  Timer::Timer(uint64 us, std::function<void()> dg, bool recurring, uint64 slack, TimerManager *manager) :
+    recurring(recurring), deadline(false), us(us), slack(slack), dg(dg), manager(manager), wheelPrev(nullptr),
+    wheelNext(nullptr), wheelSlot(0), state(ARMED), home(nullptr), linked(false), pendingUs(0), pendingStart(0),
+    mailNext(nullptr), mailed(false) {
+    SPAN_ASSERT(dg);
+    setDue(TimerManager::now() + us);
+  }
+
+  Timer::Timer(std::function<void()> dg, TimerManager *manager) : recurring(false), deadline(true), due(~0ull),
+    next(~0ull), us(~0ull), slack(0), dg(dg), manager(manager), wheelPrev(nullptr), wheelNext(nullptr), wheelSlot(0),
+    state(DISARMED), home(nullptr), linked(false), pendingUs(0), pendingStart(0), mailNext(nullptr), mailed(false) {
     SPAN_ASSERT(dg);
-    next = TimerManager::now() + us;
   }
 
-  Timer::Timer(uint64 next) : next(next) {
+  Timer::Timer(uint64 next) : deadline(false), due(next), next(next), slack(0), wheelPrev(nullptr), wheelNext(nullptr),
+    wheelSlot(0), state(ARMED), home(nullptr), linked(false), mailNext(nullptr), mailed(false) {
+  }
+
+  void Timer::setDue(uint64 pdue) {
+    due = pdue;
+    next = pdue;
+    if (slack && pdue <= ~0ull - slack) {
+      // Rounding down to a power of two no bigger than the slack leaves it no earlier than due, and lines it up
+      // with every other timer whose slack takes it past the same boundary.
+      uint64 granularity = 1ull << (63 - __builtin_clzll(slack));
+      next = (pdue + slack) / granularity * granularity;
+    }
+  }
+
+  bool Timer::transition(unsigned from, State to) {
+    int current = state.load();
+    while (true) {
+      if (current == FIRING) {
+        // Only for as long as it takes the thread expiring us to copy dg.
+        std::this_thread::yield();
+        current = state.load();
+        continue;
+      }
+      if (!(from & (1u << current))) {
+        return false;
+      }
+      if (state.compare_exchange_weak(current, to)) {
+        return true;
+      }
+    }
+  }
+
+  bool Timer::claimReset(uint64 pus, uint64 start, unsigned from) {
+    // Held across the claim too, so a racing reset can't pair its duration with our start.
+    absl::MutexLock lock(&pendingMutex);
+    pendingUs = pus;
+    pendingStart = start;
+    return transition(from, RESETTING);
   }
 
   bool Timer::cancel() {
+    SPAN_ASSERT(!deadline);
     LOG(INFO) << this << " cancel";
-    absl::MutexLock lock(&manager->mutex);
-    if (dg) {
-      dg = NULL;
-      std::set<Timer::ptr, Timer::Comparator>::iterator it = manager->timers.find(shared_from_this());
-      SPAN_ASSERT(it != manager->timers.end());
-      manager->timers.erase(it);
-      return true;
+    Timer::ptr self = shared_from_this();
+    if (!transition(1u << ARMED | 1u << RESETTING, CANCELLED)) {
+      return false;
     }
-    return false;
+    // Nobody else touches it once we're CANCELLED.
+    dg = NULL;
+    manager->withdraw(this);
+    return true;
   }
 
   bool Timer::refresh() {
-    {
-      absl::MutexLock lock(&manager->mutex);
-      if (!dg) {
-        return false;
-      }
-      std::set<Timer::ptr, Timer::Comparator>::iterator it = manager->timers.find(shared_from_this());
-      SPAN_ASSERT(it != manager->timers.end());
-      manager->timers.erase(it);
-      next = TimerManager::now() + us;
-      manager->timers.insert(shared_from_this());
+    SPAN_ASSERT(!deadline);
+    uint64 nowUs = TimerManager::now();
+    if (!claimReset(~0ull, nowUs, 1u << ARMED | 1u << RESETTING)) {
+      return false;
     }
+    // Only ever later than it was due, so there's no need to hurry whoever has it.
+    manager->relink(this, nowUs, ~0ull);
     LOG(INFO) << this << " refresh";
     return true;
   }
 
   bool Timer::reset(uint64 pus, bool fromNow) {
-    bool atFront;
+    SPAN_ASSERT(!deadline);
+    uint64 nowUs = TimerManager::now();
+    if (!claimReset(pus, fromNow ? nowUs : ~0ull, 1u << ARMED | 1u << RESETTING)) {
+      return false;
+    }
+    manager->relink(this, nowUs, fromNow ? nowUs + pus : 0);
+    LOG(INFO) << this << " reset to " << pus;
+    return true;
+  }
+
+  void Timer::arm(uint64 pus) {
+    SPAN_ASSERT(deadline);
+    uint64 nowUs = TimerManager::now();
+    bool claimed = claimReset(pus, nowUs, 1u << ARMED | 1u << RESETTING | 1u << DISARMED);
+    SPAN_ASSERT(claimed);
+    manager->relink(this, nowUs, nowUs + pus);
+  }
+
+  bool Timer::disarm() {
+    SPAN_ASSERT(deadline);
+    Timer::ptr self = shared_from_this();
+    if (!transition(1u << ARMED | 1u << RESETTING, DISARMED)) {
+      return false;
+    }
+    manager->withdraw(this);
+    return true;
+  }
+
+  TimerManager::TimerManager() : id(nextManagerId++), wheelTickUs(0), sharded(false), shared(new TimerShard(0, 0)),
+    wakeups(0), expired(0), wakeupsSaved(0) {
+  }
+
+  TimerManager::~TimerManager() noexcept(false) {
+  }
+
+  void TimerManager::useTimingWheel(uint64 tickUs) {
+    SPAN_ASSERT(tickUs);
     {
-      absl::MutexLock lock(&manager->mutex);
-      if (!dg) {
-        return false;
-      }
+      absl::MutexLock lock(&shared->mutex);
+      SPAN_ASSERT(shared->empty() && !wheelTickUs);
+    }
+    wheelTickUs = tickUs;
+    shared.reset(new TimerShard(tickUs, now()));
+    LOG(INFO) << this << " useTimingWheel(" << tickUs << ")";
+  }
 
-      if (pus == us && !fromNow) {
-        return true;
-      }
+  void TimerManager::shardByThread() {
+    absl::MutexLock lock(&shared->mutex);
+    SPAN_ASSERT(shared->empty());
+    sharded.store(true);
+    LOG(INFO) << this << " shardByThread()";
+  }
 
-      std::set<Timer::ptr, Timer::Comparator>::iterator it = manager->timers.find(shared_from_this());
-      SPAN_ASSERT(it != manager->timers.end());
-      manager->timers.erase(it);
-      uint64 start;
+  TimerShard *TimerManager::localShard() {
+    if (sharded.load(std::memory_order_relaxed)) {
+      for (const std::pair<uint64, TimerShard *> &attached : attachedShards) {
+        if (attached.first == id) {
+          return attached.second;
+        }
+      }
+    }
+    return shared.get();
+  }
 
-      if (fromNow) {
-        start = TimerManager::now();
-      } else {
-        start = next - us;
+  void TimerManager::attachThread() {
+    if (!sharded.load() || localShard() != shared.get()) {
+      return;
+    }
+    TimerShard *shard = nullptr;
+    {
+      absl::MutexLock lock(&shardsMutex);
+      for (const std::unique_ptr<TimerShard> &candidate : shards) {
+        if (!candidate->attached) {
+          shard = candidate.get();
+          break;
+        }
+      }
+      if (!shard) {
+        shards.emplace_back(new TimerShard(wheelTickUs, now()));
+        shard = shards.back().get();
       }
-      us = pus;
-      next = start + us;
+      shard->attached = true;
+    }
+    {
+      // Passes on anything posted while it was detached.
+      absl::MutexLock lock(&shard->mutex);
+      shard->drain(now());
+    }
+    attachedShards.emplace_back(id, shard);
+    LOG(INFO) << this << " attachThread(): " << shard;
+  }
 
-      it = manager->timers.insert(shared_from_this()).first;
-      atFront = (it == manager->timers.begin()) && !manager->tickled;
-      if (atFront) {
-        manager->tickled = true;
+  void TimerManager::detachThread() {
+    TimerShard *shard = localShard();
+    if (shard == shared.get()) {
+      return;
+    }
+    for (std::vector<std::pair<uint64, TimerShard *>>::iterator it = attachedShards.begin();
+      it != attachedShards.end(); ++it) {
+      if (it->first == id) {
+        attachedShards.erase(it);
+        break;
       }
     }
-    LOG(INFO) << this << " reset to " << us;
+    bool atFront = false;
+    {
+      uint64 nowUs = now();
+      std::vector<Timer::ptr> all;
+      absl::MutexLock lock(&shard->mutex);
+      shard->drain(nowUs);
+      shard->clear(&all);
+      // So nobody waits on us to pick up what they post.
+      shard->wakeDeadline.store(~0ull);
+      if (!all.empty()) {
+        // Shard then shared is the only order the two are ever locked together in.
+        absl::MutexLock lock2(&shared->mutex);
+        for (const Timer::ptr &timer : all) {
+          atFront = shared->insert(timer, nowUs) || atFront;
+        }
+        atFront = atFront && !shared->tickled;
+        if (atFront) {
+          shared->tickled = true;
+        }
+      }
+    }
+    {
+      absl::MutexLock lock(&shardsMutex);
+      shard->attached = false;
+    }
+    LOG(INFO) << this << " detachThread(): " << shard;
     if (atFront) {
-      manager->onTimerInsertedAtFront();
+      onTimerInsertedAtFront();
     }
-    return true;
   }
 
-  TimerManager::TimerManager() : tickled(false), previousTime(0ull) {
+  void TimerManager::relink(Timer *timer, uint64 nowUs, uint64 earliest) {
+    TimerShard *local = localShard();
+    while (true) {
+      TimerShard *shard = timer->home.load();
+      TimerShard *target = shard == shared.get() ? shard : local;
+      if (shard && shard != target) {
+        // Another thread's: it'll see this before it next goes to sleep. If it's already asleep, that's soon
+        // enough unless the timer is now due before it wakes up.
+        shard->post(timer);
+        if (earliest >= shard->wakeDeadline.load()) {
+          return;
+        }
+        // So take it over.
+        absl::MutexLock lock(&shard->mutex);
+        if (timer->home.load() != shard) {
+          continue;
+        }
+        if (!shard->apply(timer)) {
+          return;
+        }
+        timer->home.store(target);
+      }
+      bool atFront;
+      {
+        absl::MutexLock lock(&target->mutex);
+        TimerShard *home = timer->home.load();
+        if (shard == target || !shard) {
+          if (home != shard) {
+            // Moved (or, never having been armed, armed by someone else) since we looked.
+            continue;
+          }
+          if (!target->apply(timer)) {
+            return;
+          }
+        } else if (home != target || timer->linked) {
+          // Reset again since we took it, by someone who's seen to it.
+          return;
+        }
+        atFront = target->insert(timer->shared_from_this(), nowUs) && target == shared.get() && !target->tickled;
+        if (atFront) {
+          target->tickled = true;
+        }
+      }
+      if (atFront) {
+        onTimerInsertedAtFront();
+      }
+      return;
+    }
   }
 
-  TimerManager::~TimerManager() noexcept(false) {
+  void TimerManager::withdraw(Timer *timer) {
+    TimerShard *local = localShard();
+    while (true) {
+      TimerShard *shard = timer->home.load();
+      if (!shard) {
+        return;
+      }
+      if (shard != local && shard != shared.get()) {
+        shard->post(timer);
+        return;
+      }
+      absl::MutexLock lock(&shard->mutex);
+      if (timer->home.load() == shard) {
+        shard->erase(timer);
+        return;
+      }
+    }
   }
 
-  Timer::ptr TimerManager::registerTimer(uint64 us, std::function<void()> dg, bool recurring) {
+  Timer::ptr TimerManager::registerTimer(uint64 us, std::function<void()> dg, bool recurring, uint64 slackUs) {
     SPAN_ASSERT(dg);
-    Timer::ptr result(new Timer(us, dg, recurring, this));
+    Timer::ptr result(new Timer(us, dg, recurring, slackUs, this));
+    TimerShard *shard = localShard();
     bool atFront;
     {
-      absl::MutexLock lock(&mutex);
-      std::set<Timer::ptr, Timer::Comparator>::iterator it = timers.insert(result).first;
-
-      atFront = (it == timers.begin()) && !tickled;
+      absl::MutexLock lock(&shard->mutex);
+      // A thread's own shard only has it to wake, and it's awake.
+      atFront = shard->insert(result, result->due - us) && shard == shared.get() && !shard->tickled;
       if (atFront) {
-        tickled = true;
+        shard->tickled = true;
       }
     }
-    LOG(INFO) << result.get() << " registerTimer(" << us << ", " << recurring << "): " << atFront;
+    LOG(INFO) << result.get() << " registerTimer(" << us << ", " << recurring << ", " << slackUs << "): " << atFront;
     if (atFront) {
       onTimerInsertedAtFront();
     }
     return result;
   }
 
+  Timer::ptr TimerManager::createDeadline(std::function<void()> dg) {
+    return Timer::ptr(new Timer(dg, this));
+  }
+
   Timer::ptr TimerManager::registerConditionTimer(uint64 pus, std::function<void()> dg,
-    std::weak_ptr<void> weakCond, bool recurring) {
-    return registerTimer(pus, std::bind(stubOnTimer, weakCond, dg), recurring);
+    std::weak_ptr<void> weakCond, bool recurring, uint64 slackUs) {
+    return registerTimer(pus, std::bind(stubOnTimer, weakCond, dg), recurring, slackUs);
   }
 
   static void stubOnTimer(std::weak_ptr<void> weakCond, std::function<void()> dg) {
@@ -214,86 +806,86 @@ namespace span {
   }
 
   uint64 TimerManager::nextTimer() {
-    absl::MutexLock lock(&mutex);
-    tickled = false;
-    if (timers.empty()) {
+    uint64 deadline;
+    {
+      absl::MutexLock lock(&shared->mutex);
+      shared->tickled = false;
+      deadline = shared->nextDeadline();
+      shared->wakeDeadline.store(deadline);
+    }
+    TimerShard *shard = localShard();
+    if (shard != shared.get()) {
+      uint64 nowUs = now();
+      uint64 own;
+      do {
+        absl::MutexLock lock(&shard->mutex);
+        shard->drain(nowUs);
+        own = shard->nextDeadline();
+        shard->wakeDeadline.store(own);
+        // Anyone posting from here on sees when we'll wake, and takes their timer over if that's too late. Those
+        // who got in before may not have, so catch up with them.
+      } while (shard->mailbox.load());
+      deadline = std::min(deadline, own);
+    }
+    if (deadline == ~0ull) {
       LOG(INFO) << this << " nextTimer(): ~0ull";
       return ~0ull;
     }
-    const Timer::ptr &next = *timers.begin();
     uint64 nowUs = now();
     uint64 result;
-    if (nowUs >= next->next) {
+    if (nowUs >= deadline) {
       result = 0;
     } else {
-      result = next->next - nowUs;
+      result = deadline - nowUs;
     }
     LOG(INFO) << this << " nextTimer(): " << result;
     return result;
   }
 
-  bool TimerManager::detectClockRollover(uint64 nowUs) {
-    // If the time jumps backward, expire timers (rather than have them expire in distant future or not at all).
-    // We check this way because now() will not roll from 0xffff... to zero since the underlying hardware counter
-    // doesn't count microseconds. Use a threshold value so we don't overreact to minor clock jitter.
-    bool rollover = false;
-    if (nowUs < previousTime && nowUs < previousTime - clockRolloverThreshold) {
-      LOG(INFO) << this << " clock has rolled back from " << previousTime << " to " << nowUs << " expiring all timers";
-      rollover = true;
-    }
-    previousTime = nowUs;
-    return rollover;
+  std::vector<span::fibers::Task> TimerManager::processTimers() {
+    return processTimers(now());
   }
 
-  std::vector<std::function<void()>> TimerManager::processTimers() {
-    std::vector<Timer::ptr> expired;
-    std::vector<std::function<void()>> result;
-    uint64 nowUs = now();
+  std::vector<span::fibers::Task> TimerManager::processTimers(uint64 nowUs) {
+    std::vector<span::fibers::Task> result;
+    std::vector<uint64> deferred;
+    bool onTime = false;
+    TimerShard *shard = localShard();
+    if (shard != shared.get()) {
+      absl::MutexLock lock(&shard->mutex);
+      shard->drain(nowUs);
+      shard->expire(nowUs, &result, &deferred, &onTime);
+    }
     {
-      absl::MutexLock lock(&mutex);
-      if (timers.empty()) {
-        return result;
-      }
-      bool rollover = detectClockRollover(nowUs);
-      if (!rollover && (*timers.begin())->next > nowUs) {
-        return result;
-      }
-      Timer nowTimer(nowUs);
-      Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-
-      // Find all expired timers
-      std::set<Timer::ptr, Timer::Comparator>::iterator it = rollover ? timers.end() : timers.lower_bound(nowTimerPtr);
-      while (it != timers.end() && (*it)->next == nowUs) {
-        ++it;
-      }
-
-      // Copy to expired, remove from timers.
-      expired.insert(expired.begin(), timers.begin(), it);
-      timers.erase(timers.begin(), it);
-      result.reserve(expired.size());
-
-      // Look at expired timers and re-register recurring timers (while under the same lock)
-      for (std::vector<Timer::ptr>::iterator it2(expired.begin()); it2 != expired.end(); ++it2) {
-        Timer::ptr &timer = *it2;
-        SPAN_ASSERT(timer->dg);
-        result.push_back(timer->dg);
-        if (timer->recurring) {
-          LOG(INFO) << timer << " expired and refreshed";
-          timer->next = nowUs + timer->us;
-          timers.insert(timer);
-        } else {
-          LOG(INFO) << timer << " expired";
-          timer->dg = NULL;
-        }
-      }
+      absl::MutexLock lock(&shared->mutex);
+      shared->expire(nowUs, &result, &deferred, &onTime);
+    }
+    if (!result.empty()) {
+      ++wakeups;
+      expired += result.size();
     }
+    if (!deferred.empty()) {
+      // Each deadline put off to here would have needed a wakeup of its own, except that this one had to happen
+      // anyway if anything was due right now.
+      std::sort(deferred.begin(), deferred.end());
+      size_t distinct = std::unique(deferred.begin(), deferred.end()) - deferred.begin();
+      wakeupsSaved += onTime ? distinct : distinct - 1;
+    }
+    return result;
+  }
+
+  TimerManager::Stats TimerManager::stats() const {
+    Stats result;
+    result.wakeups = wakeups.load();
+    result.expired = expired.load();
+    result.wakeupsSaved = wakeupsSaved.load();
     return result;
   }
 
   void TimerManager::executeTimers() {
-    std::vector<std::function<void()>> expired = processTimers();
+    std::vector<span::fibers::Task> expired = processTimers();
     // Run the callbacks for each expired timer (not under a lock)
-    for (std::vector<std::function<void()>>::iterator it(expired.begin()); it != expired.end(); ++it) {
+    for (std::vector<span::fibers::Task>::iterator it(expired.begin()); it != expired.end(); ++it) {
       (*it)();
     }
   }
@@ -1,22 +1,27 @@
 #ifndef SPAN_SRC_SPAN_TIMER_HH_
 #define SPAN_SRC_SPAN_TIMER_HH_
 
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <memory>
-#include <set>
 #include <vector>
 
 #include "absl/synchronization/mutex.h"
 #include "span/Common.hh"
+#include "span/fibers/Task.hh"
 
 namespace span {
   uint64 muldiv64(uint64 a, uint32 b, uint64 c);
 
   class TimerManager;
+  class TimerShard;
+  class TimingWheel;
 
   class Timer : public std::enable_shared_from_this<Timer> {
     friend class TimerManager;
+    friend class TimerShard;
+    friend class TimingWheel;
 
   public:
     typedef std::shared_ptr<Timer> ptr;
@@ -25,18 +30,71 @@ namespace span {
     bool refresh();
     bool reset(uint64 us, bool fromNow);
 
+    /// For deadlines (TimerManager::createDeadline()): starts counting down @p us from now, restarting if
+    /// already counting. Never allocates.
+    void arm(uint64 us);
+    /// Stops counting down, returning false if it wasn't (or has already fired).
+    bool disarm();
+
   private:
-    Timer(uint64 us, std::function<void()> dg, bool recurring, TimerManager *manager);
+    // Who owns dg and what happens next. Only the thread that moves a timer out of ARMED (or RESETTING) gets to
+    // fire, cancel or reschedule it, whichever shard it's in.
+    enum State {
+      ARMED,
+      // reset(), refresh() or arm() asked for pendingUs/pendingStart, which whoever gets to it first applies.
+      RESETTING,
+      // Expired and having its callback copied out, after which a recurring timer is ARMED and a deadline
+      // DISARMED again.
+      FIRING,
+      FIRED,
+      CANCELLED,
+      DISARMED
+    };
+
+    Timer(uint64 us, std::function<void()> dg, bool recurring, uint64 slack, TimerManager *manager);
+    // Constructor for a disarmed deadline.
+    Timer(std::function<void()> dg, TimerManager *manager);
     // Constructor for Dummy object.
     explicit Timer(uint64 next);
     Timer(const Timer& rhs) = delete;
 
+    // Moves state from any of @p from (a mask of 1 << State) to @p to, waiting out FIRING. False if it was in
+    // none of them.
+    bool transition(unsigned from, State to);
+    // Sets pendingUs and pendingStart (~0ull for either keeps us, or counts from when it was last started), and
+    // moves state from any of @p from to RESETTING as transition() does.
+    bool claimReset(uint64 us, uint64 start, unsigned from);
+    // Sets due, and next to the wakeup point slack lets it share.
+    void setDue(uint64 due);
+
     bool recurring;
+    // Created by createDeadline(): armed and disarmed rather than registered and cancelled.
+    bool deadline;
+    // When it's actually due; next is when it fires, which slack may have put off.
+    uint64 due;
     uint64 next;
     uint64 us;
+    uint64 slack;
     std::function<void()> dg;
     TimerManager *manager;
 
+    // Links for TimingWheel's slot lists, and the reference the wheel holds while we're in one.
+    Timer *wheelPrev, *wheelNext;
+    uint16 wheelSlot;
+    Timer::ptr wheelRef;
+
+    std::atomic<int> state;
+    // The shard we're in, or were last in: whose mutex guards next, us, linked and the links above.
+    std::atomic<TimerShard *> home;
+    bool linked;
+    // What the latest reset asked for, set together with claiming RESETTING.
+    absl::Mutex pendingMutex;
+    uint64 pendingUs, pendingStart;
+    // Link for home's mailbox, and the reference it holds while we're in it.
+    Timer *mailNext;
+    std::atomic<bool> mailed;
+    Timer::ptr mailRef;
+
     struct Comparator {
       bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
     };
@@ -50,38 +108,109 @@ namespace span {
     TimerManager(const TimerManager& rhs) = delete;
     virtual ~TimerManager() noexcept(false);
 
-    virtual Timer::ptr registerTimer(uint64 us, std::function<void()> dg, bool recurring = false);
+    /// @p slackUs is how late the timer may fire, which lets the manager put it off to a wakeup point it
+    /// shares with others: the last multiple of the largest power of two microseconds within the slack.
+    /// For idle and keepalive timeouts, where a few milliseconds don't matter but waking up for each one
+    /// does.
+    virtual Timer::ptr registerTimer(uint64 us, std::function<void()> dg, bool recurring = false,
+      uint64 slackUs = 0);
 
     template<class Rep, class Period>
     Timer::ptr registerTimer(std::chrono::duration<Rep, Period> duration, std::function<void()> dg,
-      bool recurring = false) {
+      bool recurring = false, std::chrono::duration<Rep, Period> slack = std::chrono::duration<Rep, Period>::zero()) {
       auto rescaled = std::chrono::duration_cast<std::chrono::microseconds>(duration);
+      auto rescaledSlack = std::chrono::duration_cast<std::chrono::microseconds>(slack);
 
-      return registerTimer(rescaled.count(), dg, recurring);
+      return registerTimer(rescaled.count(), dg, recurring, rescaledSlack.count());
     }
 
     Timer::ptr registerConditionTimer(uint64 us, std::function<void()> dg, std::weak_ptr<void> weakCond,
-      bool recurring = false);
+      bool recurring = false, uint64 slackUs = 0);
+
+    struct Stats {
+      /// processTimers() calls that expired anything.
+      uint64 wakeups;
+      /// Timers (deadlines included) expired.
+      uint64 expired;
+      /// Distinct deadlines whose timers slack moved onto a later wakeup, each of which would otherwise have
+      /// had one of its own.
+      uint64 wakeupsSaved;
+    };
+    Stats stats() const;
+
+    /// Keeps timers in a hierarchical timing wheel with @p tickUs resolution instead of a sorted set, making
+    /// registering and cancelling O(1) at the cost of timers firing up to a tick late. Must be called before
+    /// any timers are registered.
+    void useTimingWheel(uint64 tickUs);
+
+    /// Gives each thread that calls attachThread() timers of its own, so threads don't contend on one lock
+    /// to register and expire them. Timers registered by an attached thread go in its shard, and cancelling,
+    /// resetting or arming them from any other thread is posted to a lock free queue the owner goes through
+    /// before it next sleeps; one reset to fire before the owner would next wake up moves to the resetting
+    /// thread's shard instead. nextTimer() and processTimers() then cover the calling thread's shard and the
+    /// timers registered by threads that aren't attached. Must be called before any timers are registered.
+    void shardByThread();
+    /// With shardByThread(), gives the calling thread its own shard; IOManager calls it from each thread that
+    /// waits for events. Only for threads that call nextTimer() and processTimers() regularly.
+    void attachThread();
+    /// Hands whatever is left in the calling thread's shard back to be shared, for when it stops processing
+    /// timers.
+    void detachThread();
+
+    /// A timer for timeouts that are set and cleared around every operation and rarely fire: created
+    /// disarmed, then Timer::arm()ed and Timer::disarm()ed as often as needed without allocating, and
+    /// @p dg runs each time it fires. Deadlines always live in a timing wheel (the one from
+    /// useTimingWheel(), or otherwise one with DEADLINE_TICK_US resolution), so may fire up to a tick
+    /// late.
+    Timer::ptr createDeadline(std::function<void()> dg);
+    static const uint64 DEADLINE_TICK_US = 1000;
 
     uint64 nextTimer();
     void executeTimers();
 
     static uint64 now();
+    /// now() as of when this thread's event loop last woke up (see updateLoopTime()), so free to read but
+    /// behind by however long fibers have run since. now() on threads not running one.
+    static uint64 coarseNow();
+    /// now() read from the TSC, where built with `--define clock=tsc` on a CPU whose TSC is invariant.
+    /// It's calibrated against now() over the first 100ms it's used (reading now() until then). The two
+    /// can drift apart by a few parts per million, so use this for timestamps and intervals, not timer
+    /// deadlines.
+    static uint64 preciseNow();
+
+    /// Caches now() as this thread's coarseNow(), returning it. IOManager calls it each time it wakes.
+    static uint64 updateLoopTime();
+    /// Goes back to coarseNow() reading now(), for when this thread's event loop is done.
+    static void clearLoopTime();
 
     // NOTE: This affects all clock instances cause static.
     static void setClock(std::function<uint64()> dg = NULL);
 
   protected:
     virtual void onTimerInsertedAtFront() {}
-    std::vector<std::function<void()>> processTimers();
+    std::vector<span::fibers::Task> processTimers();
+    std::vector<span::fibers::Task> processTimers(uint64 nowUs);
 
   private:
-    bool detectClockRollover(uint64 nowUs);
+    // The calling thread's shard, or shared.
+    TimerShard *localShard();
+    // Puts a timer whose reset the caller has claimed back in place. Unless @p earliest (a lower bound on its
+    // new deadline) comes before the owner of another thread's shard would next look, that's done by posting
+    // to it.
+    void relink(Timer *timer, uint64 nowUs, uint64 earliest);
+    // Takes a timer that's just been cancelled or disarmed out of its shard, or gets its owner to.
+    void withdraw(Timer *timer);
     static std::function<uint64()> clockDg;
-    std::set<Timer::ptr, Timer::Comparator> timers;
-    absl::Mutex mutex;
-    bool tickled;
-    uint64 previousTime;
+    // Tells apart managers in threads' lists of attached shards, which may outlive them.
+    const uint64 id;
+    uint64 wheelTickUs;
+    std::atomic<bool> sharded;
+    // Timers registered by threads without a shard; any thread processes them.
+    std::unique_ptr<TimerShard> shared;
+    absl::Mutex shardsMutex;
+    // Every shard ever attached; those of threads since detached are reused.
+    std::vector<std::unique_ptr<TimerShard>> shards;
+    std::atomic<uint64> wakeups, expired, wakeupsSaved;
   };
 }  // namespace span
 
@@ -0,0 +1,263 @@
+#include "span/TimingWheel.hh"
+
+#include <algorithm>
+#include <vector>
+
+#include "span/exceptions/Assert.hh"
+
+namespace span {
+  static const uint16 kDueSlot = 0xffff;
+  static const uint64 kHorizon = 1ull << (TimingWheel::LEVELS * TimingWheel::LEVEL_BITS);
+
+  // First set bit at or after @p from, or LEVEL_SLOTS if there isn't one.
+  static unsigned firstOccupied(const uint64 *occupied, unsigned from) {
+    for (unsigned word = from / 64; word < TimingWheel::LEVEL_SLOTS / 64; ++word) {
+      uint64 bits = occupied[word];
+      if (word == from / 64) {
+        bits &= ~0ull << (from % 64);
+      }
+      if (bits) {
+        return word * 64 + __builtin_ctzll(bits);
+      }
+    }
+    return TimingWheel::LEVEL_SLOTS;
+  }
+
+  TimingWheel::TimingWheel(uint64 tickUs, uint64 nowUs) : tick(tickUs), current(nowUs / tickUs), size(0),
+    due(nullptr) {
+    SPAN_ASSERT(tickUs);
+    for (Level &level : levels) {
+      std::fill(level.slots, level.slots + LEVEL_SLOTS, nullptr);
+      std::fill(level.occupied, level.occupied + LEVEL_SLOTS / 64, 0);
+      level.size = 0;
+    }
+  }
+
+  TimingWheel::~TimingWheel() {
+    std::vector<Timer::ptr> all;
+    clear(&all);
+  }
+
+  uint64 TimingWheel::tickOf(const Timer *timer) const {
+    // Round up, so nothing fires early.
+    return timer->next / tick + (timer->next % tick ? 1 : 0);
+  }
+
+  void TimingWheel::link(Timer *timer, unsigned level, unsigned slot) {
+    Timer **head;
+    if (level == LEVELS) {
+      head = &due;
+      timer->wheelSlot = kDueSlot;
+    } else {
+      head = &levels[level].slots[slot];
+      timer->wheelSlot = static_cast<uint16>(level * LEVEL_SLOTS + slot);
+      levels[level].occupied[slot / 64] |= 1ull << (slot % 64);
+      ++levels[level].size;
+    }
+    timer->wheelPrev = nullptr;
+    timer->wheelNext = *head;
+    if (*head) {
+      (*head)->wheelPrev = timer;
+    }
+    *head = timer;
+  }
+
+  Timer *TimingWheel::takeSlot(unsigned level, unsigned slot) {
+    Level &l = levels[level];
+    Timer *list = l.slots[slot];
+    l.slots[slot] = nullptr;
+    l.occupied[slot / 64] &= ~(1ull << (slot % 64));
+    for (Timer *timer = list; timer; timer = timer->wheelNext) {
+      --l.size;
+    }
+    return list;
+  }
+
+  void TimingWheel::place(Timer *timer) {
+    uint64 at = tickOf(timer);
+    if (at <= current) {
+      link(timer, LEVELS, 0);
+      return;
+    }
+    uint64 delta = at - current;
+    if (delta >= kHorizon) {
+      // Parked as far out as we reach; expireSlot() puts it back when it gets there.
+      at = current + kHorizon - 1;
+      delta = kHorizon - 1;
+    }
+    unsigned level = 0;
+    while (delta >= (1ull << ((level + 1) * LEVEL_BITS))) {
+      ++level;
+    }
+    link(timer, level, (at >> (level * LEVEL_BITS)) & (LEVEL_SLOTS - 1));
+  }
+
+  void TimingWheel::insert(const Timer::ptr &timer, uint64 nowUs) {
+    SPAN_ASSERT(!timer->wheelRef);
+    timer->wheelRef = timer;
+    ++size;
+    if (timer->next <= nowUs) {
+      link(timer.get(), LEVELS, 0);
+    } else {
+      place(timer.get());
+    }
+  }
+
+  void TimingWheel::erase(Timer *timer) {
+    SPAN_ASSERT(timer->wheelRef);
+    Timer **head;
+    if (timer->wheelSlot == kDueSlot) {
+      head = &due;
+    } else {
+      Level &level = levels[timer->wheelSlot / LEVEL_SLOTS];
+      unsigned slot = timer->wheelSlot % LEVEL_SLOTS;
+      head = &level.slots[slot];
+      --level.size;
+      if (*head == timer && !timer->wheelNext) {
+        level.occupied[slot / 64] &= ~(1ull << (slot % 64));
+      }
+    }
+    if (timer->wheelPrev) {
+      timer->wheelPrev->wheelNext = timer->wheelNext;
+    } else {
+      *head = timer->wheelNext;
+    }
+    if (timer->wheelNext) {
+      timer->wheelNext->wheelPrev = timer->wheelPrev;
+    }
+    timer->wheelPrev = timer->wheelNext = nullptr;
+    --size;
+    // Last, it may be the only thing keeping timer alive.
+    timer->wheelRef.reset();
+  }
+
+  uint64 TimingWheel::nextDeadline() const {
+    if (due) {
+      return 0;
+    }
+    uint64 next = nextTick();
+    return next == ~0ull ? next : next * tick;
+  }
+
+  uint64 TimingWheel::nextTick() const {
+    uint64 best = ~0ull;
+    for (unsigned level = 0; level < LEVELS; ++level) {
+      if (!levels[level].size) {
+        continue;
+      }
+      // Slots are in use for the LEVEL_SLOTS groups after ours, wrapping round to our own index last.
+      unsigned shift = level * LEVEL_BITS;
+      uint64 group = current >> shift;
+      unsigned from = (group + 1) & (LEVEL_SLOTS - 1);
+      unsigned slot = firstOccupied(levels[level].occupied, from);
+      if (slot == LEVEL_SLOTS) {
+        slot = firstOccupied(levels[level].occupied, 0);
+      }
+      SPAN_ASSERT(slot != LEVEL_SLOTS);
+      uint64 ahead = (slot - from) & (LEVEL_SLOTS - 1);
+      best = std::min(best, (group + 1 + ahead) << shift);
+    }
+    return best;
+  }
+
+  void TimingWheel::expireSlot(unsigned slot, std::vector<Timer::ptr> *expired) {
+    Timer *timer = takeSlot(0, slot);
+    while (timer) {
+      Timer *next = timer->wheelNext;
+      if (tickOf(timer) > current) {
+        // Was past the horizon.
+        place(timer);
+      } else {
+        timer->wheelPrev = timer->wheelNext = nullptr;
+        --size;
+        expired->push_back(std::move(timer->wheelRef));
+      }
+      timer = next;
+    }
+  }
+
+  void TimingWheel::expireDue(std::vector<Timer::ptr> *expired) {
+    while (due) {
+      Timer *timer = due;
+      due = timer->wheelNext;
+      timer->wheelPrev = timer->wheelNext = nullptr;
+      --size;
+      expired->push_back(std::move(timer->wheelRef));
+    }
+  }
+
+  void TimingWheel::cascade() {
+    // current has just reached a multiple of LEVEL_SLOTS, and maybe of higher levels' spans too. Bring
+    // down the slots starting here, highest first so nothing lands in a slot we've already emptied.
+    unsigned top = 1;
+    while (top + 1 < LEVELS && !(current & ((1ull << ((top + 1) * LEVEL_BITS)) - 1))) {
+      ++top;
+    }
+    for (unsigned level = top; level >= 1; --level) {
+      Timer *timer = takeSlot(level, (current >> (level * LEVEL_BITS)) & (LEVEL_SLOTS - 1));
+      while (timer) {
+        Timer *next = timer->wheelNext;
+        place(timer);
+        timer = next;
+      }
+    }
+  }
+
+  void TimingWheel::advance(uint64 nowUs, std::vector<Timer::ptr> *expired) {
+    expireDue(expired);
+
+    uint64 target = nowUs / tick;
+    while (current < target) {
+      if (!levels[0].size) {
+        // Nothing to do until the next higher level slot comes round.
+        uint64 next = nextTick();
+        if (next > target) {
+          current = target;
+          break;
+        }
+        current = next - 1;
+      }
+      // Level 0 slots for the rest of this block map one to one onto ticks, so jump to the next one in use.
+      uint64 blockEnd = (current | (LEVEL_SLOTS - 1)) + 1;
+      uint64 last = std::min(target, blockEnd - 1);
+      unsigned from = (current + 1) & (LEVEL_SLOTS - 1);
+      unsigned slot = from ? firstOccupied(levels[0].occupied, from) : LEVEL_SLOTS;
+      if (slot <= (last & (LEVEL_SLOTS - 1)) && from) {
+        current = (current & ~static_cast<uint64>(LEVEL_SLOTS - 1)) | slot;
+        expireSlot(slot, expired);
+        continue;
+      }
+      if (last == target) {
+        current = target;
+        break;
+      }
+      current = blockEnd;
+      cascade();
+      // Anything due exactly now was cascaded onto the due list.
+      expireDue(expired);
+      expireSlot(0, expired);
+    }
+  }
+
+  void TimingWheel::clear(std::vector<Timer::ptr> *all) {
+    auto drain = [this, all](Timer *timer) {
+      while (timer) {
+        Timer *next = timer->wheelNext;
+        timer->wheelPrev = timer->wheelNext = nullptr;
+        --size;
+        all->push_back(std::move(timer->wheelRef));
+        timer = next;
+      }
+    };
+    drain(due);
+    due = nullptr;
+    for (unsigned level = 0; level < LEVELS; ++level) {
+      for (unsigned slot = 0; slot < LEVEL_SLOTS; ++slot) {
+        if (levels[level].slots[slot]) {
+          drain(takeSlot(level, slot));
+        }
+      }
+    }
+    SPAN_ASSERT(!size);
+  }
+}  // namespace span
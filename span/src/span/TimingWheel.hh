@@ -0,0 +1,83 @@
+#ifndef SPAN_SRC_SPAN_TIMINGWHEEL_HH_
+#define SPAN_SRC_SPAN_TIMINGWHEEL_HH_
+
+#include <vector>
+
+#include "span/Common.hh"
+#include "span/Timer.hh"
+
+namespace span {
+  /// Hierarchical timing wheel (Varghese & Lauck), the storage behind TimerManager::useTimingWheel().
+  ///
+  /// Time is cut into ticks of `tickUs`. Level 0 has a slot per tick for the next LEVEL_SLOTS ticks, level 1
+  /// a slot per LEVEL_SLOTS ticks, and so on; a timer goes in the lowest level whose span reaches it. When
+  /// level 0 comes round to the start of a higher level slot, that slot is cascaded down. Slots are
+  /// intrusive lists threaded through the Timers themselves, so inserting and cancelling are O(1) and
+  /// never allocate.
+  ///
+  /// A timer fires on the first tick boundary at or after its deadline (at most one tick late, never
+  /// early), except ones already due when inserted, which fire straight away. Past LEVELS levels
+  /// (2^32 ticks, 49 days at 1ms) timers are parked in the last slot and re-inserted when they get there.
+  ///
+  /// Not thread safe; TimerManager holds its mutex around every call.
+  class TimingWheel {
+  public:
+    static const unsigned LEVELS = 4;
+    static const unsigned LEVEL_BITS = 8;
+    static const unsigned LEVEL_SLOTS = 1 << LEVEL_BITS;
+
+    TimingWheel(uint64 tickUs, uint64 nowUs);
+    TimingWheel(const TimingWheel &rhs) = delete;
+    ~TimingWheel();
+
+    uint64 tickUs() const {
+      return tick;
+    }
+
+    bool empty() const {
+      return !size;
+    }
+
+    /// Takes a reference to timer until it's erased or handed back by advance() or clear().
+    void insert(const Timer::ptr &timer, uint64 nowUs);
+    void erase(Timer *timer);
+
+    /// When something next needs doing: the deadline of the next timer due in the coming LEVEL_SLOTS
+    /// ticks, or the earlier time a higher level needs cascading. 0 if a timer is overdue, ~0ull if the
+    /// wheel is empty.
+    uint64 nextDeadline() const;
+
+    /// Removes every timer due by @p nowUs, appending them to @p expired.
+    void advance(uint64 nowUs, std::vector<Timer::ptr> *expired);
+    /// Removes every timer.
+    void clear(std::vector<Timer::ptr> *all);
+
+  private:
+    struct Level {
+      Timer *slots[LEVEL_SLOTS];
+      // Which slots are non-empty.
+      uint64 occupied[LEVEL_SLOTS / 64];
+      size_t size;
+    };
+
+    uint64 tickOf(const Timer *timer) const;
+    // The next tick with a level 0 slot to expire or a higher level slot to cascade, or ~0ull.
+    uint64 nextTick() const;
+    void link(Timer *timer, unsigned level, unsigned slot);
+    Timer *takeSlot(unsigned level, unsigned slot);
+    void place(Timer *timer);
+    void expireDue(std::vector<Timer::ptr> *expired);
+    void expireSlot(unsigned slot, std::vector<Timer::ptr> *expired);
+    void cascade();
+
+    uint64 tick;
+    // Ticks up to and including this one have been processed.
+    uint64 current;
+    size_t size;
+    Level levels[LEVELS];
+    // Timers that were already due when inserted.
+    Timer *due;
+  };
+}  // namespace span
+
+#endif  // SPAN_SRC_SPAN_TIMINGWHEEL_HH_
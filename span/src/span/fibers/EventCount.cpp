@@ -0,0 +1,93 @@
+#include <thread>
+
+#include "span/fibers/EventCount.hh"
+#include "span/exceptions/Assert.hh"
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace span {
+  namespace fibers {
+    static const uint64 kWaiter = 1;
+    static const uint64 kWaiterMask = 0xffffffffull;
+    static const uint64 kEpoch = 1ull << 32;
+    static const int kEpochShift = 32;
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+    // The futex is the epoch half of `state`.
+    static uint32 *epochOf(std::atomic<uint64> *state) {
+      static_assert(sizeof(std::atomic<uint64>) == sizeof(uint64), "atomic<uint64> must be lock free");
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return reinterpret_cast<uint32 *>(state) + 1;
+#else
+      return reinterpret_cast<uint32 *>(state);
+#endif
+    }
+#endif
+
+    EventCount::Key EventCount::prepareWait() {
+      uint64 prev = state.fetch_add(kWaiter, std::memory_order_seq_cst);
+      return static_cast<Key>(prev >> kEpochShift);
+    }
+
+    void EventCount::cancelWait() {
+      uint64 prev = state.fetch_sub(kWaiter, std::memory_order_seq_cst);
+      SPAN_ASSERT((prev & kWaiterMask) != 0);
+    }
+
+    void EventCount::wait(Key key) {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      while ((state.load(std::memory_order_acquire) >> kEpochShift) == key) {
+        int rc = syscall(SYS_futex, epochOf(&state), FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+        SPAN_ASSERT(rc == 0 || errno == EAGAIN || errno == EINTR);
+      }
+#else
+      {
+        absl::MutexLock lock(&mutex);
+        while ((state.load(std::memory_order_acquire) >> kEpochShift) == key) {
+          cond.Wait(&mutex);
+        }
+      }
+#endif
+      uint64 prev = state.fetch_sub(kWaiter, std::memory_order_seq_cst);
+      SPAN_ASSERT((prev & kWaiterMask) != 0);
+    }
+
+    void EventCount::notify() {
+      doNotify(1);
+    }
+
+    void EventCount::notifyAll() {
+      doNotify(INT_MAX);
+    }
+
+    void EventCount::doNotify(int count) {
+      // Pairs with the fetch_add in prepareWait(): either the waiter sees whatever we
+      // changed before notifying, or we see the waiter.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if ((state.load(std::memory_order_relaxed) & kWaiterMask) == 0) {
+        return;
+      }
+      state.fetch_add(kEpoch, std::memory_order_release);
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      syscall(SYS_futex, epochOf(&state), FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+      absl::MutexLock lock(&mutex);
+      if (count == 1) {
+        cond.Signal();
+      } else {
+        cond.SignalAll();
+      }
+#endif
+    }
+
+    size_t AdaptiveSpin::defaultMaxSpins() {
+      return std::thread::hardware_concurrency() > 1 ? 1000 : 0;
+    }
+  }  // namespace fibers
+}  // namespace span
@@ -0,0 +1,106 @@
+#ifndef SPAN_SRC_SPAN_FIBERS_EVENTCOUNT_HH_
+#define SPAN_SRC_SPAN_FIBERS_EVENTCOUNT_HH_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "span/Common.hh"
+
+#if UNIX_FLAVOUR != UNIX_FLAVOUR_LINUX
+#include "absl/synchronization/mutex.h"
+#endif
+
+namespace span {
+  namespace fibers {
+    /// Lets threads sleep until "something changed", without a lost wakeup.
+    ///
+    /// Unlike a Semaphore, notifications aren't counted; a waiter registers with
+    /// prepareWait(), re-checks whatever it's waiting for, and then either cancelWait()s
+    /// or wait()s. Any notify() after prepareWait() makes wait() return. notify() is just
+    /// an atomic load when nobody is waiting, and wakes exactly one waiter when someone is.
+    ///
+    /// On Linux this is a futex, elsewhere a mutex and condition variable.
+    class EventCount {
+    public:
+      typedef uint32 Key;
+
+      EventCount() : state(0) {}
+      EventCount(const EventCount &rhs) = delete;
+
+      Key prepareWait();
+      void cancelWait();
+      void wait(Key key);
+
+      void notify();
+      void notifyAll();
+
+    private:
+      void doNotify(int count);
+
+      // Waiters in the low 32 bits, epoch in the high 32 bits.
+      std::atomic<uint64> state;
+#if UNIX_FLAVOUR != UNIX_FLAVOUR_LINUX
+      absl::Mutex mutex;
+      absl::CondVar cond;
+#endif
+    };
+
+    /// Busy waits for a little while before a thread gives up and sleeps.
+    ///
+    /// Spinning stops as soon as the predicate is true. The number of spins adapts: it grows
+    /// while spinning keeps paying off, and halves every time it doesn't, so threads on a
+    /// quiet process end up parking almost straight away.
+    class AdaptiveSpin {
+    public:
+      explicit AdaptiveSpin(size_t maxSpins = defaultMaxSpins()) : max(maxSpins), current(maxSpins) {}
+
+      /// Spin until `ready()` is true or we run out of spins, returning `ready()`.
+      template<class Predicate>
+      bool spin(Predicate ready);
+
+      /// Upper bound on spins, 0 disables spinning.
+      void maxSpins(size_t spins) {
+        max = spins;
+        current = spins;
+      }
+      size_t maxSpins() const {
+        return max;
+      }
+
+      /// 0 on a single CPU (spinning can only delay whoever we're waiting on), 1000 otherwise.
+      static size_t defaultMaxSpins();
+
+    private:
+      std::atomic<size_t> max;
+      std::atomic<size_t> current;
+    };
+
+    inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield" ::: "memory");
+#endif
+    }
+
+    template<class Predicate>
+    inline bool AdaptiveSpin::spin(Predicate ready) {
+      size_t limit = max.load(std::memory_order_relaxed);
+      size_t spins = current.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < spins; ++i) {
+        if (ready()) {
+          current.store(std::min(limit, spins * 2), std::memory_order_relaxed);
+          return true;
+        }
+        cpuRelax();
+      }
+      // Never drop below a token amount, or we'd never find out spinning is worth it again.
+      current.store(std::max(spins / 2, std::min<size_t>(limit, 16)), std::memory_order_relaxed);
+      return ready();
+    }
+  }  // namespace fibers
+}  // namespace span
+
+#endif  // SPAN_SRC_SPAN_FIBERS_EVENTCOUNT_HH_
@@ -1,4 +1,11 @@
+#include <algorithm>
 #include <atomic>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 
 #ifdef HAVE_VALGRIND
@@ -7,9 +14,11 @@
 
 #include "span/Common.hh"
 #include "span/exceptions/Assert.hh"
+#include "span/exceptions/Demangle.hh"
 #include "span/fibers/Fiber.hh"
 
 #include "absl/synchronization/mutex.h"
+#include "glog/logging.h"
 
 #if PLATFORM == PLATFORM_DARWIN
 #define setjmp _setjmp
@@ -53,14 +62,28 @@ namespace span {
       return indices;
     }
 
+    // Keyed on the type of the initial function, and for plain function pointers
+    // the function itself (since they all share one type).
+    typedef std::pair<const std::type_info *, void *> StackUsageKey;
+
+    static ::absl::Mutex & globalStackUsageMutex() {
+      static ::absl::Mutex mutex;
+      return mutex;
+    }
+
+    static std::map<StackUsageKey, Fiber::StackUsage> & globalStackUsage() {
+      static std::map<StackUsageKey, Fiber::StackUsage> usage;
+      return usage;
+    }
+
     Fiber::Fiber() : sp(stackId()), currentState(EXEC) {
       SPAN_ASSERT(!fiber);
       setThis(this);
     }
 
-    Fiber::Fiber(std::function<void()> dg, size_t stackSize) :
+    Fiber::Fiber(Task dg, size_t stackSize) :
       base::FiberBase(stackSize ? stackSize : DEFAULT_STACK_SIZE),
-      dg(dg),
+      dg(std::move(dg)),
       sp(stackId()),
       currentState(INIT) {
     }
@@ -89,11 +112,11 @@ namespace span {
       }
     }
 
-    void Fiber::reset(std::function<void()> pDg) {
+    void Fiber::reset(Task pDg) {
       exception = std::exception_ptr();
       SPAN_ASSERT(stackPtr() != nullptr);
       SPAN_ASSERT(currentState == TERM || currentState == INIT || currentState == EXCEPT);
-      dg = pDg;
+      dg = std::move(pDg);
       base::FiberBase::reset();
       currentState = INIT;
     }
@@ -226,6 +249,8 @@ namespace span {
       }
       SPAN_ASSERT(cur->dg);
       State nextState = TERM;
+      const std::type_info &type = cur->dg.target_type();
+      void *function = cur->dg.functionPointer();
       try {
         if (cur->currentState == EXCEPT) {
           SPAN_ASSERT(cur->exception);
@@ -239,6 +264,11 @@ namespace span {
         nextState = EXCEPT;
       }
 
+      size_t highWaterMark = cur->stackHighWaterMark();
+      if (highWaterMark) {
+        recordStackUsage(type, function, cur->stackSize(), highWaterMark);
+      }
+
       exitpoint(&cur, nextState);
     }
 
@@ -275,6 +305,46 @@ namespace span {
       }
     }
 
+    void Fiber::stackTelemetry(bool enable) {
+      base::FiberBase::paintStacks(enable);
+    }
+
+    void Fiber::recordStackUsage(const std::type_info &type, void *function, size_t stackSize,
+      size_t highWaterMark) {
+      LOG(INFO) << "fiber " << span::exceptions::demangle(type) << " " << function << " used "
+        << highWaterMark << "/" << stackSize << " bytes of stack";
+      absl::MutexLock lock(&globalStackUsageMutex());
+      Fiber::StackUsage &usage = globalStackUsage()[StackUsageKey(&type, function)];
+      ++usage.fibers;
+      usage.stackSize = std::max(usage.stackSize, stackSize);
+      usage.highWaterMark = std::max(usage.highWaterMark, highWaterMark);
+    }
+
+    std::vector<Fiber::StackUsage> Fiber::stackUsage() {
+      std::vector<StackUsage> result;
+      {
+        absl::MutexLock lock(&globalStackUsageMutex());
+        for (const auto &entry : globalStackUsage()) {
+          result.push_back(entry.second);
+          std::ostringstream name;
+          name << span::exceptions::demangle(*entry.first.first);
+          if (entry.first.second) {
+            name << " " << entry.first.second;
+          }
+          result.back().entrypoint = name.str();
+        }
+      }
+      std::sort(result.begin(), result.end(), [](const StackUsage &lhs, const StackUsage &rhs) {
+        return lhs.highWaterMark > rhs.highWaterMark;
+      });
+      return result;
+    }
+
+    void Fiber::clearStackUsage() {
+      absl::MutexLock lock(&globalStackUsageMutex());
+      globalStackUsage().clear();
+    }
+
 #if PLATFORM == PLATFORM_WIN32
 static bool globalDoesntHaveOSFLS;
 #endif
@@ -5,9 +5,11 @@
 #include <functional>
 #include <memory>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
 #include "span/Common.hh"
+#include "span/fibers/Task.hh"
 
 #if PLATFORM == PLATFORM_WIN32
 #error Your platform (architecture and compiler) is NOT supported for Fibers. Yell at someone to add WindowsFiber.
@@ -44,8 +46,11 @@ namespace span {
       //    memory; physical/paging memory is not allocated until the actual pages are touched
       //    by the fiber executing.
       //
+      // Stacks come from base::StackPool, so they are recycled across fibers, and have a
+      // guard page below them.
+      //
       // Afterwards the state is INIT.
-      explicit Fiber(std::function<void()> dg, size_t stackSize = 0);
+      explicit Fiber(Task dg, size_t stackSize = 0);
       ~Fiber() noexcept(false);
 
       // Resets a Fiber to be used again, but with a different function.
@@ -53,7 +58,7 @@ namespace span {
       // * `dg` - The new initial function.
       //
       // The pre state should be one of INIT/TERM/EXCEPT, post state will be INIT.
-      void reset(std::function<void()> dg);
+      void reset(Task dg);
 
       // Get the current executing Fiber.
       static ptr getThis();
@@ -107,6 +112,30 @@ namespace span {
       // The Current Execution State of this Fiber.
       State state();
 
+      // Stack usage for every fiber that ran a given entry point.
+      struct StackUsage {
+        // Demangled type of the initial function (plus its address for plain function pointers).
+        std::string entrypoint;
+        // How many terminated fibers were measured.
+        size_t fibers;
+        // Largest stack any of those fibers had.
+        size_t stackSize;
+        // Deepest any of those fibers went, in bytes.
+        size_t highWaterMark;
+      };
+
+      // Turns stack high-water-mark telemetry on or off.
+      //
+      // While on, stacks are painted before every run, and each fiber's high-water mark
+      // is recorded against its entry point when it terminates. Painting commits every
+      // page of every stack, so this is meant for measuring what stack sizes to use,
+      // not for production.
+      static void stackTelemetry(bool enable);
+
+      // Snapshot of everything recorded by stackTelemetry(), deepest first.
+      static std::vector<StackUsage> stackUsage();
+      static void clearStackUsage();
+
     private:
       // Create a Fiber for the current executing thread.
       //
@@ -120,10 +149,12 @@ namespace span {
 
       virtual void entrypoint();
       static void exitpoint(Fiber::ptr *cur, State targetState);
+      static void recordStackUsage(const std::type_info &type, void *function, size_t stackSize,
+        size_t highWaterMark);
 
       Fiber(const Fiber& rhs) = delete;
 
-      std::function<void()> dg;
+      Task dg;
       void *sp;
       State currentState, yielderNextState;
       ptr outer, yielder;
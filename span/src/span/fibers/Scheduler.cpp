@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <deque>
 #include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include "span/fibers/Scheduler.hh"
@@ -13,10 +15,23 @@ namespace span {
   namespace fibers {
     thread_local Scheduler* Scheduler::threadLocalScheduler = nullptr;
     thread_local Fiber* Scheduler::threadLocalFiber = nullptr;
+    thread_local Scheduler::WorkerQueue* Scheduler::threadLocalQueue = nullptr;
+
+    // Every this many pops a worker takes its oldest item instead of its newest,
+    // so a fiber that keeps rescheduling work can't starve what's behind it.
+    static const size_t kFairnessInterval = 61;
 
     Scheduler::Scheduler(size_t threads, bool useCaller, size_t pBatchSize)
-      : activeThreadCount(0), idleThreadCount(0), stopping(true), autoStop(false), batchSize(pBatchSize) {
+      : sharedCount(0), queueCount(0), nextInbox(0), nextUnpark(0), pendingCount(0), activeThreadCount(0),
+        idleThreadCount(0), stopping(true), autoStop(false), batchSize(pBatchSize) {
       SPAN_ASSERT(threads >= 1);
+      for (size_t i = 0; i < MAX_WORKER_QUEUES; ++i) {
+        queues[i] = nullptr;
+      }
+      stackClassSizes[TINY_STACK] = 16 * 1024;
+      stackClassSizes[SMALL_STACK] = 64 * 1024;
+      stackClassSizes[MEDIUM_STACK] = 256 * 1024;
+      stackClassSizes[LARGE_STACK] = 1024 * 1024;
 
       if (useCaller) {
         --threads;
@@ -36,6 +51,12 @@ namespace span {
       if (getThis() == this) {
         threadLocalScheduler = NULL;
       }
+      if (threadLocalQueue && threadLocalQueue->owner == this) {
+        threadLocalQueue = nullptr;
+      }
+      for (size_t i = 0; i < queueCount; ++i) {
+        delete queues[i].load();
+      }
     }
 
     Scheduler * Scheduler::getThis() {
@@ -63,8 +84,63 @@ namespace span {
     }
 
     bool Scheduler::hasWorkToDo() {
-      absl::MutexLock lock(&mutex);
-      return !fibers.empty();
+      return pendingCount != 0;
+    }
+
+    bool Scheduler::hasRunnableWork() {
+      WorkerQueue *queue = localQueue();
+      if (queue && (queue->mailboxSize != 0 || queue->size != 0 || queue->inboxSize != 0)) {
+        return true;
+      }
+      if (sharedCount != 0) {
+        return true;
+      }
+      size_t count = queueCount.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; ++i) {
+        WorkerQueue *victim = queues[i].load(std::memory_order_relaxed);
+        if (victim != queue && victim->active && (victim->size != 0 || victim->inboxSize != 0)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void Scheduler::tickleThread(std::thread::id) {
+      tickle();
+    }
+
+    void Scheduler::parkIdle() {
+      WorkerQueue *queue = localQueue();
+      SPAN_ASSERT(queue);
+      // Before checking, so a wake for anything we miss isn't skipped as already done.
+      queue->unparked = false;
+      EventCount::Key key = queue->parked.prepareWait();
+      // Anything scheduled from here on will wake us.
+      if (Stopping() || hasRunnableWork()) {
+        queue->parked.cancelWait();
+      } else {
+        queue->parked.wait(key);
+      }
+    }
+
+    void Scheduler::unparkIdle() {
+      size_t count = queueCount.load(std::memory_order_acquire);
+      size_t start = nextUnpark++;
+      for (size_t i = 0; i < count; ++i) {
+        WorkerQueue *queue = queues[(start + i) % count].load(std::memory_order_relaxed);
+        if (queue->active && queue->idle && !queue->unparked && !queue->unparked.exchange(true)) {
+          queue->parked.notify();
+          return;
+        }
+      }
+    }
+
+    void Scheduler::unparkThread(std::thread::id thread) {
+      WorkerQueue *queue = findQueue(thread);
+      if (queue) {
+        queue->unparked = true;
+        queue->parked.notify();
+      }
     }
 
     void Scheduler::stop() {
@@ -132,8 +208,7 @@ namespace span {
     }
 
     bool Scheduler::Stopping() {
-      absl::MutexLock _lock(&mutex);
-      return stopping && fibers.empty() && activeThreadCount == 0;
+      return stopping && pendingCount == 0 && activeThreadCount == 0;
     }
 
     void Scheduler::switchTo(std::thread::id thread) {
@@ -163,8 +238,15 @@ namespace span {
     }
 
     void Scheduler::yield() {
-      SPAN_ASSERT(Scheduler::getThis());
-      Scheduler::getThis()->schedule(Fiber::getThis());
+      Scheduler *self = Scheduler::getThis();
+      SPAN_ASSERT(self);
+      WorkerQueue *queue = self->localQueue();
+      if (queue) {
+        // Behind everything else this thread has queued, or we'd just run again.
+        self->enqueueLocal(queue, FiberAndThread(Fiber::getThis(), std::thread::id()), true);
+      } else {
+        self->schedule(Fiber::getThis());
+      }
       yieldTo();
     }
 
@@ -209,6 +291,340 @@ namespace span {
       threadLocalFiber->yieldTo(yieldToCallerOnTerminate);
     }
 
+    Scheduler::WorkerQueue *Scheduler::localQueue() {
+      WorkerQueue *queue = threadLocalQueue;
+      if (queue && queue->owner == this) {
+        return queue;
+      }
+      return nullptr;
+    }
+
+    Scheduler::WorkerQueue *Scheduler::findQueue(std::thread::id thread) {
+      if (thread == std::thread::id()) {
+        return nullptr;
+      }
+      size_t count = queueCount.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; ++i) {
+        WorkerQueue *queue = queues[i].load(std::memory_order_relaxed);
+        if (queue->thread == thread) {
+          return queue;
+        }
+      }
+      return nullptr;
+    }
+
+    Scheduler::WorkerQueue *Scheduler::queueFor(std::thread::id thread) {
+      WorkerQueue *queue = findQueue(thread);
+      if (queue) {
+        return queue;
+      }
+      absl::MutexLock lock(&mutex);
+      // Someone may have beaten us to it.
+      queue = findQueue(thread);
+      if (queue) {
+        return queue;
+      }
+      size_t count = queueCount.load(std::memory_order_relaxed);
+      // One a thread that has stopped running left behind.
+      for (size_t i = 0; i < count; ++i) {
+        queue = queues[i].load(std::memory_order_relaxed);
+        absl::MutexLock mailboxLock(&queue->mailboxMutex);
+        if (queue->thread.load() == std::thread::id()) {
+          queue->unparked = false;
+          queue->thread = thread;
+          return queue;
+        }
+      }
+      if (count == MAX_WORKER_QUEUES) {
+        throw std::runtime_error("Too many threads are using this scheduler.");
+      }
+      queue = new WorkerQueue(this, thread);
+      queues[count].store(queue, std::memory_order_relaxed);
+      queueCount.store(count + 1, std::memory_order_release);
+      return queue;
+    }
+
+    Scheduler::WorkerQueue *Scheduler::attachQueue() {
+      WorkerQueue *queue = queueFor(std::this_thread::get_id());
+      queue->idle = false;
+      queue->active = true;
+      threadLocalQueue = queue;
+      return queue;
+    }
+
+    void Scheduler::detachQueue(WorkerQueue *queue) {
+      threadLocalQueue = nullptr;
+      std::deque<FiberAndThread> leftovers;
+      {
+        // Once inactive, nothing else lands in the inbox.
+        absl::MutexLock lock(&queue->inboxMutex);
+        queue->active = false;
+        leftovers.swap(queue->inbox);
+        queue->inboxSize = 0;
+      }
+      {
+        absl::MutexLock lock(&queue->mutex);
+        for (FiberAndThread &ft : queue->tasks) {
+          leftovers.push_back(std::move(ft));
+        }
+        queue->tasks.clear();
+        queue->size = 0;
+      }
+      {
+        // With nothing waiting for this thread to come back, the queue can go to another; otherwise the
+        // mailbox is left alone until it does.
+        absl::MutexLock lock(&mutex);
+        absl::MutexLock mailboxLock(&queue->mailboxMutex);
+        if (queue->mailbox.empty()) {
+          queue->thread = std::thread::id();
+        }
+      }
+      if (leftovers.empty()) {
+        return;
+      }
+      {
+        absl::MutexLock lock(&mutex);
+        for (FiberAndThread &ft : leftovers) {
+          fibers.push_back(std::move(ft));
+        }
+        sharedCount += leftovers.size();
+      }
+      tickle();
+    }
+
+    bool Scheduler::enqueueShared(FiberAndThread &&ft) {
+      absl::MutexLock lock(&mutex);
+      bool tickleMe = fibers.empty();
+      fibers.push_back(std::move(ft));
+      ++sharedCount;
+      ++pendingCount;
+      return tickleMe;
+    }
+
+    bool Scheduler::enqueueLocal(WorkerQueue *queue, FiberAndThread &&ft, bool front) {
+      absl::MutexLock lock(&queue->mutex);
+      // We'll get to it ourselves; only worth waking someone if they're idle and could steal it.
+      bool tickleMe = queue->tasks.empty() && idleThreadCount != 0;
+      if (front) {
+        queue->tasks.push_front(std::move(ft));
+      } else {
+        queue->tasks.push_back(std::move(ft));
+      }
+      ++queue->size;
+      ++pendingCount;
+      return tickleMe;
+    }
+
+    bool Scheduler::enqueueMailbox(WorkerQueue *queue, FiberAndThread &&ft, bool front) {
+      std::thread::id thread = ft.thread;
+      bool tickleMe;
+      while (true) {
+        {
+          absl::MutexLock lock(&queue->mailboxMutex);
+          // Unless its thread stopped running and gave it up since we looked it up.
+          if (queue->thread.load() == thread) {
+            tickleMe = queue->mailbox.empty() && thread != std::this_thread::get_id();
+            if (front) {
+              queue->mailbox.push_front(std::move(ft));
+            } else {
+              queue->mailbox.push_back(std::move(ft));
+            }
+            ++queue->mailboxSize;
+            ++pendingCount;
+            break;
+          }
+        }
+        queue = queueFor(thread);
+      }
+      // Waking whoever happens to be next in line won't help.
+      if (tickleMe && shouldTickle(true)) {
+        tickleThread(thread);
+      }
+      return false;
+    }
+
+    bool Scheduler::enqueue(FiberAndThread &&ft) {
+      if (ft.thread != std::thread::id()) {
+        // Pinned work can only ever run on one thread, so it goes straight to that thread.
+        return enqueueMailbox(queueFor(ft.thread), std::move(ft), false);
+      }
+      WorkerQueue *local = localQueue();
+      if (local) {
+        return enqueueLocal(local, std::move(ft), false);
+      }
+      // From outside the scheduler; spread over the running threads, preferring idle ones.
+      WorkerQueue *target = nullptr;
+      size_t count = queueCount.load(std::memory_order_acquire);
+      size_t start = nextInbox++;
+      for (size_t i = 0; i < count; ++i) {
+        WorkerQueue *queue = queues[(start + i) % count].load(std::memory_order_relaxed);
+        if (!queue->active) {
+          continue;
+        }
+        if (!target) {
+          target = queue;
+        }
+        if (queue->idle) {
+          target = queue;
+          break;
+        }
+      }
+      if (target) {
+        absl::MutexLock lock(&target->inboxMutex);
+        if (target->active) {
+          bool tickleMe = target->inboxSize == 0 && target->size == 0;
+          target->inbox.push_back(std::move(ft));
+          ++target->inboxSize;
+          ++pendingCount;
+          return tickleMe;
+        }
+      }
+      return enqueueShared(std::move(ft));
+    }
+
+    void Scheduler::requeue(WorkerQueue *queue, FiberAndThread &&ft) {
+      if (ft.thread != std::thread::id()) {
+        enqueueMailbox(queue, std::move(ft), true);
+      } else {
+        enqueueLocal(queue, std::move(ft), true);
+      }
+    }
+
+    void Scheduler::drainInbox(WorkerQueue *queue) {
+      if (queue->inboxSize.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+      std::deque<FiberAndThread> incoming;
+      {
+        absl::MutexLock lock(&queue->inboxMutex);
+        incoming.swap(queue->inbox);
+        queue->inboxSize = 0;
+      }
+      absl::MutexLock lock(&queue->mutex);
+      // Newest at the back, pushed backwards so the oldest is popped first.
+      for (auto it = incoming.rbegin(); it != incoming.rend(); ++it) {
+        queue->tasks.push_back(std::move(*it));
+      }
+      queue->size += incoming.size();
+    }
+
+    void Scheduler::takeMailbox(WorkerQueue *queue, std::vector<FiberAndThread> *batch) {
+      if (queue->mailboxSize.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+      absl::MutexLock lock(&queue->mailboxMutex);
+      while (batch->size() < batchSize && !queue->mailbox.empty()) {
+        batch->push_back(std::move(queue->mailbox.front()));
+        queue->mailbox.pop_front();
+        --queue->mailboxSize;
+        --pendingCount;
+      }
+    }
+
+    void Scheduler::takeShared(std::vector<FiberAndThread> *batch, bool *tickleMe) {
+      if (sharedCount.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+      absl::MutexLock lock(&mutex);
+      while (!fibers.empty()) {
+        // We were just checking if there is more work; there is so set the flag
+        // and don't actually take this piece of work.
+        if (batch->size() == batchSize) {
+          *tickleMe = true;
+          break;
+        }
+        batch->push_back(std::move(fibers.front()));
+        fibers.pop_front();
+        --sharedCount;
+        --pendingCount;
+      }
+    }
+
+    void Scheduler::steal(WorkerQueue *queue, std::vector<FiberAndThread> *batch) {
+      size_t count = queueCount.load(std::memory_order_acquire);
+      size_t start = reinterpret_cast<uintptr_t>(queue) / sizeof(WorkerQueue);
+      for (size_t i = 0; i < count && batch->size() < batchSize; ++i) {
+        WorkerQueue *victim = queues[(start + i) % count].load(std::memory_order_relaxed);
+        if (victim == queue || !victim->active) {
+          continue;
+        }
+        if (victim->idle && victim->mailboxSize.load(std::memory_order_relaxed) != 0) {
+          // Only its owner can run that; make sure it's awake to do so.
+          std::thread::id thread = victim->thread;
+          LOG(INFO) << this << " thread " << thread << " has pinned work waiting";
+          tickleThread(thread);
+        }
+        if (victim->size.load(std::memory_order_relaxed) != 0) {
+          absl::MutexLock lock(&victim->mutex);
+          // Take up to half of what's there, oldest first.
+          size_t want = std::min(batchSize - batch->size(), (victim->tasks.size() + 1) / 2);
+          while (want-- && !victim->tasks.empty()) {
+            batch->push_back(std::move(victim->tasks.front()));
+            victim->tasks.pop_front();
+            --victim->size;
+            --pendingCount;
+          }
+          continue;
+        }
+        if (victim->inboxSize.load(std::memory_order_relaxed) != 0) {
+          absl::MutexLock lock(&victim->inboxMutex);
+          while (batch->size() < batchSize && !victim->inbox.empty()) {
+            batch->push_back(std::move(victim->inbox.front()));
+            victim->inbox.pop_front();
+            --victim->inboxSize;
+            --pendingCount;
+          }
+        }
+      }
+    }
+
+    void Scheduler::takeWork(WorkerQueue *queue, std::vector<FiberAndThread> *batch, bool *tickleMe,
+      bool *dontIdle) {
+      static thread_local size_t ticks = 0;
+      // Pinned work first, nobody else can take it off our hands.
+      takeMailbox(queue, batch);
+      drainInbox(queue);
+      if (batch->size() < batchSize && queue->size.load(std::memory_order_relaxed) != 0) {
+        absl::MutexLock lock(&queue->mutex);
+        while (batch->size() < batchSize && !queue->tasks.empty()) {
+          if (++ticks % kFairnessInterval == 0) {
+            batch->push_back(std::move(queue->tasks.front()));
+            queue->tasks.pop_front();
+          } else {
+            batch->push_back(std::move(queue->tasks.back()));
+            queue->tasks.pop_back();
+          }
+          --queue->size;
+          --pendingCount;
+        }
+      }
+      if (batch->empty()) {
+        takeShared(batch, tickleMe);
+      }
+      if (batch->empty()) {
+        steal(queue, batch);
+      }
+      // More than we can take; wake an idle peer to take some. It does the same, so a single
+      // tickle for a burst of work ends up waking as many threads as there's work for.
+      if (!batch->empty() && idleThreadCount != 0 && hasRunnableWork()) {
+        *tickleMe = true;
+      }
+
+      // A fiber that is still executing was probably scheduled just before it
+      // yielded on another thread, put it back til it's done yielding.
+      for (std::vector<FiberAndThread>::iterator it(batch->begin()); it != batch->end();) {
+        SPAN_ASSERT(it->fiber || it->dg);
+        if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+          LOG(INFO) << this << " skipping executing fiber: " << it->fiber;
+          requeue(queue, std::move(*it));
+          it = batch->erase(it);
+          *dontIdle = true;
+        } else {
+          ++it;
+        }
+      }
+    }
+
     void Scheduler::run() {
       setThis();
       if (std::this_thread::get_id() != rootThread) {
@@ -218,90 +634,25 @@ namespace span {
         // Hijacked a Thread.
         SPAN_ASSERT(threadLocalFiber == Fiber::getThis().get());
       }
+      WorkerQueue *queue = attachQueue();
       Fiber::ptr idleFiber(new Fiber(std::bind(&Scheduler::idle, this)));
       LOG(INFO) << this << " starting thread with idle fiber " << idleFiber;
-      Fiber::ptr dgFiber;
+      // One recycled fiber per stack class for running functors.
+      Fiber::ptr dgFibers[STACK_CLASSES];
       // Use a vector for an O(1) .size()
       std::vector<FiberAndThread> batch;
       batch.reserve(batchSize);
-      bool isActive = false;
       while (true) {
         SPAN_ASSERT(batch.empty());
         bool dontIdle = false;
         bool tickleMe = false;
-        {
-          absl::MutexLock _lock(&mutex);
-          // Kill ourselves off if needeed.
-          if (threads.size() > threadCount && std::this_thread::get_id() != rootThread) {
-            // Accounting
-            if (isActive) {
-              --activeThreadCount;
-            }
-            // Kill off the idle fiber.
-            try {
-              throw std::logic_error("Killing off the fiber because too many threads.");
-            } catch (...) {
-              idleFiber->inject(std::current_exception());
-            }
-            // Detach our thread.
-            for (std::vector<std::shared_ptr<std::thread>>::iterator it = threads.begin();
-              it != threads.end(); ++it) {
-                if ((*it)->get_id() == std::this_thread::get_id()) {
-                  threads.erase(it);
-                  if (threads.size() > threadCount) {
-                    tickle();
-                  }
-                  return;
-                }
-              }
 
-            /// Impossible to reach.
-            SPAN_ASSERT(false);
-          }
-
-          std::vector<FiberAndThread>::iterator it(fibers.begin());
-          while (it != fibers.end()) {
-            // If we've met our batch size, and we're not checking to see
-            // if we need to tickle another thread, then break
-            if ((tickleMe || activeThreadCount == ThreadCount()) && batch.size() == batchSize) {
-              break;
-            }
-            if (it->thread != std::thread::id() && it->thread != std::this_thread::get_id()) {
-              LOG(INFO) << this << " scheduled item skipping for this thread: " << it->thread;
-
-              // Wake up another thread to hopefully service this.
-              tickleMe = true;
-              dontIdle = true;
-              ++it;
-              continue;
-            }
-            SPAN_ASSERT(it->fiber || it->dg);
-            // This fiber is still executing; probably just some race race condition that it
-            // needs to yield on one thread before running on another thread
-            if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-              LOG(INFO) << this << " skipping executing fiber: " << it->fiber;
-              ++it;
-              dontIdle = true;
-              continue;
-            }
-            // We were just checking if there is more work; there is so set the flag
-            // and don't actually take this piece of work.
-            if (batch.size() == batchSize) {
-              tickleMe = true;
-              break;
-            }
-            batch.push_back(*it);
-            it = fibers.erase(it);
-            if (!isActive) {
-              activeThreadCount++;
-              isActive = true;
-            }
-          }
-
-          if (batch.empty() && isActive) {
-            --activeThreadCount;
-            isActive = false;
-          }
+        // Count ourselves as active before taking anything, so Stopping() never sees
+        // work that has been dequeued but not yet run as "no work".
+        ++activeThreadCount;
+        takeWork(queue, &batch, &tickleMe, &dontIdle);
+        if (batch.empty()) {
+          --activeThreadCount;
         }
 
         if (tickleMe) {
@@ -309,16 +660,48 @@ namespace span {
         }
 
         LOG(INFO) << this << " got " << batch.size() << " fibers/dgs to process (max: "
-          << batchSize << ", active: " << isActive<< ")";
-        SPAN_ASSERT(isActive == !batch.empty());
+          << batchSize << ")";
 
         if (batch.empty()) {
           if (dontIdle) {
             continue;
           }
 
+          bool retire = false;
+          {
+            absl::MutexLock _lock(&mutex);
+            // Kill ourselves off if needeed.
+            if (threads.size() > threadCount && std::this_thread::get_id() != rootThread) {
+              // Kill off the idle fiber.
+              try {
+                throw std::logic_error("Killing off the fiber because too many threads.");
+              } catch (...) {
+                idleFiber->inject(std::current_exception());
+              }
+              // Detach our thread.
+              for (std::vector<std::shared_ptr<std::thread>>::iterator it = threads.begin();
+                it != threads.end(); ++it) {
+                  if ((*it)->get_id() == std::this_thread::get_id()) {
+                    threads.erase(it);
+                    if (threads.size() > threadCount) {
+                      tickle();
+                    }
+                    retire = true;
+                    break;
+                  }
+                }
+
+              SPAN_ASSERT(retire);
+            }
+          }
+          if (retire) {
+            detachQueue(queue);
+            return;
+          }
+
           if (idleFiber->state() == Fiber::TERM) {
             LOG(INFO) << this << " idle fiber terminated.";
+            detachQueue(queue);
             if (std::this_thread::get_id() == rootThread) {
               callingFiber.reset();
             }
@@ -330,16 +713,20 @@ namespace span {
           }
 
           LOG(INFO) << this << " idling.";
+          queue->idle = true;
           idleThreadCount++;
           idleFiber->call();
           idleThreadCount--;
+          queue->idle = false;
           continue;
         }
 
         while (!batch.empty()) {
           FiberAndThread& ft = batch.back();
-          Fiber::ptr f = ft.fiber;
-          std::function<void()> dg = ft.dg;
+          Fiber::ptr f = std::move(ft.fiber);
+          Task dg = std::move(ft.dg);
+          Fiber::ptr &dgFiber = dgFibers[ft.stack];
+          size_t stackSize = stackClassSize(ft.stack);
           batch.pop_back();
 
           try {
@@ -348,12 +735,11 @@ namespace span {
               f->yieldTo();
             } else if (dg) {
               if (dgFiber) {
-                dgFiber->reset(dg);
+                dgFiber->reset(std::move(dg));
               } else {
-                dgFiber.reset(new Fiber(dg));
+                dgFiber.reset(new Fiber(std::move(dg), stackSize));
               }
               LOG(INFO) << this << " running.";
-              dg = NULL;
               dgFiber->yieldTo();
               if (dgFiber->state() != Fiber::TERM) {
                 dgFiber.reset();
@@ -362,17 +748,17 @@ namespace span {
               }
             }
           } catch(...) {
-            {
-              absl::MutexLock _lock(&mutex);
-              copy(batch.begin(), batch.end(), back_inserter(fibers));
-              batch.clear();
-              // decrease activeThreadCount as this is an exception
-              isActive = false;
-              --activeThreadCount;
+            // Put back what we hadn't got to yet.
+            for (FiberAndThread &remaining : batch) {
+              requeue(queue, std::move(remaining));
             }
+            batch.clear();
+            // decrease activeThreadCount as this is an exception
+            --activeThreadCount;
             throw;
           }
         }
+        --activeThreadCount;
       }
     }
 
@@ -2,13 +2,18 @@
 #define SPAN_SRC_SPAN_FIBERS_SCHEDULER_HH_
 
 #include <atomic>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "absl/synchronization/mutex.h"
 
+#include "span/fibers/EventCount.hh"
+#include "span/fibers/Task.hh"
+
 namespace span {
   namespace fibers {
     class Fiber;
@@ -27,6 +32,19 @@ namespace span {
     /// via stop(). stop() will only return when all work is done.
     class Scheduler {
     public:
+      /// Named stack sizes for functors passed to schedule().
+      ///
+      /// Functors run on a fiber the scheduler keeps around and recycles, one per class.
+      /// Defaults are 16K/64K/256K/1M, and can be changed per scheduler with stackClassSize().
+      /// Fibers passed to schedule() keep whatever stack they were created with.
+      enum StackClass {
+        TINY_STACK,
+        SMALL_STACK,
+        MEDIUM_STACK,
+        LARGE_STACK,
+        STACK_CLASSES
+      };
+
       /// Default Constructor for a Scheduler.
       ///
       /// By Default a Single Thread Hijacking Scheduler is constructed.
@@ -65,8 +83,9 @@ namespace span {
       ///
       /// fd - The Fiber or Functor to be scheduled. If a pointer
       /// is passed in the ownership will transfer to this scheduler.
+      /// Functors are moved into a Task, so pass rvalues to avoid a copy.
       template<class FiberOrDg>
-      void schedule(FiberOrDg fd, std::thread::id thread = {});
+      void schedule(FiberOrDg &&fd, std::thread::id thread = {}, StackClass stack = LARGE_STACK);
 
       /// Schedule multiple items to be executed at once.
       template<class InputIterator>
@@ -105,6 +124,16 @@ namespace span {
         return rootThread;
       }
 
+      /// Size in bytes of the stack functors scheduled with `stack` get.
+      size_t stackClassSize(StackClass stack) const;
+      /// Change the size of a stack class. Only affects fibers created afterwards.
+      void stackClassSize(StackClass stack, size_t size);
+
+      /// Upper bound on how long an idle thread busy waits for new work before it sleeps, in
+      /// spins of roughly 10-100ns each. 0 sleeps straight away. See AdaptiveSpin.
+      size_t maxIdleSpins() const;
+      void maxIdleSpins(size_t spins);
+
     protected:
       /// Dervied classes can query stopping() to determine if the scheduler is stopping.
       ///
@@ -121,10 +150,26 @@ namespace span {
       /// The scheduler wants to force the idle fiber to Fiber::yield(), because
       /// new work has been scheduled.
       virtual void tickle() = 0;
+      /// Like tickle(), but only `thread` can run the new work. Defaults to tickle().
+      virtual void tickleThread(std::thread::id thread);
 
       bool hasWorkToDo();
+      /// Whether there's anything the calling thread could take right now: its own queue,
+      /// the shared queue, or something it could steal. Work pinned to other threads doesn't count.
+      bool hasRunnableWork();
+      /// Spin for a bit (see maxIdleSpins()) waiting for hasRunnableWork(), returning it.
+      bool spinForWork();
+      /// Sleep the calling thread until unparkIdle() picks it, unparkThread() names it, or it sees
+      /// hasRunnableWork() or Stopping(). Each thread sleeps on its own EventCount.
+      void parkIdle();
+      /// Wake one thread sleeping in parkIdle() that nobody has woken yet, if there is one.
+      void unparkIdle();
+      /// Wake `thread`, if it's sleeping in parkIdle(), and nobody else.
+      void unparkThread(std::thread::id thread);
       virtual bool hasIdleThreads() const;
-      /// Determine whether tickle() is needed, to be invoked in schedule().
+      /// Determine whether tickle() is needed, to be invoked in schedule(). `empty` is true when the
+      /// work landed on a queue nobody is about to look at (an empty queue of an idle thread, the shared
+      /// queue, or our own queue while peers sit idle).
       virtual bool shouldTickle(bool empty) const;
 
       /// Set 'this' to TLS so that getThis() can get correct scheduler.
@@ -134,45 +179,129 @@ namespace span {
       void yieldTo(bool yieldToCallerOnTerminate);
       void run();
 
-      template<class FiberOrDg>
-      bool scheduleNoLock(FiberOrDg fd, std::thread::id thread = {});
-
       Scheduler(const Scheduler& rhs) = delete;
 
       struct FiberAndThread {
         std::shared_ptr<Fiber> fiber;
-        std::function<void()> dg;
+        Task dg;
         std::thread::id thread;
+        StackClass stack;
 
-        FiberAndThread(std::shared_ptr<Fiber> f, std::thread::id th) : fiber(f), thread(th) {
+        FiberAndThread(std::shared_ptr<Fiber> f, std::thread::id th, StackClass st = LARGE_STACK) :
+          fiber(std::move(f)), thread(th), stack(st) {
         }
 
-        FiberAndThread(std::shared_ptr<Fiber>* f, std::thread::id th) : thread(th) {
+        FiberAndThread(std::shared_ptr<Fiber>* f, std::thread::id th, StackClass st = LARGE_STACK) : thread(th),
+          stack(st) {
           fiber.swap(*f);
         }
 
-        FiberAndThread(std::function<void()> d, std::thread::id th) : dg(d), thread(th) {
+        FiberAndThread(Task d, std::thread::id th, StackClass st = LARGE_STACK) : dg(std::move(d)),
+          thread(th), stack(st) {
         }
 
-        FiberAndThread(std::function<void()> *d, std::thread::id th) : thread(th) {
-          dg.swap(*d);
+        FiberAndThread(Task *d, std::thread::id th, StackClass st = LARGE_STACK) : dg(std::move(*d)),
+          thread(th), stack(st) {
+        }
+
+        FiberAndThread(std::function<void()> *d, std::thread::id th, StackClass st = LARGE_STACK) : thread(th),
+          stack(st) {
+          std::function<void()> taken;
+          taken.swap(*d);
+          dg = std::move(taken);
         }
       };
 
+      /// Run queue owned by a single thread running this scheduler.
+      ///
+      /// The owner pushes, and pops `tasks` at the back (LIFO, it's cache hot), idle peers
+      /// steal from the front (FIFO). Work scheduled from any other thread goes in `inbox`
+      /// instead, so producers never contend with the owner's pops; the owner moves it over
+      /// to `tasks` each time around the run loop. Work pinned to the thread goes in `mailbox`,
+      /// which only the owner ever takes from, so nobody has to skip over work they can't run.
+      /// A queue left with nothing in it when its thread stops running is handed to the next thread
+      /// that needs one.
+      struct WorkerQueue {
+        WorkerQueue(Scheduler *owner, std::thread::id thread) : owner(owner), thread(thread), active(false),
+          idle(false), unparked(false), size(0), inboxSize(0), mailboxSize(0) {}
+
+        Scheduler *owner;
+        // Nobody's (free for reuse) once it's std::thread::id(); only changes under the scheduler's
+        // mutex and mailboxMutex both.
+        std::atomic<std::thread::id> thread;
+        // Whether the owning thread is inside run(), nothing is pushed to an inactive queue.
+        std::atomic<bool> active;
+        std::atomic<bool> idle;
+        // What the owner sleeps on in parkIdle(), and whether it has been woken since it last checked
+        // for work, so unparkIdle() moves on to someone else.
+        EventCount parked;
+        std::atomic<bool> unparked;
+
+        absl::Mutex mutex;
+        std::deque<FiberAndThread> tasks;
+        std::atomic<size_t> size;
+
+        absl::Mutex inboxMutex;
+        std::deque<FiberAndThread> inbox;
+        std::atomic<size_t> inboxSize;
+
+        absl::Mutex mailboxMutex;
+        std::deque<FiberAndThread> mailbox;
+        std::atomic<size_t> mailboxSize;
+      };
+
+      static const size_t MAX_WORKER_QUEUES = 256;
+
+      /// Queue `ft`, returning true if it may need a tickle() to be picked up promptly.
+      bool enqueue(FiberAndThread &&ft);
+      /// Push straight onto the calling thread's own queue; `front` puts it behind everything else.
+      /// Returns true if there are idle threads that could steal it.
+      bool enqueueLocal(WorkerQueue *queue, FiberAndThread &&ft, bool front);
+      /// Push onto the mailbox of the thread `ft` is pinned to.
+      bool enqueueMailbox(WorkerQueue *queue, FiberAndThread &&ft, bool front);
+      /// Push onto the queue shared by all threads (used before any thread is running).
+      bool enqueueShared(FiberAndThread &&ft);
+      /// Put work taken by this thread back where it came from, at the front.
+      void requeue(WorkerQueue *queue, FiberAndThread &&ft);
+      WorkerQueue *localQueue();
+      WorkerQueue *findQueue(std::thread::id thread);
+      /// Find, reuse or create the queue for `thread`, which need not be running yet.
+      WorkerQueue *queueFor(std::thread::id thread);
+      WorkerQueue *attachQueue();
+      void detachQueue(WorkerQueue *queue);
+      void drainInbox(WorkerQueue *queue);
+      void takeWork(WorkerQueue *queue, std::vector<FiberAndThread> *batch, bool *tickleMe, bool *dontIdle);
+      void takeMailbox(WorkerQueue *queue, std::vector<FiberAndThread> *batch);
+      void takeShared(std::vector<FiberAndThread> *batch, bool *tickleMe);
+      void steal(WorkerQueue *queue, std::vector<FiberAndThread> *batch);
+
       static thread_local Scheduler* threadLocalScheduler;
       static thread_local Fiber* threadLocalFiber;
+      static thread_local WorkerQueue* threadLocalQueue;
 
       absl::Mutex mutex;
-      std::vector<FiberAndThread> fibers;
+      // Unpinned work that can't go on any thread's queue yet (scheduled before the scheduler was
+      // running, or left over by threads that have exited).
+      std::deque<FiberAndThread> fibers;
+      std::atomic<size_t> sharedCount;
+      std::atomic<WorkerQueue *> queues[MAX_WORKER_QUEUES];
+      std::atomic<size_t> queueCount;
+      std::atomic<size_t> nextInbox;
+      std::atomic<size_t> nextUnpark;
+      // Everything queued anywhere, but not yet taken by a thread.
+      std::atomic<size_t> pendingCount;
       std::thread::id rootThread;
       std::shared_ptr<Fiber> rootFiber;
       std::shared_ptr<Fiber> callingFiber;
       std::vector<std::shared_ptr<std::thread>> threads;
-      size_t threadCount, activeThreadCount;
+      size_t threadCount;
+      std::atomic<size_t> activeThreadCount;
       std::atomic<size_t> idleThreadCount;
       bool stopping;
       bool autoStop;
       size_t batchSize;
+      std::atomic<size_t> stackClassSizes[STACK_CLASSES];
+      AdaptiveSpin idleSpinner;
     };
 
     /// Automatic Scheduler Switcher
@@ -192,13 +321,8 @@ namespace span {
     };
 
     template<class FiberOrDg>
-    inline void Scheduler::schedule(FiberOrDg fd, std::thread::id thread) {
-      bool tickleMe;
-      {
-        absl::MutexLock _lock(&mutex);
-        tickleMe = scheduleNoLock(fd, thread);
-      }
-      if (shouldTickle(tickleMe)) {
+    inline void Scheduler::schedule(FiberOrDg &&fd, std::thread::id thread, StackClass stack) {
+      if (shouldTickle(enqueue(FiberAndThread(std::forward<FiberOrDg>(fd), thread, stack)))) {
         tickle();
       }
     }
@@ -206,10 +330,21 @@ namespace span {
     template<class InputIterator>
     inline void Scheduler::schedule(InputIterator begin, InputIterator end) {
       bool tickleMe = false;
-      {
-        absl::MutexLock _lock(&mutex);
+      WorkerQueue *queue = localQueue();
+      if (queue) {
+        // The owner pops LIFO, so push a batch backwards to have it run in order.
+        std::vector<FiberAndThread> local;
+        while (begin != end) {
+          FiberAndThread ft(&*begin, std::thread::id());
+          ++begin;
+          local.push_back(std::move(ft));
+        }
+        for (auto it = local.rbegin(); it != local.rend(); ++it) {
+          tickleMe = enqueueLocal(queue, std::move(*it), false) || tickleMe;
+        }
+      } else {
         while (begin != end) {
-          tickleMe = scheduleNoLock(&*begin) || tickleMe;
+          tickleMe = enqueue(FiberAndThread(&*begin, std::thread::id())) || tickleMe;
           ++begin;
         }
       }
@@ -235,15 +370,29 @@ namespace span {
     }
 
     inline bool Scheduler::shouldTickle(bool empty) const {
-      return empty && Scheduler::getThis() != this;
+      return empty;
     }
 
-    template<class FiberOrDg>
-    inline bool Scheduler::scheduleNoLock(FiberOrDg fd, std::thread::id thread) {
-      bool tickleMe = fibers.empty();
-      fibers.push_back(FiberAndThread(fd, thread));
-      return tickleMe;
+    inline size_t Scheduler::maxIdleSpins() const {
+      return idleSpinner.maxSpins();
+    }
+
+    inline void Scheduler::maxIdleSpins(size_t spins) {
+      idleSpinner.maxSpins(spins);
     }
+
+    inline bool Scheduler::spinForWork() {
+      return idleSpinner.spin([this]() { return hasRunnableWork(); });
+    }
+
+    inline size_t Scheduler::stackClassSize(StackClass stack) const {
+      return stackClassSizes[stack].load(std::memory_order_relaxed);
+    }
+
+    inline void Scheduler::stackClassSize(StackClass stack, size_t size) {
+      stackClassSizes[stack] = size;
+    }
+
   }  // namespace fibers
 }  // namespace span
 
@@ -0,0 +1,229 @@
+#ifndef SPAN_SRC_SPAN_FIBERS_TASK_HH_
+#define SPAN_SRC_SPAN_FIBERS_TASK_HH_
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace span {
+  namespace fibers {
+    /// A move-only `void()` callable, used for everything handed to a Scheduler.
+    ///
+    /// Callables up to INLINE_SIZE bytes (that can be moved without throwing) are stored
+    /// inside the Task itself, so scheduling a lambda capturing a handful of pointers, or a
+    /// std::bind of a member function, never touches the heap. Larger callables fall back to
+    /// a single heap allocation. Unlike std::function, a Task is never copied; it is moved
+    /// from schedule() through the run queue and onto the fiber that runs it.
+    class Task {
+    public:
+      static const size_t INLINE_SIZE = 48;
+
+      Task() noexcept : ops(nullptr) {}
+      Task(std::nullptr_t) noexcept : ops(nullptr) {}  // NOLINT(runtime/explicit)
+
+      template<class F, class Fn = typename std::decay<F>::type, class = typename std::enable_if<
+        !std::is_same<Fn, Task>::value && std::is_invocable_r<void, Fn &>::value>::type>
+      Task(F &&f) : ops(nullptr) {  // NOLINT(runtime/explicit)
+        if (!isNull(f)) {
+          init<Fn>(std::forward<F>(f));
+        }
+      }
+
+      Task(Task &&rhs) noexcept : ops(nullptr) {
+        moveFrom(&rhs);
+      }
+
+      Task &operator=(Task &&rhs) noexcept {
+        if (this != &rhs) {
+          reset();
+          moveFrom(&rhs);
+        }
+        return *this;
+      }
+
+      Task &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+      }
+
+      Task(const Task &rhs) = delete;
+      Task &operator=(const Task &rhs) = delete;
+
+      ~Task() {
+        reset();
+      }
+
+      explicit operator bool() const {
+        return ops != nullptr;
+      }
+
+      void operator()() {
+        ops->invoke(target());
+      }
+
+      void swap(Task &rhs) noexcept {
+        Task tmp(std::move(rhs));
+        rhs = std::move(*this);
+        *this = std::move(tmp);
+      }
+
+      /// Type of the wrapped callable (or what a wrapped std::function holds), like
+      /// std::function::target_type().
+      const std::type_info &target_type() const {
+        return ops ? ops->type(target()) : typeid(void);
+      }
+
+      /// The plain function pointer this Task calls, if that's what it wraps.
+      void *functionPointer() const {
+        return ops ? ops->function(target()) : nullptr;
+      }
+
+      /// Whether the callable lives in the inline buffer rather than on the heap.
+      bool isInline() const {
+        return ops && ops->local;
+      }
+
+    private:
+      struct Ops {
+        void (*invoke)(void *);
+        // Move construct into `to` and destroy `from`.
+        void (*relocate)(void *from, void *to);
+        void (*destroy)(void *);
+        const std::type_info &(*type)(const void *);
+        void *(*function)(const void *);
+        bool local;
+      };
+
+      template<class Fn>
+      struct Local {
+        static Fn *get(void *p) {
+          return std::launder(reinterpret_cast<Fn *>(p));
+        }
+        static void invoke(void *p) {
+          (*get(p))();
+        }
+        static void relocate(void *from, void *to) {
+          new (to) Fn(std::move(*get(from)));
+          get(from)->~Fn();
+        }
+        static void destroy(void *p) {
+          get(p)->~Fn();
+        }
+      };
+
+      template<class Fn>
+      struct Remote {
+        static Fn *&get(void *p) {
+          return *reinterpret_cast<Fn **>(p);
+        }
+        static void invoke(void *p) {
+          (*get(p))();
+        }
+        static void relocate(void *from, void *to) {
+          *reinterpret_cast<Fn **>(to) = get(from);
+        }
+        static void destroy(void *p) {
+          delete get(p);
+        }
+      };
+
+      template<class Fn>
+      static constexpr bool fitsInline() {
+        return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t) &&
+          std::is_nothrow_move_constructible<Fn>::value;
+      }
+
+      template<class Fn>
+      static const Fn &unwrap(const void *p) {
+        if constexpr (fitsInline<Fn>()) {
+          return *std::launder(reinterpret_cast<const Fn *>(p));
+        } else {
+          return **reinterpret_cast<Fn *const *>(p);
+        }
+      }
+
+      template<class Fn>
+      static const std::type_info &typeOf(const void *p) {
+        if constexpr (std::is_same<Fn, std::function<void()>>::value) {
+          return unwrap<Fn>(p).target_type();
+        } else {
+          return typeid(Fn);
+        }
+      }
+
+      template<class Fn>
+      static void *functionOf(const void *p) {
+        if constexpr (std::is_same<Fn, std::function<void()>>::value) {
+          auto target = unwrap<Fn>(p).template target<void (*)()>();
+          return target ? reinterpret_cast<void *>(*target) : nullptr;
+        } else if constexpr (std::is_pointer<Fn>::value && std::is_function<
+          typename std::remove_pointer<Fn>::type>::value) {
+          return reinterpret_cast<void *>(unwrap<Fn>(p));
+        } else {
+          return nullptr;
+        }
+      }
+
+      template<class Fn>
+      static const Ops *opsFor() {
+        if constexpr (fitsInline<Fn>()) {
+          static const Ops ops = {&Local<Fn>::invoke, &Local<Fn>::relocate, &Local<Fn>::destroy,
+            &typeOf<Fn>, &functionOf<Fn>, true};
+          return &ops;
+        } else {
+          static const Ops ops = {&Remote<Fn>::invoke, &Remote<Fn>::relocate, &Remote<Fn>::destroy,
+            &typeOf<Fn>, &functionOf<Fn>, false};
+          return &ops;
+        }
+      }
+
+      template<class F>
+      static bool isNull(const F &f) {
+        if constexpr (std::is_pointer<F>::value || std::is_member_pointer<F>::value ||
+          std::is_same<F, std::function<void()>>::value) {
+          return !f;
+        } else {
+          return false;
+        }
+      }
+
+      template<class Fn, class F>
+      void init(F &&f) {
+        if constexpr (fitsInline<Fn>()) {
+          new (buffer) Fn(std::forward<F>(f));
+        } else {
+          *reinterpret_cast<Fn **>(buffer) = new Fn(std::forward<F>(f));
+        }
+        ops = opsFor<Fn>();
+      }
+
+      void *target() const {
+        return const_cast<unsigned char *>(buffer);
+      }
+
+      void moveFrom(Task *rhs) noexcept {
+        if (rhs->ops) {
+          rhs->ops->relocate(rhs->target(), target());
+          ops = rhs->ops;
+          rhs->ops = nullptr;
+        }
+      }
+
+      void reset() noexcept {
+        if (ops) {
+          const Ops *old = ops;
+          ops = nullptr;
+          old->destroy(target());
+        }
+      }
+
+      alignas(std::max_align_t) unsigned char buffer[INLINE_SIZE];
+      const Ops *ops;
+    };
+  }  // namespace fibers
+}  // namespace span
+
+#endif  // SPAN_SRC_SPAN_FIBERS_TASK_HH_
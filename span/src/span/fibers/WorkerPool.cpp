@@ -15,7 +15,9 @@ namespace span {
         if (Stopping()) {
           return;
         }
-        sema.wait();
+        if (!spinForWork()) {
+          parkIdle();
+        }
         try {
           Fiber::yield();
         } catch (...) {
@@ -26,7 +28,12 @@ namespace span {
 
     void WorkerPool::tickle() {
       LOG(INFO) << this << " tickling";
-      sema.notify();
+      unparkIdle();
+    }
+
+    void WorkerPool::tickleThread(std::thread::id thread) {
+      LOG(INFO) << this << " tickling " << thread;
+      unparkThread(thread);
     }
   }  // namespace fibers
 }  // namespace span
@@ -2,7 +2,6 @@
 #define SPAN_SRC_SPAN_FIBERS_WORKERPOOL_HH_
 
 #include "span/fibers/Scheduler.hh"
-#include "span/fibers/Semaphore.hh"
 
 namespace span {
   namespace fibers {
@@ -15,14 +14,13 @@ namespace span {
       }
 
     protected:
-      /// The Idle Fiber for a worker pool simply loops waitin on a Semaphore,
-      /// and yields whenever that semaphore is signalled, returning if stopping() is true.
+      /// The Idle Fiber for a worker pool spins for a bit (see maxIdleSpins()), then parks (see
+      /// parkIdle()), and yields whenever there's work it can run, returning if stopping() is true.
       void idle();
-      /// Signals the semaphore so that the idle Fiber will yield.
+      /// Wakes one parked thread so that its idle Fiber will yield.
       void tickle();
-
-    private:
-      Semaphore sema;
+      /// Wakes `thread` alone, only it can run the work.
+      void tickleThread(std::thread::id thread);
     };
   }  // namespace fibers
 }  // namespace span
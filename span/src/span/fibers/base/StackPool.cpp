@@ -0,0 +1,199 @@
+#include "span/fibers/base/StackPool.hh"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "span/exceptions/Assert.hh"
+
+#include "absl/synchronization/mutex.h"
+#include "glog/logging.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+namespace span {
+  namespace fibers {
+    namespace base {
+      namespace {
+        typedef std::pair<void *, size_t> CachedStack;
+
+        std::atomic<size_t> g_threadCacheLimit(64);
+        std::atomic<size_t> g_globalCacheLimit(1024);
+        std::atomic<bool> g_decommitOnRelease(false);
+
+        size_t queryPageSize() {
+          return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        }
+
+        ::absl::Mutex & globalPoolMutex() {
+          static ::absl::Mutex mutex;
+          return mutex;
+        }
+
+        std::vector<CachedStack> & globalPool() {
+          static std::vector<CachedStack> pool;
+          return pool;
+        }
+
+        void unmapStack(void *stack, size_t size) {
+          char *base = static_cast<char *>(stack) - StackPool::pageSize();
+          if (munmap(base, size + StackPool::pageSize())) {
+            LOG(ERROR) << "munmap(" << static_cast<void *>(base) << ", " << size + StackPool::pageSize()
+              << "): (" << errno << ")";
+          }
+        }
+
+        void *mapStack(size_t size) {
+          size_t total = size + StackPool::pageSize();
+          void *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+          if (base == MAP_FAILED) {
+            LOG(ERROR) << "mmap(" << total << "): (" << errno << ")";
+            throw std::bad_alloc();
+          }
+          // Stacks grow down, so the guard goes at the lowest address.
+          if (mprotect(base, StackPool::pageSize(), PROT_NONE)) {
+            LOG(ERROR) << "mprotect(" << base << ", PROT_NONE): (" << errno << ")";
+            munmap(base, total);
+            throw std::bad_alloc();
+          }
+          return static_cast<char *>(base) + StackPool::pageSize();
+        }
+
+        // Pulls a stack of exactly `size` bytes out of `cache`, or returns NULL.
+        void *takeFrom(std::vector<CachedStack> *cache, size_t size) {
+          for (auto it = cache->rbegin(); it != cache->rend(); ++it) {
+            if (it->second == size) {
+              void *stack = it->first;
+              *it = cache->back();
+              cache->pop_back();
+              return stack;
+            }
+          }
+          return NULL;
+        }
+
+        void spill(std::vector<CachedStack> *from, size_t keep) {
+          std::vector<CachedStack> unmap;
+          {
+            absl::MutexLock lock(&globalPoolMutex());
+            size_t limit = g_globalCacheLimit.load(std::memory_order_relaxed);
+            while (from->size() > keep) {
+              if (globalPool().size() < limit) {
+                globalPool().push_back(from->back());
+              } else {
+                unmap.push_back(from->back());
+              }
+              from->pop_back();
+            }
+          }
+          for (const CachedStack &stack : unmap) {
+            unmapStack(stack.first, stack.second);
+          }
+        }
+
+        // The cache itself is only reachable through a trivially destructible pointer,
+        // so fibers destroyed late in thread teardown (after CacheOwner has run) safely
+        // see NULL, and go straight to the global pool.
+        thread_local std::vector<CachedStack> *t_cache = nullptr;
+
+        struct CacheOwner {
+          std::vector<CachedStack> cache;
+          CacheOwner() { t_cache = &cache; }
+          ~CacheOwner() {
+            t_cache = nullptr;
+            spill(&cache, 0);
+          }
+        };
+
+        std::vector<CachedStack> *threadCache() {
+          static thread_local CacheOwner owner;
+          return t_cache;
+        }
+      }  // namespace
+
+      size_t StackPool::pageSize() {
+        static size_t pageSize = queryPageSize();
+        return pageSize;
+      }
+
+      void *StackPool::allocate(size_t *size) {
+        size_t page = pageSize();
+        *size = (*size + page - 1) & ~(page - 1);
+
+        std::vector<CachedStack> *cache = threadCache();
+        void *stack = cache ? takeFrom(cache, *size) : NULL;
+        if (stack) {
+          return stack;
+        }
+        {
+          absl::MutexLock lock(&globalPoolMutex());
+          stack = takeFrom(&globalPool(), *size);
+        }
+        if (stack) {
+          return stack;
+        }
+        return mapStack(*size);
+      }
+
+      void StackPool::release(void *stack, size_t size) {
+        SPAN_ASSERT(stack);
+        if (g_decommitOnRelease.load(std::memory_order_relaxed)) {
+          if (madvise(stack, size, MADV_DONTNEED)) {
+            LOG(ERROR) << "madvise(" << stack << ", " << size << ", MADV_DONTNEED): (" << errno << ")";
+          }
+        }
+
+        std::vector<CachedStack> *cache = t_cache;
+        if (!cache) {
+          std::vector<CachedStack> single(1, CachedStack(stack, size));
+          spill(&single, 0);
+          return;
+        }
+        cache->push_back(CachedStack(stack, size));
+        size_t limit = g_threadCacheLimit.load(std::memory_order_relaxed);
+        if (cache->size() > limit) {
+          spill(cache, limit / 2);
+        }
+      }
+
+      void StackPool::threadCacheLimit(size_t limit) {
+        g_threadCacheLimit = limit;
+      }
+
+      void StackPool::globalCacheLimit(size_t limit) {
+        g_globalCacheLimit = limit;
+      }
+
+      void StackPool::decommitOnRelease(bool decommit) {
+        g_decommitOnRelease = decommit;
+      }
+
+      void StackPool::trim() {
+        std::vector<CachedStack> unmap;
+        std::vector<CachedStack> *cache = threadCache();
+        if (cache) {
+          unmap.swap(*cache);
+        }
+        {
+          absl::MutexLock lock(&globalPoolMutex());
+          unmap.insert(unmap.end(), globalPool().begin(), globalPool().end());
+          globalPool().clear();
+        }
+        for (const CachedStack &stack : unmap) {
+          unmapStack(stack.first, stack.second);
+        }
+      }
+    }  // namespace base
+  }  // namespace fibers
+}  // namespace span
@@ -0,0 +1,49 @@
+#ifndef SPAN_SRC_SPAN_FIBERS_BASE_STACKPOOL_HH_
+#define SPAN_SRC_SPAN_FIBERS_BASE_STACKPOOL_HH_
+
+#include <stddef.h>
+
+#include "span/Common.hh"
+
+namespace span {
+  namespace fibers {
+    namespace base {
+      /// Recycles fiber stacks.
+      ///
+      /// Every stack is its own mmap with a PROT_NONE guard page directly below it, so
+      /// overflowing a fiber's stack raises SIGSEGV instead of scribbling over the heap.
+      ///
+      /// Released stacks go to a small cache owned by the releasing thread, once that
+      /// fills up half of it spills into a global (locked) pool that any thread can
+      /// pull from. Anything beyond the global limit is unmapped.
+      class StackPool {
+      public:
+        /// Get a stack of at least `size` usable bytes.
+        ///
+        /// `size` is rounded up to a whole number of pages, and the rounded size is
+        /// written back. Returns the lowest usable address (just above the guard page).
+        static void *allocate(size_t *size);
+
+        /// Give a stack returned by allocate() back to the pool.
+        static void release(void *stack, size_t size);
+
+        /// Maximum number of stacks kept by each thread. Defaults to 64.
+        static void threadCacheLimit(size_t limit);
+        /// Maximum number of stacks kept in the shared spill pool. Defaults to 1024.
+        static void globalCacheLimit(size_t limit);
+
+        /// When true, released stacks have their pages handed back to the OS with
+        /// madvise(MADV_DONTNEED) before being cached. This keeps RSS bounded by the
+        /// number of live fibers at the cost of re-faulting pages on reuse.
+        static void decommitOnRelease(bool decommit);
+
+        /// Unmap everything in the calling thread's cache, and the global pool.
+        static void trim();
+
+        static size_t pageSize();
+      };
+    }  // namespace base
+  }  // namespace fibers
+}  // namespace span
+
+#endif  // SPAN_SRC_SPAN_FIBERS_BASE_STACKPOOL_HH_
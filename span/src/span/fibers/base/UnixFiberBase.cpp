@@ -1,20 +1,137 @@
+#include <string.h>
+
+#include <atomic>
 #include <cstdlib>
-#include <new>
 
 #include "span/exceptions/Assert.hh"
+#include "span/fibers/base/StackPool.hh"
 #include "span/fibers/base/UnixFiberBase.hh"
 
+#ifdef SPAN_FIBER_ASM
+// span_fiber_switch(void **from, void *to)
+//
+// Pushes every callee-saved register onto the current stack, stores the
+// resulting stack pointer in *from, loads `to` as the new stack pointer, and
+// pops the same set of registers back off it. Since this is an ordinary
+// function call, the compiler already assumes everything else is clobbered.
+//
+// span_fiber_start is the "return address" of a freshly built stack, it passes
+// the FiberBase (stashed in a callee-saved register) to FiberBase::trampoline.
+extern "C" {
+  void span_fiber_switch(void **from, void *to);
+  void span_fiber_start();
+}
+
+#if defined(__x86_64__)
+asm(R"(
+  .text
+  .globl span_fiber_switch
+  .type span_fiber_switch, @function
+  .align 16
+span_fiber_switch:
+  .cfi_startproc
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .cfi_endproc
+  .size span_fiber_switch, .-span_fiber_switch
+
+  .globl span_fiber_start
+  .type span_fiber_start, @function
+  .align 16
+span_fiber_start:
+  .cfi_startproc
+  .cfi_undefined rip
+  movq %r12, %rdi
+  callq *%r13
+  ud2
+  .cfi_endproc
+  .size span_fiber_start, .-span_fiber_start
+)");
+#elif defined(__aarch64__)
+asm(R"(
+  .text
+  .globl span_fiber_switch
+  .type span_fiber_switch, %function
+  .align 4
+span_fiber_switch:
+  .cfi_startproc
+  sub sp, sp, #0xa0
+  stp d8, d9, [sp, #0x00]
+  stp d10, d11, [sp, #0x10]
+  stp d12, d13, [sp, #0x20]
+  stp d14, d15, [sp, #0x30]
+  stp x19, x20, [sp, #0x40]
+  stp x21, x22, [sp, #0x50]
+  stp x23, x24, [sp, #0x60]
+  stp x25, x26, [sp, #0x70]
+  stp x27, x28, [sp, #0x80]
+  stp x29, x30, [sp, #0x90]
+  mov x9, sp
+  str x9, [x0]
+  mov sp, x1
+  ldp d8, d9, [sp, #0x00]
+  ldp d10, d11, [sp, #0x10]
+  ldp d12, d13, [sp, #0x20]
+  ldp d14, d15, [sp, #0x30]
+  ldp x19, x20, [sp, #0x40]
+  ldp x21, x22, [sp, #0x50]
+  ldp x23, x24, [sp, #0x60]
+  ldp x25, x26, [sp, #0x70]
+  ldp x27, x28, [sp, #0x80]
+  ldp x29, x30, [sp, #0x90]
+  add sp, sp, #0xa0
+  ret
+  .cfi_endproc
+  .size span_fiber_switch, .-span_fiber_switch
+
+  .globl span_fiber_start
+  .type span_fiber_start, %function
+  .align 4
+span_fiber_start:
+  .cfi_startproc
+  .cfi_undefined x30
+  mov x0, x19
+  blr x20
+  brk #0
+  .cfi_endproc
+  .size span_fiber_start, .-span_fiber_start
+)");
+#endif
+#endif
+
 namespace span {
   namespace fibers {
     namespace base {
-      FiberBase::FiberBase() : mInit(true), mStack(nullptr) { }
+      static std::atomic<bool> g_paintStacks(false);
+      static const uint64 kStackPaint = 0x5350414e5350414eull;  // "SPANSPAN"
 
-      FiberBase::FiberBase(uint32 size) : stackSize(size) {
-        if ((mStack = malloc(stackSize)) == nullptr) {
-          throw std::bad_alloc();
-        }
+      FiberBase::FiberBase() : mInit(true), mPainted(false), mTracked(false), mStack(nullptr), mStackSize(0) { }
+
+      FiberBase::FiberBase(uint32 size) : mPainted(false), mTracked(false) {
+        size_t rounded = size;
+        mStack = StackPool::allocate(&rounded);
+        mStackSize = static_cast<uint32>(rounded);
 #ifdef HAVE_VALGRIND
-        mValgrindStackId = VALGRIND_STACK_REGISTER(mStack, (char *)mStack + stackSize);
+        mValgrindStackId = VALGRIND_STACK_REGISTER(mStack, (char *)mStack + mStackSize);
 #endif
         reset();
       }
@@ -23,19 +140,100 @@ namespace span {
 #ifdef HAVE_VALGRIND
         VALGRIND_STACK_DEREGISTER(mValgrindStackId);
 #endif
-        free(mStack);
+        if (mStack) {
+          StackPool::release(mStack, mStackSize);
+        }
+      }
+
+      void FiberBase::paintStacks(bool paint) {
+        g_paintStacks = paint;
+      }
+
+      bool FiberBase::paintStacks() {
+        return g_paintStacks.load(std::memory_order_relaxed);
+      }
+
+      void FiberBase::paint() {
+        if (!mStack || mPainted || !paintStacks()) {
+          return;
+        }
+        uint64 *word = static_cast<uint64 *>(mStack);
+        uint64 *end = word + mStackSize / sizeof(uint64);
+        while (word != end) {
+          *word++ = kStackPaint;
+        }
+        mPainted = true;
       }
 
+      size_t FiberBase::stackHighWaterMark() const {
+        if (!mStack || !mTracked) {
+          return 0;
+        }
+        // Stacks grow down, so the first disturbed word from the bottom is the deepest point.
+        const uint64 *word = static_cast<const uint64 *>(mStack);
+        const uint64 *end = word + mStackSize / sizeof(uint64);
+        while (word != end && *word == kStackPaint) {
+          ++word;
+        }
+        return reinterpret_cast<const char *>(end) - reinterpret_cast<const char *>(word);
+      }
+
+      const char *FiberBase::backend() {
+#ifdef SPAN_FIBER_ASM
+        return "asm";
+#else
+        return "ucontext";
+#endif
+      }
+
+#ifdef SPAN_FIBER_ASM
+      void FiberBase::reset() {
+        mInit = false;
+        paint();
+
+        // Build the frame span_fiber_switch expects to pop, so the first switch
+        // "returns" into span_fiber_start.
+        uintptr_t top = (reinterpret_cast<uintptr_t>(mStack) + mStackSize) & ~static_cast<uintptr_t>(15);
+        uintptr_t *sp = reinterpret_cast<uintptr_t *>(top);
+#if defined(__x86_64__)
+        // Return address sits 8 bytes off a 16 byte boundary, so span_fiber_start
+        // runs with the stack aligned the way a `call` expects.
+        *--sp = reinterpret_cast<uintptr_t>(&span_fiber_start);
+        *--sp = 0;  // rbp
+        *--sp = 0;  // rbx
+        *--sp = reinterpret_cast<uintptr_t>(this);  // r12
+        *--sp = reinterpret_cast<uintptr_t>(&FiberBase::trampoline);  // r13
+        *--sp = 0;  // r14
+        *--sp = 0;  // r15
+        // Default MXCSR, and x87 control word.
+        *--sp = (static_cast<uintptr_t>(0x037F) << 32) | 0x1F80;
+#elif defined(__aarch64__)
+        sp -= 20;
+        for (size_t i = 0; i < 20; ++i) {
+          sp[i] = 0;
+        }
+        sp[8] = reinterpret_cast<uintptr_t>(this);  // x19
+        sp[9] = reinterpret_cast<uintptr_t>(&FiberBase::trampoline);  // x20
+        sp[19] = reinterpret_cast<uintptr_t>(&span_fiber_start);  // x30
+#endif
+        mSp = sp;
+      }
+
+      void FiberBase::switchContext(FiberBase *to) {
+        span_fiber_switch(&mSp, to->mSp);
+      }
+#else
       void FiberBase::reset() {
         ucontext_t tmp;
         mInit = false;
+        paint();
 
         if (getcontext(&mCtx) == -1) {
           throw std::current_exception();
         }
 
         mCtx.uc_stack.ss_sp = mStack;
-        mCtx.uc_stack.ss_size = stackSize;
+        mCtx.uc_stack.ss_size = mStackSize;
         // Save tmp, so we can trampoline back.
         mCtx.uc_link = &tmp;
 
@@ -54,11 +252,14 @@ namespace span {
           }
         }
       }
+#endif
 
       void FiberBase::trampoline(void *ptr) {
         FiberBase* fiber = reinterpret_cast<FiberBase*>(ptr);
 
         fiber->mInit = true;
+        fiber->mTracked = fiber->mPainted;
+        fiber->mPainted = false;
         fiber->entrypoint();
       }
     }  // namespace base
@@ -8,17 +8,38 @@
 
 #include "span/Common.hh"
 
+// On x86-64, and AArch64 ELF targets we switch between fibers with a small hand
+// written routine that only saves callee-saved registers. Everywhere else
+// (Mach-O, which wants its own symbol directives and prefixes, or when
+// SPAN_FIBER_UCONTEXT is defined at build time) we fall back to
+// getcontext/makecontext for the first switch, and _setjmp/_longjmp afterwards.
+#if !defined(SPAN_FIBER_UCONTEXT) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define SPAN_FIBER_ASM 1
+#endif
+
+#ifndef SPAN_FIBER_ASM
 #if PLATFORM == PLATFORM_DARWIN || UNIX_FLAVOUR == UNIX_FLAVOUR_OSX
 #define _XOPEN_SOURCE
 #include <sys/ucontext.h>
 #else
 #include <ucontext.h>
 #endif
+#endif
 
 namespace span {
   namespace fibers {
     namespace base {
       class FiberBase {
+      public:
+        /// The name of the context switch backend compiled in, "asm" or "ucontext".
+        static const char *backend();
+
+        /// Fill stacks with a known pattern before each run, so stackHighWaterMark()
+        /// can tell how deep a fiber went. This touches (and so commits) every page
+        /// of every stack, only turn it on to measure.
+        static void paintStacks(bool paint);
+        static bool paintStacks();
+
       protected:
         FiberBase();
         explicit FiberBase(uint32 stack_size);
@@ -30,28 +51,50 @@ namespace span {
         void switchContext(class FiberBase *to);
 
         void* stackId() {
+#ifdef SPAN_FIBER_ASM
+          return &mSp;
+#else
           return &mCtx;
+#endif
         }
 
         void* stackPtr() {
           return mStack;
         }
 
+        size_t stackSize() const {
+          return mStackSize;
+        }
+
+        /// Deepest point of the stack the last run reached in bytes, or 0 if
+        /// the stack was not painted before that run.
+        size_t stackHighWaterMark() const;
+
       private:
         FiberBase(const FiberBase& rhs) = delete;
         static void trampoline(void* ptr);
+        void paint();
 
         bool mInit;
+        // mPainted: the stack holds nothing but paint. mTracked: the current (or last)
+        // run started on a freshly painted stack.
+        bool mPainted, mTracked;
 #ifdef HAVE_VALGRIND
         int mValgrindStackId;
 #endif
         void* mStack;
-        uint32 stackSize;
+        uint32 mStackSize;
 
+#ifdef SPAN_FIBER_ASM
+        // Saved stack pointer while this fiber is switched out. All other state
+        // lives on the fiber's own stack.
+        void* mSp;
+#else
         union {
           ucontext_t mCtx;
           jmp_buf mEnv;
         };
+#endif
       };
     }  // namespace base
   }  // namespace fibers
@@ -3,15 +3,25 @@
 #if PLATFORM == PLATFORM_UNIX
 #if UNIX_FLAVOUR != UNIX_FLAVOUR_BSD && UNIX_FLAVOUR != UNIX_FLAVOUR_OSX
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <algorithm>
 #include <exception>
 #include <vector>
 
 #include "span/fibers/Fiber.hh"
 #include "span/exceptions/Assert.hh"
+#include "span/io/Uring.hh"
 
 #include "glog/logging.h"
 
@@ -97,6 +107,16 @@ namespace span {
         os << "EPOLLRDHUP";
         one = true;
       }
+#ifdef EPOLLEXCLUSIVE
+      if (events & EPOLLEXCLUSIVE) {
+        if (one) {
+          os << " | ";
+        }
+        os << "EPOLLEXCLUSIVE";
+        one = true;
+      }
+      events = (EPOLL_EVENTS)(events & ~EPOLLEXCLUSIVE);
+#endif
       events = (EPOLL_EVENTS)(
         events & ~(EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLET | EPOLLONESHOT | EPOLLRDHUP));
       if (events) {
@@ -108,7 +128,18 @@ namespace span {
       return os;
     }
 
-    IOManager::AsyncState::AsyncState() : fd(0), events(NONE) {}
+    // epoll_event::data for fd's registration; generation 0 is the tickle eventfd.
+    static inline uint64 eventKey(int fd, uint32 generation) {
+      return (static_cast<uint64>(generation) << 32) | static_cast<uint32>(fd);
+    }
+
+    // Submission queue size; also how many operations can queue up before we submit them without waiting
+    // for the idle loop to do it.
+    static const unsigned kUringEntries = 256;
+    static const size_t kSubmitBatch = 32;
+
+    IOManager::AsyncState::AsyncState() : fd(0), generation(0), events(NONE), ready(NONE), registered(false),
+      exclusive(false), kept(false), reading(nullptr), writing(nullptr) {}
 
     IOManager::AsyncState::~AsyncState() noexcept(false) {
       absl::MutexLock lock(&mutex);
@@ -128,6 +159,11 @@ namespace span {
       }
     }
 
+    IOManager::CompletionOp *&IOManager::AsyncState::opForEvent(Event event) {
+      SPAN_ASSERT(event == READ || event == WRITE);
+      return event == READ ? reading : writing;
+    }
+
     bool IOManager::AsyncState::triggerEvent(Event event, std::atomic<size_t> *pendingEventCount) {
       if (!(events & event)) {
         return false;
@@ -163,14 +199,18 @@ namespace span {
       // is released, and it is surely run in the Scheduler working fiber instead of the idle fiber.
       // It is fine to pass context address to the function since the address will always be valid
       // until ~IOManager()
-      context.scheduler->schedule(std::bind(&IOManager::AsyncState::asyncResetContext, this, context));
+      context.scheduler->schedule([this, old = std::move(context)]() mutable { asyncResetContext(old); });
       context.scheduler = NULL;
       context.fiber.reset();
       context.dg = NULL;
     }
 
-    IOManager::IOManager(size_t threads, bool useCaller, bool autoStart) : span::fibers::Scheduler(threads, useCaller),
-      pendingEventCount(0) {
+    IOManager::IOManager(size_t threads, bool useCaller, bool autoStart, bool completionIO) :
+      span::fibers::Scheduler(threads, useCaller),
+      tickled(false), pwait2(false), timerFd(-1), timerFdDeadline(0), pendingEventCount(0), nextGeneration(1) {
+      for (size_t i = 0; i < FD_CHUNKS; ++i) {
+        fdChunks[i].store(nullptr, std::memory_order_relaxed);
+      }
       epfd = epoll_create(5000);
       if (epfd <= 0) {
         LOG(ERROR) << this << " epoll_create(5000): " << epfd;
@@ -178,49 +218,88 @@ namespace span {
       } else {
         LOG(INFO) << this << " epoll_create(5000): " << epfd;
       }
-      int rc = pipe(tickleFds);
-      if (rc) {
-        LOG(ERROR) << this << " pipe(): " << rc;
+      tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (tickleFd < 0) {
+        LOG(ERROR) << this << " eventfd(): " << tickleFd;
         close(epfd);
-        throw std::current_exception();
+        throw std::runtime_error("eventfd");
       } else {
-        LOG(INFO) << this << " pipe(): " << rc;
+        LOG(INFO) << this << " eventfd(): " << tickleFd;
       }
 
-      SPAN_ASSERT(tickleFds[0] > 0);
-      SPAN_ASSERT(tickleFds[1] > 0);
-
       epoll_event event;
       memset(&event, 0, sizeof(epoll_event));
       event.events = EPOLLIN | EPOLLET;
-      event.data.fd = tickleFds[0];
-      rc = fcntl(tickleFds[0], F_SETFL, O_NONBLOCK);
-      if (rc == -1) {
-        close(tickleFds[0]);
-        close(tickleFds[1]);
-        close(epfd);
-        throw std::current_exception();
-      }
+      event.data.u64 = eventKey(tickleFd, 0);
 
-      rc = epoll_ctl(epfd, EPOLL_CTL_ADD, tickleFds[0], &event);
+      int rc = epoll_ctl(epfd, EPOLL_CTL_ADD, tickleFd, &event);
       if (rc) {
-        LOG(ERROR) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << tickleFds[0]
+        LOG(ERROR) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << tickleFd
           << ", EPOLLIN | EPOLLET): " << rc;
-        close(tickleFds[0]);
-        close(tickleFds[1]);
+        close(tickleFd);
         close(epfd);
         throw std::current_exception();
       } else {
-        LOG(INFO) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << tickleFds[0]
+        LOG(INFO) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << tickleFd
           << ", EPOLLIN | EPOLLET): " << rc;
       }
 
+#ifdef __NR_epoll_pwait2
+      {
+        timespec zero = {0, 0};
+        epoll_event ignored;
+        pwait2 = syscall(__NR_epoll_pwait2, epfd, &ignored, 1, &zero, NULL, 0) >= 0;
+      }
+#endif
+      if (!pwait2) {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = eventKey(timerFd, 0);
+        if (timerFd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, timerFd, &event)) {
+          close(timerFd);
+          timerFd = -1;
+        }
+        if (timerFd < 0) {
+          LOG(WARNING) << this << " no epoll_pwait2 or timerfd, timers will fire to the millisecond";
+        }
+      }
+      LOG(INFO) << this << " timer waits through " << (pwait2 ? "epoll_pwait2" : "timerfd ") << timerFd;
+
+      if (completionIO) {
+        try {
+          uring.reset(new Uring(kUringEntries));
+        } catch (std::runtime_error &) {
+          LOG(WARNING) << this << " no usable io_uring, waiting for readiness instead";
+        }
+      }
+      if (uring) {
+        // Completions wake epoll_wait like any other event.
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = eventKey(uring->fd(), 0);
+        rc = epoll_ctl(epfd, EPOLL_CTL_ADD, uring->fd(), &event);
+        if (rc) {
+          LOG(ERROR) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << uring->fd()
+            << ", EPOLLIN | EPOLLET): " << rc;
+          if (timerFd >= 0) {
+            close(timerFd);
+          }
+          close(tickleFd);
+          close(epfd);
+          throw std::runtime_error("epoll_ctl");
+        } else {
+          LOG(INFO) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD," << uring->fd()
+            << ", EPOLLIN | EPOLLET): " << rc;
+        }
+      }
+
       if (autoStart) {
         try {
           start();
         } catch (...) {
-          close(tickleFds[0]);
-          close(tickleFds[1]);
+          if (timerFd >= 0) {
+            close(timerFd);
+          }
+          close(tickleFd);
           close(epfd);
           throw;
         }
@@ -231,16 +310,98 @@ namespace span {
       stop();
       close(epfd);
       LOG(INFO) << this << " close(" << epfd << ")";
-      close(tickleFds[0]);
-      LOG(INFO) << this << " close(" << tickleFds[0] << ")";
-      close(tickleFds[1]);
-      // Yes it would be more C++-esque to store a std::shared_ptr in the vec,
-      // but that would require an extra alloc per fd for the counter.
-      for (size_t i = 0; i < pendingEvents.size(); ++i) {
-        if (pendingEvents[i]) {
-          delete pendingEvents[i];
+      close(tickleFd);
+      LOG(INFO) << this << " close(" << tickleFd << ")";
+      if (timerFd >= 0) {
+        close(timerFd);
+      }
+      for (size_t i = 0; i < FD_CHUNKS; ++i) {
+        FdChunk *chunk = fdChunks[i].load(std::memory_order_acquire);
+        if (!chunk) {
+          continue;
+        }
+        for (size_t j = 0; j < FD_CHUNK_SIZE; ++j) {
+          delete chunk->states[j].load(std::memory_order_acquire);
         }
+        delete chunk;
       }
+      for (AsyncState *state : freeStates) {
+        delete state;
+      }
+    }
+
+    std::atomic<IOManager::AsyncState *> *IOManager::slotFor(int fd, bool create) {
+      size_t index = static_cast<size_t>(fd) >> FD_CHUNK_BITS;
+      if (index >= FD_CHUNKS) {
+        if (create) {
+          LOG(ERROR) << this << " fd " << fd << " is past the end of the fd table";
+          throw std::runtime_error("fd out of range");
+        }
+        return nullptr;
+      }
+      FdChunk *chunk = fdChunks[index].load(std::memory_order_acquire);
+      if (!chunk) {
+        if (!create) {
+          return nullptr;
+        }
+        // Value initialised, so every slot starts out null.
+        FdChunk *fresh = new FdChunk();
+        if (fdChunks[index].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel,
+          std::memory_order_acquire)) {
+          chunk = fresh;
+        } else {
+          // Someone else got there first, chunk is theirs.
+          delete fresh;
+        }
+      }
+      return &chunk->states[static_cast<size_t>(fd) & (FD_CHUNK_SIZE - 1)];
+    }
+
+    IOManager::AsyncState *IOManager::lookupState(int fd) {
+      std::atomic<AsyncState *> *slot = slotFor(fd, false);
+      return slot ? slot->load(std::memory_order_acquire) : nullptr;
+    }
+
+    IOManager::AsyncState *IOManager::lookupOrCreateState(int fd) {
+      std::atomic<AsyncState *> *slot = slotFor(fd, true);
+      AsyncState *state = slot->load(std::memory_order_acquire);
+      if (state) {
+        return state;
+      }
+      {
+        absl::MutexLock lock(&freeStatesMutex);
+        if (!freeStates.empty()) {
+          state = freeStates.back();
+          freeStates.pop_back();
+        }
+      }
+      if (!state) {
+        state = new AsyncState();
+      }
+      {
+        absl::MutexLock lock(&state->mutex);
+        state->fd = fd;
+      }
+      AsyncState *existing = nullptr;
+      if (slot->compare_exchange_strong(existing, state, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return state;
+      }
+      releaseState(state);
+      return existing;
+    }
+
+    void IOManager::releaseState(AsyncState *state) {
+      {
+        absl::MutexLock lock(&state->mutex);
+        SPAN_ASSERT(!state->events);
+        state->fd = 0;
+        state->ready = NONE;
+        state->registered = state->exclusive = state->kept = false;
+        // Anything still in flight was cancelled by unregisterFd(), and reaping it only needs the op.
+        state->reading = state->writing = nullptr;
+      }
+      absl::MutexLock lock(&freeStatesMutex);
+      freeStates.push_back(state);
     }
 
     bool IOManager::stopping() {
@@ -248,43 +409,66 @@ namespace span {
       return stopping(&timeout);
     }
 
-    void IOManager::registerEvent(int fd, Event event, std::function<void()> dg) {
+    void IOManager::registerEvent(int fd, Event event, span::fibers::Task dg, bool exclusive) {
       SPAN_ASSERT(fd > 0);
       SPAN_ASSERT(Scheduler::getThis());
       SPAN_ASSERT(dg || span::fibers::Fiber::getThis());
       SPAN_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-      // Look up our state in the global map, expanding it if necessary.
-      AsyncState *state = nullptr;
-      {
-        absl::MutexLock lock(&mutex);
-        if (pendingEvents.size() < static_cast<size_t>(fd)) {
-          pendingEvents.resize(fd * 3 / 2);
-        }
-        if (!pendingEvents[fd - 1]) {
-          pendingEvents[fd - 1] = new AsyncState();
-          pendingEvents[fd - 1]->fd = fd;
-        }
-        state = pendingEvents[fd - 1];
-        SPAN_ASSERT(fd == state->fd);
-      }
+      AsyncState *state = lookupOrCreateState(fd);
       absl::MutexLock lock(&state->mutex);
+      // fd can't be closed while we're waiting to use it.
+      SPAN_ASSERT(fd == state->fd);
 
       SPAN_ASSERT(!(state->events & event));
-      int op = state->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-      epoll_event epevent;
-      epevent.events = EPOLLET | state->events | event;
-      epevent.data.ptr = state;
-
-      int rc = epoll_ctl(epfd, op, fd, &epevent);
-      if (rc) {
-        LOG(ERROR) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
+      // Unless fd was kept, it may have been closed and its number reused since the last wait without
+      // epoll or us finding out, so with nobody waiting on it the registration is made afresh.
+      if (!state->registered || (!state->kept && state->events == NONE)) {
+        // Everything we could ever wait for, edge triggered, so the registration never has to change.
+        epoll_event epevent;
+        uint32 generation = nextGeneration.fetch_add(1, std::memory_order_relaxed);
+        if (generation == 0) {
+          generation = nextGeneration.fetch_add(1, std::memory_order_relaxed);
+        }
+        epevent.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+#ifdef EPOLLEXCLUSIVE
+        if (exclusive) {
+          // EPOLLRDHUP isn't allowed with it, and a listening socket has no use for it anyway.
+          epevent.events = EPOLLET | EPOLLIN | EPOLLEXCLUSIVE;
+        }
+#else
+        exclusive = false;
+#endif
+        epevent.data.u64 = eventKey(fd, generation);
+
+        int op = EPOLL_CTL_ADD;
+        int rc = epoll_ctl(epfd, op, fd, &epevent);
+        if (rc && errno == EEXIST) {
+          // Still there from an earlier wait, or a dup of fd was closed without unregisterFd(); point
+          // epoll back at us. EPOLLEXCLUSIVE can't be modified in, so that means starting over.
+          if (exclusive) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+          } else {
+            op = EPOLL_CTL_MOD;
+          }
+          rc = epoll_ctl(epfd, op, fd, &epevent);
+        }
+        if (rc) {
+          LOG(ERROR) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
           throw std::current_exception();
-      } else {
-        LOG(INFO) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
-      }
+        } else {
+          LOG(INFO) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
+        }
+        state->registered = true;
+        state->exclusive = exclusive;
+        state->generation = generation;
+        // Adding (or modifying) polls fd again, so whatever is ready now will be reported afresh.
+        state->ready = NONE;
+      }
+      // Nothing but EPOLLIN would ever come.
+      SPAN_ASSERT(!state->exclusive || event == READ);
       pendingEventCount++;
       state->events = (Event)(state->events | event);
       AsyncState::EventContext &context = state->contextForEvent(event);
@@ -297,48 +481,31 @@ namespace span {
       } else {
         context.fiber = span::fibers::Fiber::getThis();
       }
+
+      if (state->ready & event) {
+        // Already happened, and epoll won't say so again until the next edge.
+        state->ready = (Event)(state->ready & ~event);
+        state->triggerEvent(event, &pendingEventCount);
+      }
     }
 
     bool IOManager::unregisterEvent(int fd, Event event) {
       SPAN_ASSERT(fd > 0);
       SPAN_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-      AsyncState *state = nullptr;
-      {
-        absl::MutexLock lock(&mutex);
-        if (pendingEvents.size() < static_cast<size_t>(fd)) {
-          return false;
-        }
-        if (!pendingEvents[fd - 1]) {
-          return false;
-        }
-        state = pendingEvents[fd - 1];
-        SPAN_ASSERT(fd == state->fd);
+      AsyncState *state = lookupState(fd);
+      if (!state) {
+        return false;
       }
 
       absl::MutexLock lock(&state->mutex);
-      if (!(state->events & event)) {
+      // Recycled for another fd since we looked it up, so there's nothing of ours in it.
+      if (fd != state->fd || !(state->events & event)) {
         return false;
       }
 
-      SPAN_ASSERT(fd == state->fd);
-      Event newEvents = (Event)(state->events &~event);
-      int op = newEvents ? EPOLL_CTL_MOD: EPOLL_CTL_DEL;
-      epoll_event epevent;
-      epevent.events = EPOLLET | newEvents;
-      epevent.data.ptr = state;
-
-      int rc = epoll_ctl(epfd, op, fd, &epevent);
-      if (rc) {
-        LOG(ERROR) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
-        throw std::current_exception();
-      } else {
-        LOG(INFO) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
-      }
       pendingEventCount--;
-      state->events = newEvents;
+      state->events = (Event)(state->events & ~event);
       AsyncState::EventContext &context = state->contextForEvent(event);
       // spawn a dedicated fiber to do the cleanup.
       state->resetContext(context);
@@ -349,41 +516,233 @@ namespace span {
       SPAN_ASSERT(fd > 0);
       SPAN_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-      AsyncState *state = nullptr;
-      {
-        absl::MutexLock lock(&mutex);
-        if (pendingEvents.size() < static_cast<size_t>(fd)) {
-          return false;
-        }
-        if (!pendingEvents[fd - 1]) {
-          return false;
-        }
-        state = pendingEvents[fd - 1];
-        SPAN_ASSERT(fd == state->fd);
+      AsyncState *state = lookupState(fd);
+      if (!state) {
+        return false;
+      }
+      absl::MutexLock lock(&state->mutex);
+      if (fd != state->fd) {
+        return false;
+      }
+      if (event != CLOSE && state->opForEvent(event)) {
+        cancelIO(state->opForEvent(event));
+        return true;
       }
-      absl::MutexLock(&state->mutex);
       if (!(state->events & event)) {
         return false;
       }
 
+      state->triggerEvent(event, &pendingEventCount);
+      return true;
+    }
+
+    void IOManager::unregisterFd(int fd) {
+      SPAN_ASSERT(fd > 0);
+
+      std::atomic<AsyncState *> *slot = slotFor(fd, false);
+      AsyncState *state = slot ? slot->load(std::memory_order_acquire) : nullptr;
+      if (!state) {
+        return;
+      }
+
+      {
+        absl::MutexLock lock(&state->mutex);
+        SPAN_ASSERT(fd == state->fd);
+        state->triggerEvent(READ, &pendingEventCount);
+        state->triggerEvent(WRITE, &pendingEventCount);
+        state->triggerEvent(CLOSE, &pendingEventCount);
+        if (state->reading) {
+          cancelIO(state->reading);
+        }
+        if (state->writing) {
+          cancelIO(state->writing);
+        }
+        if (state->registered) {
+          epoll_event epevent;
+          memset(&epevent, 0, sizeof(epoll_event));
+          int rc = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &epevent);
+          if (rc) {
+            // Already closed, most likely; either way the caller is about to close it, which takes it out of
+            // epoll, and destructors call this.
+            LOG(WARNING) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_DEL, " << fd << "): " << rc << " ("
+              << errno << ")";
+          } else {
+            LOG(INFO) << this << " epoll_ctl(" << epfd << ", EPOLL_CTL_DEL, " << fd << "): " << rc;
+          }
+        }
+        slot->store(nullptr, std::memory_order_release);
+      }
+      releaseState(state);
+    }
+
+    void IOManager::keepRegistered(int fd) {
+      SPAN_ASSERT(fd > 0);
+
+      AsyncState *state = lookupOrCreateState(fd);
+      absl::MutexLock lock(&state->mutex);
       SPAN_ASSERT(fd == state->fd);
-      Event newEvents = (Event)(state->events &~event);
-      int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-      epoll_event epevent;
-      epevent.events = EPOLLET | newEvents;
-      epevent.data.ptr = state;
+      if (!state->kept && state->events == NONE) {
+        // What's there may be left over from an earlier fd with this number, so add it once more.
+        state->registered = false;
+      }
+      state->kept = true;
+    }
 
-      int rc = epoll_ctl(epfd, op, fd, &epevent);
-      if (rc) {
-        LOG(ERROR) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
-        throw std::current_exception();
-      } else {
-        LOG(INFO) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-          << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc;
+    ssize_t IOManager::performIO(int fd, Event event, io_uring_sqe *sqe) {
+      SPAN_ASSERT(uring);
+      SPAN_ASSERT(Scheduler::getThis());
+      SPAN_ASSERT(span::fibers::Fiber::getThis());
+
+      CompletionOp op;
+      op.fd = fd;
+      op.event = event;
+      op.scheduler = Scheduler::getThis();
+      op.fiber = span::fibers::Fiber::getThis();
+      op.result = 0;
+      sqe->user_data = reinterpret_cast<uint64>(&op);
+
+      AsyncState *state = lookupOrCreateState(fd);
+      {
+        absl::MutexLock lock(&state->mutex);
+        SPAN_ASSERT(fd == state->fd);
+        SPAN_ASSERT(!state->opForEvent(event));
+        state->opForEvent(event) = &op;
+        ++pendingEventCount;
       }
-      state->triggerEvent(event, &pendingEventCount);
-      return true;
+      // Normally the idle loop submits, batching whatever every fiber queued in the meantime.
+      if (uring->push(*sqe) >= kSubmitBatch) {
+        uring->submit();
+      }
+      Scheduler::yieldTo();
+
+      if (op.result == -EAGAIN) {
+        // Kernels that honour O_NONBLOCK rather than polling for us.
+        registerEvent(fd, event);
+        Scheduler::yieldTo();
+      }
+      if (op.result < 0) {
+        errno = -op.result;
+        return -1;
+      }
+      return op.result;
+    }
+
+    void IOManager::cancelIO(CompletionOp *op) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_ASYNC_CANCEL;
+      sqe.fd = -1;
+      sqe.addr = reinterpret_cast<uint64>(op);
+      // Cancellations complete with no user data; the operation reports for itself.
+      sqe.user_data = 0;
+      uring->push(sqe);
+      uring->submit();
+    }
+
+    void IOManager::reapCompletions() {
+      size_t reaped = uring->reap([this](uint64 userData, int32 result) {
+        if (!userData) {
+          return;
+        }
+        CompletionOp *op = reinterpret_cast<CompletionOp *>(userData);
+        AsyncState *state = lookupState(op->fd);
+        if (state) {
+          absl::MutexLock lock(&state->mutex);
+          if (state->fd == op->fd && state->opForEvent(op->event) == op) {
+            state->opForEvent(op->event) = nullptr;
+          }
+        }
+        op->result = result;
+        // op is gone as soon as the fiber runs.
+        span::fibers::Scheduler *scheduler = op->scheduler;
+        std::shared_ptr<span::fibers::Fiber> fiber = std::move(op->fiber);
+        scheduler->schedule(&fiber);
+        --pendingEventCount;
+      });
+      LOG(INFO) << this << " reaped " << reaped << " completions";
+    }
+
+    ssize_t IOManager::recvmsg(int fd, msghdr *msg, int flags) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_RECVMSG;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<uint64>(msg);
+      sqe.len = 1;
+      sqe.msg_flags = flags;
+      return performIO(fd, READ, &sqe);
+    }
+
+    ssize_t IOManager::sendmsg(int fd, const msghdr *msg, int flags) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_SENDMSG;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<uint64>(msg);
+      sqe.len = 1;
+      sqe.msg_flags = flags;
+      return performIO(fd, WRITE, &sqe);
+    }
+
+    int IOManager::accept(int fd, int flags) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_ACCEPT;
+      sqe.fd = fd;
+      sqe.accept_flags = flags;
+      return static_cast<int>(performIO(fd, READ, &sqe));
+    }
+
+    int IOManager::connect(int fd, const sockaddr *addr, socklen_t addrLen) {
+      // IORING_OP_CONNECT won't wait on a non-blocking socket, so start the connect ourselves and have
+      // io_uring tell us when it's done.
+      if (!::connect(fd, addr, addrLen)) {
+        return 0;
+      }
+      if (errno != EINPROGRESS) {
+        return -1;
+      }
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_POLL_ADD;
+      sqe.fd = fd;
+      sqe.poll32_events = POLLOUT;
+      if (performIO(fd, WRITE, &sqe) < 0 && errno != EAGAIN) {
+        return -1;
+      }
+      int err = 0;
+      socklen_t size = sizeof(int);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size)) {
+        return -1;
+      }
+      if (err) {
+        errno = err;
+        return -1;
+      }
+      return 0;
+    }
+
+    ssize_t IOManager::readv(int fd, const iovec *iov, int count) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_READV;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<uint64>(iov);
+      sqe.len = count;
+      // The current file position, like readv(2).
+      sqe.off = ~0ull;
+      return performIO(fd, READ, &sqe);
+    }
+
+    ssize_t IOManager::writev(int fd, const iovec *iov, int count) {
+      io_uring_sqe sqe;
+      memset(&sqe, 0, sizeof(io_uring_sqe));
+      sqe.opcode = IORING_OP_WRITEV;
+      sqe.fd = fd;
+      sqe.addr = reinterpret_cast<uint64>(iov);
+      sqe.len = count;
+      sqe.off = ~0ull;
+      return performIO(fd, WRITE, &sqe);
     }
 
     bool IOManager::stopping(uint64 *nextTimeout) {
@@ -394,19 +753,38 @@ namespace span {
     void IOManager::idle() {
       epoll_event events[64];
       while (true) {
+        // Here rather than once up front, to pick up shardByThread() called after we started. The timerfd
+        // (see waitForEvents()) wakes whichever thread epoll picks, which can only fire shared timers, so
+        // with one every thread's timers stay shared.
+        if (timerFd < 0) {
+          attachThread();
+        }
         uint64 nextTimeout;
         if (stopping(&nextTimeout)) {
+          clearLoopTime();
+          detachThread();
           return;
         }
+        // Everything fibers queued up since we were last here goes to the kernel in one go.
+        if (uring) {
+          uring->submit();
+        }
+        // Work often turns up a few microseconds later; catching it here is much cheaper than
+        // sleeping in epoll_wait and being woken by a tickle.
+        if (nextTimeout != 0 && spinForWork()) {
+          updateLoopTime();
+          try {
+            span::fibers::Fiber::yield();
+          } catch (...) {
+            clearLoopTime();
+            detachThread();
+            return;
+          }
+          continue;
+        }
         int rc;
-        int timeout;
         do {
-          if (nextTimeout != ~0ull) {
-            timeout = static_cast<int>((nextTimeout / 1000) + 1);
-          } else {
-            timeout = -1;
-          }
-          rc = epoll_wait(epfd, events, 64, timeout);
+          rc = waitForEvents(events, 64, nextTimeout);
           if (rc < 0 && errno == EINTR) {
             nextTimeout = nextTimer();
           } else {
@@ -415,31 +793,47 @@ namespace span {
         } while (true);
 
         if (rc < 0) {
-          LOG(ERROR) << this << " epoll_wait(" << epfd << ", 64, " << timeout << "): " << rc;
+          LOG(ERROR) << this << " epoll_wait(" << epfd << ", 64, " << nextTimeout << "us): " << rc;
           throw std::current_exception();
         } else {
-          LOG(INFO) << this << " epoll_wait(" << epfd << ", 64, " << timeout << "): " << rc;
+          LOG(INFO) << this << " epoll_wait(" << epfd << ", 64, " << nextTimeout << "us): " << rc;
         }
-        std::vector<std::function<void()>> expired = processTimers();
+        std::vector<span::fibers::Task> expired = processTimers(updateLoopTime());
         if (!expired.empty()) {
           schedule(expired.begin(), expired.end());
           expired.clear();
         }
 
-        std::exception_ptr exception;
         for (int i = 0; i < rc; ++i) {
           epoll_event &event = events[i];
-          if (event.data.fd == tickleFds[0]) {
-            unsigned char dummy;
-            int rc2;
-            while ((rc2 = read(tickleFds[0], &dummy, 1)) == 1) {
-              LOG(INFO) << this << " received tickle";
-            }
-            SPAN_ASSERT(rc2 < 0 && errno == EAGAIN);
+          if (event.data.u64 == eventKey(tickleFd, 0)) {
+            uint64_t count;
+            int rc2 = read(tickleFd, &count, sizeof(count));
+            SPAN_ASSERT(rc2 == sizeof(count) || (rc2 < 0 && errno == EAGAIN));
+            LOG(INFO) << this << " received tickle";
+            // Only after the read, or a tickle in between could be left with nothing to wake anyone.
+            // One landing before this is fine: we're awake and about to look for its work.
+            tickled = false;
+            continue;
+          }
+          if (timerFd >= 0 && event.data.u64 == eventKey(timerFd, 0)) {
+            // Only here to wake us; the timers it was armed for get processed above.
+            uint64_t count;
+            int rc2 = read(timerFd, &count, sizeof(count));
+            SPAN_ASSERT(rc2 == sizeof(count) || (rc2 < 0 && errno == EAGAIN));
+            continue;
+          }
+          if (uring && event.data.u64 == eventKey(uring->fd(), 0)) {
+            reapCompletions();
             continue;
           }
 
-          AsyncState *state = static_cast<AsyncState *>(event.data.ptr);
+          int fd = static_cast<int>(event.data.u64 & 0xffffffff);
+          uint32 generation = static_cast<uint32>(event.data.u64 >> 32);
+          AsyncState *state = lookupState(fd);
+          if (!state) {
+            continue;
+          }
 
           absl::MutexLock lock2(&state->mutex);
           LOG(INFO) << " epoll_event {" << (EPOLL_EVENTS)event.events << ", " << state->fd
@@ -460,60 +854,87 @@ namespace span {
             incomingEvents |= CLOSE;
           }
 
-          // Nothing will be triggered, probably because a prior cancelEvent call
-          // (probably on a different thread) already triggered it, so no
-          // need to tell epoll anything.
-          if ((state->events & incomingEvents) == NONE) {
+          // Reported before unregisterFd() took fd out of the set, it belongs to whatever fd was before.
+          if (state->fd != fd || !state->registered || state->generation != generation) {
             continue;
           }
 
-          int remainingEvents = (state->events & ~incomingEvents);
-          int op = remainingEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-          event.events = EPOLLET | remainingEvents;
-
-          int rc2 = epoll_ctl(epfd, op, state->fd, &event);
-          if (rc2) {
-            LOG(ERROR) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-              << state->fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc2;
-            exception = std::current_exception();
-          } else {
-            LOG(INFO) << this << " epoll_ctl(" << epfd << ", " << (epoll_ctl_op_t)op << ", "
-              << state->fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc2;
-          }
+          // The registration is edge triggered, so this is the only time we'll hear about these;
+          // remember the ones nobody is waiting for yet.
+          state->ready = (Event)(state->ready | (incomingEvents & ~state->events));
 
-          bool triggered = false;
           if (incomingEvents & READ) {
-            triggered = state->triggerEvent(READ, &pendingEventCount);
+            state->triggerEvent(READ, &pendingEventCount);
           }
           if (incomingEvents & WRITE) {
-            triggered = state->triggerEvent(WRITE, &pendingEventCount) || triggered;
+            state->triggerEvent(WRITE, &pendingEventCount);
           }
           if (incomingEvents & CLOSE) {
-            triggered = state->triggerEvent(CLOSE, &pendingEventCount) || triggered;
+            state->triggerEvent(CLOSE, &pendingEventCount);
           }
-          SPAN_ASSERT(triggered);
-        }
-
-        if (exception) {
-          throw exception;
         }
 
         try {
           span::fibers::Fiber::yield();
         } catch (...) {
+          clearLoopTime();
+          detachThread();
           return;
         }
       }
     }
 
+    int IOManager::waitForEvents(epoll_event *events, int maxEvents, uint64 timeoutUs) {
+      if (timeoutUs == ~0ull) {
+        return epoll_wait(epfd, events, maxEvents, -1);
+      }
+#ifdef __NR_epoll_pwait2
+      if (pwait2) {
+        timespec timeout;
+        timeout.tv_sec = timeoutUs / 1000000;
+        timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+        return static_cast<int>(syscall(__NR_epoll_pwait2, epfd, events, maxEvents, &timeout, NULL, 0));
+      }
+#endif
+      // Rounded up, so we never wake before a timer is due.
+      uint64 timeoutMs = (timeoutUs + 999) / 1000;
+      if (timerFd >= 0 && timeoutUs % 1000) {
+        // Wakes a thread on the microsecond; the millisecond timeout is only a backstop.
+        itimerspec spec;
+        memset(&spec, 0, sizeof(itimerspec));
+        clock_gettime(CLOCK_MONOTONIC, &spec.it_value);
+        const uint64 nowNs = spec.it_value.tv_sec * 1000000000ull + spec.it_value.tv_nsec;
+        const uint64 deadlineNs = nowNs + timeoutUs * 1000;
+        spec.it_value.tv_sec = deadlineNs / 1000000000;
+        spec.it_value.tv_nsec = deadlineNs % 1000000000;
+        // Every waiting thread shares it, so it's only ever brought forward (unless what it was set for has
+        // passed), and nobody's wake up gets pushed back. One that comes early just wakes a thread to set it
+        // again.
+        absl::MutexLock lock(&timerFdMutex);
+        if (timerFdDeadline <= nowNs || deadlineNs < timerFdDeadline) {
+          if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+            LOG(WARNING) << this << " timerfd_settime(" << timerFd << "): (" << errno << ")";
+          } else {
+            timerFdDeadline = deadlineNs;
+          }
+        }
+      }
+      return epoll_wait(epfd, events, maxEvents, static_cast<int>(std::min<uint64>(timeoutMs, INT_MAX)));
+    }
+
     void IOManager::tickle() {
       if (!hasIdleThreads()) {
         LOG(INFO) << this << " 0 idle threads, no tickle.";
         return;
       }
-      int rc = write(tickleFds[1], "T", 1);
-      LOG(INFO) << this << " write(" << tickleFds[1] << ", 1): " << rc;
-      SPAN_ASSERT(rc == 1);
+      if (tickled.exchange(true)) {
+        LOG(INFO) << this << " tickle already pending.";
+        return;
+      }
+      uint64_t one = 1;
+      int rc = write(tickleFd, &one, sizeof(one));
+      LOG(INFO) << this << " write(" << tickleFd << ", 1): " << rc;
+      SPAN_ASSERT(rc == sizeof(one));
     }
 
   }  // namespace io
@@ -1,6 +1,9 @@
 #ifndef SPAN_SRC_SPAN_IO_IOMANAGEREPOLL_HH_
 #define SPAN_SRC_SPAN_IO_IOMANAGEREPOLL_HH_
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include <atomic>
 #include <functional>
 #include <memory>
@@ -15,12 +18,24 @@
 #if PLATFORM == PLATFORM_UNIX
 #if UNIX_FLAVOUR != UNIX_FLAVOUR_BSD && UNIX_FLAVOUR != UNIX_FLAVOUR_OSX
 
+// `--define io=uring` makes io_uring the default for socket and stream IO.
+#ifdef SPAN_IO_URING
+#define SPAN_IO_URING_DEFAULT true
+#else
+#define SPAN_IO_URING_DEFAULT false
+#endif
+
+struct epoll_event;
+struct io_uring_sqe;
+
 namespace span {
   namespace fibers {
     class Fiber;
   }
 
   namespace io {
+    class Uring;
+
     class IOManager : public span::fibers::Scheduler, public span::TimerManager {
     public:
       enum Event {
@@ -32,15 +47,34 @@ namespace span {
 
       /**
        * @param autoStart - Whether or not to call the start() automatically in the constructor.
+       * @param completionIO - Run socket and stream IO through io_uring, where the kernel has a
+       *   usable one; otherwise (or if false) everything waits for readiness through epoll.
        *
        * NOTE: @p autoStart provides a more friendly behavior for dervied classes.
+       *
+       * NOTE: Where the kernel has no epoll_pwait2 (before 5.11), shardByThread() is ignored: timers wake
+       * through one timerfd, and whichever thread epoll wakes for it has to be able to fire them.
        */
-      explicit IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+      explicit IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool completionIO = SPAN_IO_URING_DEFAULT);
       ~IOManager() noexcept(false);
 
       bool stopping();
 
-      void registerEvent(int fd, Event events, std::function<void()> dg = NULL);
+      /**
+       * Waits for @p events on @p fd, running @p dg (or resuming the calling fiber) once it happens.
+       *
+       * Unless fd is kept, each wait adds it to epoll afresh, as its number may have been closed and reused
+       * since the last one. Once keepRegistered(fd) is called, fd stays registered until unregisterFd(), so
+       * waiting again costs no epoll_ctl. If epoll reported the event while nobody was waiting, it fires
+       * straight away. Callers retry their IO and register again on EAGAIN, so a stale report only costs one
+       * extra attempt.
+       *
+       * @p exclusive adds fd with EPOLLEXCLUSIVE, for a listening socket several IOManagers accept on
+       * (see Socket::share()): each connection then wakes one of them rather than all. It only counts
+       * on the first registration, and such an fd can only be waited on for READ.
+       */
+      void registerEvent(int fd, Event events, span::fibers::Task dg = NULL, bool exclusive = false);
       /**
        * Unregisters an event, returning true if it was successfully unregistered.
        *
@@ -51,6 +85,36 @@ namespace span {
        * NOTE: This function will cause the event to fire.
        */
       bool cancelEvent(int fd, Event events);
+      /**
+       * Drops the epoll registration for @p fd; call this before closing it, so a new fd that reuses
+       * the number isn't mistaken for one epoll already knows about. Anything still waiting on fd is
+       * woken, as if cancelled.
+       */
+      void unregisterFd(int fd);
+      /**
+       * Promises unregisterFd() will be called before @p fd is closed, so its epoll registration can
+       * be left in place between waits. Call it before waiting on a freshly opened fd.
+       */
+      void keepRegistered(int fd);
+
+      /// Whether IO goes through io_uring, the calls below are only usable if so.
+      bool completionIO() const {
+        return uring != nullptr;
+      }
+      /**
+       * io_uring versions of the syscalls: each submits the operation, suspends the calling fiber until
+       * it completes, and then returns like the syscall would (-1 and errno on failure).
+       *
+       * cancelEvent(fd, READ) cancels a receive, read or accept in progress, cancelEvent(fd, WRITE) a
+       * send, write or connect; the call then fails with ECANCELED. If the kernel refuses to wait on a
+       * non-blocking fd itself, these wait for readiness instead and fail with EAGAIN, to be retried.
+       */
+      ssize_t recvmsg(int fd, msghdr *msg, int flags);
+      ssize_t sendmsg(int fd, const msghdr *msg, int flags);
+      int accept(int fd, int flags);
+      int connect(int fd, const sockaddr *addr, socklen_t addrLen);
+      ssize_t readv(int fd, const iovec *iov, int count);
+      ssize_t writev(int fd, const iovec *iov, int count);
 
     protected:
       bool stopping(uint64 *nextTimeout);
@@ -62,6 +126,15 @@ namespace span {
       }
 
     private:
+      // A fiber waiting on an io_uring operation; lives on that fiber's stack.
+      struct CompletionOp {
+        int fd;
+        Event event;
+        span::fibers::Scheduler *scheduler;
+        std::shared_ptr<span::fibers::Fiber> fiber;
+        int32 result;
+      };
+
       struct AsyncState {
         AsyncState();
         ~AsyncState() noexcept(false);
@@ -71,27 +144,79 @@ namespace span {
           EventContext() : scheduler(NULL) {}
           span::fibers::Scheduler *scheduler;
           std::shared_ptr<span::fibers::Fiber> fiber;
-          std::function<void()> dg;
+          span::fibers::Task dg;
         };
 
         EventContext &contextForEvent(Event event);
+        CompletionOp *&opForEvent(Event event);
         bool triggerEvent(Event event, std::atomic<size_t> *pendingEventCount);
         void resetContext(EventContext &);
 
         int fd;
+        // Unique per epoll registration and carried in its events, so ones left over from a
+        // previous owner of fd (or of this state) can be told apart.
+        uint32 generation;
         EventContext in, out, close;
+        // What's being waited for.
         Event events;
+        // What epoll reported while nobody was waiting for it.
+        Event ready;
+        // Whether fd is in the epoll set, and whether it went in with EPOLLEXCLUSIVE.
+        bool registered, exclusive;
+        // Whether the owner promised unregisterFd() before closing fd (see keepRegistered()).
+        bool kept;
+        // io_uring operations in progress, so cancelEvent() can find them.
+        CompletionOp *reading, *writing;
         absl::Mutex mutex;
 
       private:
         void asyncResetContext(EventContext &);
       };
 
+      // Two level radix table from fd to its AsyncState. Lookups are a couple of atomic loads, chunks
+      // are published with a CAS the first time an fd in their range shows up, and neither level is
+      // ever shrunk, so readers never need a lock.
+      static const size_t FD_CHUNK_BITS = 10;
+      static const size_t FD_CHUNK_SIZE = 1 << FD_CHUNK_BITS;
+      static const size_t FD_CHUNKS = 4096;
+
+      struct FdChunk {
+        std::atomic<AsyncState *> states[FD_CHUNK_SIZE];
+      };
+
+      std::atomic<AsyncState *> *slotFor(int fd, bool create);
+      AsyncState *lookupState(int fd);
+      AsyncState *lookupOrCreateState(int fd);
+      void releaseState(AsyncState *state);
+
+      ssize_t performIO(int fd, Event event, io_uring_sqe *sqe);
+      void cancelIO(CompletionOp *op);
+      void reapCompletions();
+      // epoll_wait for up to @p timeoutUs (~0ull for ever), as precisely as the kernel lets us.
+      int waitForEvents(epoll_event *events, int maxEvents, uint64 timeoutUs);
+
       int epfd;
-      int tickleFds[2];
+      // eventfd that wakes a thread out of epoll_wait.
+      int tickleFd;
+      // Set from the first tickle() until an idle thread drains tickleFd, so a burst of
+      // tickles costs a single write.
+      std::atomic<bool> tickled;
+      // How waits for the next timer get finer than epoll_wait's milliseconds: epoll_pwait2 (5.11+) takes
+      // a timespec, otherwise a timerfd in the epoll set goes off on time. -1 when it's neither.
+      bool pwait2;
+      int timerFd;
+      // Every thread shares the timerfd, and whichever one epoll wakes handles it; it's set for the earliest
+      // CLOCK_MONOTONIC deadline, in ns, any of them is waiting for.
+      absl::Mutex timerFdMutex;
+      uint64 timerFdDeadline;
       std::atomic<size_t> pendingEventCount;
-      absl::Mutex mutex;
-      std::vector<AsyncState*> pendingEvents;
+      std::unique_ptr<Uring> uring;
+      std::atomic<FdChunk *> fdChunks[FD_CHUNKS];
+      std::atomic<uint32> nextGeneration;
+      // States of closed fds, handed out again to new ones. They're never freed before the IOManager
+      // is, because a lookup racing with unregisterFd() may still be about to lock one.
+      absl::Mutex freeStatesMutex;
+      std::vector<AsyncState *> freeStates;
     };
   }  // namespace io
 }  // namespace span
@@ -14,7 +14,7 @@
 
 namespace span {
   namespace io {
-    IOManager::IOManager(size_t threads, bool useCaller, bool autoStart) {
+    IOManager::IOManager(size_t threads, bool useCaller, bool autoStart, bool completionIO) {
       kqfd = kqueue();
       if (kqfd <= 0) {
         LOG(ERROR) << this << " kqueue(): " << kqfd;
@@ -70,7 +70,7 @@ namespace span {
       return stopping(&timeout);
     }
 
-    void IOManager::registerEvent(int fd, Event events, std::function<void()> dg) {
+    void IOManager::registerEvent(int fd, Event events, fibers::Task dg, bool exclusive) {
       SPAN_ASSERT(fd > 0);
       SPAN_ASSERT(Scheduler::getThis());
       SPAN_ASSERT(fibers::Fiber::getThis());
@@ -101,15 +101,17 @@ namespace span {
 
       if (events == READ || events == WRITE) {
         SPAN_ASSERT(!e.dg && !e.fiber);
-        e.dg = dg;
-        if (!dg) {
+        if (dg) {
+          e.dg = std::move(dg);
+        } else {
           e.fiber = fibers::Fiber::getThis();
         }
         e.scheduler = Scheduler::getThis();
       } else {
         SPAN_ASSERT(!e.dgClose && !e.fiberClose);
-        e.dgClose = dg;
-        if (!dg) {
+        if (dg) {
+          e.dgClose = std::move(dg);
+        } else {
           e.fiberClose = fibers::Fiber::getThis();
         }
         e.schedulerClose = Scheduler::getThis();
@@ -141,7 +143,7 @@ namespace span {
 
       Scheduler *scheduler;
       fibers::Fiber::ptr fiber;
-      std::function<void()> dg;
+      fibers::Task dg;
 
       if (events == READ) {
         scheduler = e.scheduler;
@@ -150,9 +152,9 @@ namespace span {
         if (e.fiberClose || e.dgClose)  {
           if (dg || fiber) {
             if (dg) {
-              scheduler->schedule(dg);
+              scheduler->schedule(&dg);
             } else {
-              scheduler->schedule(fiber);
+              scheduler->schedule(&fiber);
             }
           }
           return;
@@ -164,9 +166,9 @@ namespace span {
         if (e.fiber || e.dg) {
           if (dg || fiber) {
             if (dg) {
-              scheduler->schedule(dg);
+              scheduler->schedule(&dg);
             } else {
-              scheduler->schedule(fiber);
+              scheduler->schedule(&fiber);
             }
           }
           return;
@@ -256,10 +258,27 @@ namespace span {
       struct kevent events[64];
 
       while (true) {
+        // Here rather than once up front, to pick up shardByThread() called after we started.
+        attachThread();
         uint64 nextTimeout;
         if (stopping(&nextTimeout)) {
+          clearLoopTime();
+          detachThread();
           return;
         }
+        // Work often turns up a few microseconds later; catching it here is much cheaper than
+        // sleeping in kevent and being woken by a tickle.
+        if (nextTimeout != 0 && spinForWork()) {
+          updateLoopTime();
+          try {
+            fibers::Fiber::yield();
+          } catch (...) {
+            clearLoopTime();
+            detachThread();
+            return;
+          }
+          continue;
+        }
         int rc;
 
         do {
@@ -283,7 +302,7 @@ namespace span {
         } else {
           LOG(INFO) << this << " kevent(" << kqfd << "): " << rc;
         }
-        std::vector<std::function<void()>> expired = processTimers();
+        std::vector<fibers::Task> expired = processTimers(updateLoopTime());
         if (!expired.empty()) {
           schedule(expired.begin(), expired.end());
           expired.clear();
@@ -363,6 +382,8 @@ namespace span {
         try {
           fibers::Fiber::yield();
         } catch (...) {
+          clearLoopTime();
+          detachThread();
           return;
         }
       }
@@ -7,8 +7,11 @@
 
 #if UNIX_FLAVOUR == UNIX_FLAVOUR_BSD
 
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -29,14 +32,48 @@ namespace span {
         CLOSE
       };
 
-      explicit IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+      // There's no io_uring here, @p completionIO is accepted for the sake of portable callers.
+      explicit IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        bool completionIO = false);
       ~IOManager();
 
       bool stopping();
 
-      void registerEvent(int fd, Event events, std::function<void()> dg = NULL);
+      // kqueue has no EPOLLEXCLUSIVE to ask for, @p exclusive is accepted for the sake of portable callers.
+      void registerEvent(int fd, Event events, fibers::Task dg = NULL, bool exclusive = false);
       void cancelEvent(int fd, Event events);
       void unregisterEvent(int fd, Event events);
+      // kqueue forgets about an fd when it's closed, nothing to do.
+      void unregisterFd(int fd) {}
+      void keepRegistered(int fd) {}
+      bool completionIO() const {
+        return false;
+      }
+      // Only there so callers needn't care which backend they have; never used, since completionIO() is false.
+      ssize_t recvmsg(int fd, msghdr *msg, int flags) {
+        errno = ENOSYS;
+        return -1;
+      }
+      ssize_t sendmsg(int fd, const msghdr *msg, int flags) {
+        errno = ENOSYS;
+        return -1;
+      }
+      int accept(int fd, int flags) {
+        errno = ENOSYS;
+        return -1;
+      }
+      int connect(int fd, const sockaddr *addr, socklen_t addrLen) {
+        errno = ENOSYS;
+        return -1;
+      }
+      ssize_t readv(int fd, const iovec *iov, int count) {
+        errno = ENOSYS;
+        return -1;
+      }
+      ssize_t writev(int fd, const iovec *iov, int count) {
+        errno = ENOSYS;
+        return -1;
+      }
 
     protected:
       bool stopping(uint64 *nextTimeout);
@@ -53,7 +90,7 @@ namespace span {
 
         Scheduler *scheduler, *schedulerClose;
         std::shared_ptr<span::fibers::Fiber> fiber, fiberClose;
-        std::function<void()> dg, dgClose;
+        fibers::Task dg, dgClose;
       };
 
       int kqfd;
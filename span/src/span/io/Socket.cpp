@@ -1,6 +1,7 @@
 #include "span/io/Socket.hh"
 
 #include "span/Common.hh"
+#include "span/Sleep.hh"
 #include "span/exceptions/Assert.hh"
 #include "span/fibers/Fiber.hh"
 #include "glog/logging.h"
@@ -11,14 +12,28 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/udp.h>
+#include <poll.h>
 
 #define closesocket close
 #endif
 
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
+
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -42,6 +57,18 @@ namespace span {
         UDP = IPPROTO_UDP
       };
 
+      // Most datagrams sendBatch() and receiveBatch() hand the kernel at once.
+      static const size_t kMaxBatch = 64;
+      // How long an accept loop waits before trying again after accept() fails (out of fds or memory, say).
+      static const uint64 kAcceptRetryUs = 10000;
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      // Set on accepted sockets by accept4() itself, saving an fcntl() each.
+      static const int kAcceptFlags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+#else
+      static const int kAcceptFlags = 0;
+#endif
+
       static inline bool isInterupted(int errnoVal) {
         switch (errnoVal) {
 #if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
@@ -109,7 +136,11 @@ namespace span {
       cancelledSend_(0),
       cancelledReceive_(0),
       isConnected_(false),
-      isRegisteredForRemoteClose_(false) {
+      isRegisteredForRemoteClose_(false),
+      exclusiveAccept_(false),
+      zeroCopyThreshold_(~0ull),
+      zeroCopySends_(0),
+      zeroCopyCompletions_(0) {
       // Windows accepts type == 0 as implying SOCK_STREAM; other OS's aren't so lenient.
       SPAN_ASSERT(type != 0);
     }
@@ -119,7 +150,11 @@ namespace span {
       protocol_(protocol),
       ioManager_(NULL),
       isConnected_(false),
-      isRegisteredForRemoteClose_(false) {
+      isRegisteredForRemoteClose_(false),
+      exclusiveAccept_(false),
+      zeroCopyThreshold_(~0ull),
+      zeroCopySends_(0),
+      zeroCopyCompletions_(0) {
       // Windows accepts type == 0 as implying SOCK_STREAM; other OS's aren't so lenient.
       SPAN_ASSERT(type != 0);
 
@@ -148,7 +183,11 @@ namespace span {
       cancelledSend_(0),
       cancelledReceive_(0),
       isConnected_(false),
-      isRegisteredForRemoteClose_(false) {
+      isRegisteredForRemoteClose_(false),
+      exclusiveAccept_(false),
+      zeroCopyThreshold_(~0ull),
+      zeroCopySends_(0),
+      zeroCopyCompletions_(0) {
       // Windows accepts type == 0 as implying SOCK_STREAM; other OS's aren't so lenient.
       SPAN_ASSERT(type != 0);
 
@@ -164,6 +203,8 @@ namespace span {
         ::closesocket(sock_);
         throw std::runtime_error("fcntl");
       }
+      // ~Socket() unregisters sock_ before closing it.
+      ioManager_->keepRegistered(sock_);
 #endif
 #if PLATFORM == PLATFORM_DARWIN || UNIX_FLAVOUR == UNIX_FLAVOUR_OSX
       unsigned int opt = 1;
@@ -176,9 +217,15 @@ namespace span {
 
     Socket::~Socket() {
 #if PLATFORM != PLATFORM_WIN32
+      // Nothing can be waiting, but a deadline that fired late could still be armed.
+      disarmTimeout(IOManager::READ);
+      disarmTimeout(IOManager::WRITE);
       if (isRegisteredForRemoteClose_) {
         ioManager_->unregisterEvent(sock_, IOManager::CLOSE);
       }
+      if (ioManager_ && sock_ != -1) {
+        ioManager_->unregisterFd(sock_);
+      }
 #endif
       if (sock_ != -1) {
         int rc = ::closesocket(sock_);
@@ -216,7 +263,25 @@ namespace span {
         DLOG(INFO) << this << " connect(" << sock_ << ", " << to << ") local: " << *(localAddress());
       } else {
 #if PLATFORM != PLATFORM_WIN32
-        if (!::connect(sock_, to.name(), to.nameLen())) {
+        if (ioManager_->completionIO()) {
+          if (cancelledSend_) {
+            LOG(ERROR) << this << " connect(" << sock_ << ", " << to << "): (" << cancelledSend_ << ")";
+            throw std::runtime_error("connect cancelledSend_");
+          }
+          armTimeout(IOManager::WRITE);
+          int rc = ioManager_->connect(sock_, to.name(), to.nameLen());
+          error_t error = lastError();
+          disarmTimeout(IOManager::WRITE);
+          if (cancelledSend_) {
+            LOG(ERROR) << this << " connect(" << sock_ << ", " << to << "): (" << cancelledSend_ << ")";
+            throw std::runtime_error("connect cancelledSend_");
+          }
+          if (rc) {
+            LOG(ERROR) << this << " connect(" << sock_ << ", " << to << "): (" << error << ")";
+            throw std::runtime_error("connect");
+          }
+          DLOG(INFO) << this << " connect(" << sock_ << ", " << to << ") local: " << *(localAddress());
+        } else if (!::connect(sock_, to.name(), to.nameLen())) {
           DLOG(INFO) << this << " connect(" << sock_ << ", " << to << ") local: " << *(localAddress());
           // Worked first time
           return;
@@ -230,21 +295,9 @@ namespace span {
             throw std::runtime_error("connect cancelledSend_");
           }
 
-          Timer::ptr timeout;
-          if (sendTimeout_ != ~0ull) {
-            timeout = ioManager_->registerTimer(
-              sendTimeout_,
-              std::bind(
-                &Socket::cancelIo,
-                this,
-                IOManager::WRITE,
-                &cancelledSend_,
-                ETIMEDOUT));
-          }
+          armTimeout(IOManager::WRITE);
           ::span::fibers::Scheduler::yieldTo();
-          if (timeout) {
-            timeout->cancel();
-          }
+          disarmTimeout(IOManager::WRITE);
           if (cancelledSend_) {
             LOG(ERROR) << this << " connect(" << sock_ << ", " << to << "): (" << cancelledSend_ << ")";
             throw std::runtime_error("connect cancelledSend_");
@@ -271,13 +324,31 @@ namespace span {
       }
     }
 
-    void Socket::listen(int backlog) {
+    void Socket::listen(int backlog, bool exclusive) {
       int rc = ::listen(sock_, backlog);
       if (rc) {
         LOG(ERROR) << this << " listen(" << sock_ << ", " << backlog << "): " << rc << "(" << lastError() << ")";
         throw std::runtime_error("listen");
       }
       DLOG(INFO) << this << " listen(" << sock_ << ", " << backlog << "): " << rc << " (" << lastError() << ")";
+      exclusiveAccept_ = exclusive;
+    }
+
+    Socket::ptr Socket::share(IOManager *ioManager) {
+      // The dup shares O_NONBLOCK with us, so both ends have to be waiting through an IOManager.
+      SPAN_ASSERT(ioManager_ && ioManager);
+      socket_t newsock = fcntl(sock_, F_DUPFD_CLOEXEC, 0);
+      if (newsock == -1) {
+        LOG(ERROR) << this << " dup(" << sock_ << "): (" << lastError() << ")";
+        throw std::runtime_error("dup");
+      }
+      Socket::ptr result(new Socket(ioManager, family_, type(), protocol_, 0));
+      result->sock_ = newsock;
+      ioManager->keepRegistered(newsock);
+      result->receiveTimeout_ = receiveTimeout_;
+      result->exclusiveAccept_ = exclusiveAccept_;
+      DLOG(INFO) << this << " dup(" << sock_ << "): " << newsock << " (" << result.get() << ")";
+      return result;
     }
 
     Socket::ptr Socket::accept() {
@@ -286,6 +357,174 @@ namespace span {
       return sock;
     }
 
+    std::vector<Socket::ptr> Socket::acceptBatch(size_t max) {
+      std::vector<Socket::ptr> result;
+      int sockType = type();
+      Socket::ptr sock(new Socket(ioManager_, family_, sockType, protocol_, 0));
+      accept(sock);
+      result.push_back(sock);
+#if PLATFORM != PLATFORM_WIN32
+      // A blocking listener would wait for another connection rather than say there isn't one.
+      while (ioManager_ && result.size() < max) {
+        error_t error;
+        sock.reset(new Socket(ioManager_, family_, sockType, protocol_, 0));
+        socket_t newsock = acceptNow(&sock->remoteAddress_, &error);
+        if (newsock == -1) {
+          // Whatever went wrong will come up again for the next accept(), which can throw with nothing lost.
+          if (error != EAGAIN) {
+            DLOG(INFO) << this << " accept(" << sock_ << "): " << newsock << " (" << error << ")";
+          }
+          break;
+        }
+        sock->sock_ = newsock;
+        ioManager_->keepRegistered(newsock);
+        sock->isConnected_ = true;
+        result.push_back(sock);
+      }
+      DLOG(INFO) << this << " acceptBatch(" << sock_ << ", " << max << "): " << result.size();
+#endif
+      return result;
+    }
+
+    std::vector<Socket::ptr> Socket::listenSharded(IOManager *ioManager, const Address &address,
+      std::function<void(Socket::ptr)> onAccept, bool steerByCpu, int type, int backlog) {
+      // Everything the IOManager runs on: the hijacked thread, if there is one, then those it spawned.
+      std::vector<std::thread::id> threads;
+      if (ioManager->rootThreadId() != std::thread::id()) {
+        threads.push_back(ioManager->rootThreadId());
+      }
+      for (const std::shared_ptr<std::thread> &thread : ioManager->Threads()) {
+        threads.push_back(thread->get_id());
+      }
+      SPAN_ASSERT(!threads.empty());
+
+      std::vector<Socket::ptr> listeners;
+      Address::ptr bindTo;
+      for (size_t i = 0; i < threads.size(); ++i) {
+        Socket::ptr listener(new Socket(ioManager, address.family(), type));
+        int opt = 1;
+        listener->setOption(SOL_SOCKET, SO_REUSEADDR, opt);
+#ifdef SO_REUSEPORT
+        listener->setOption(SOL_SOCKET, SO_REUSEPORT, opt);
+#endif
+        // A port of 0 is only picked once; the rest of the group has to join the first on it.
+        listener->bind(bindTo ? *bindTo : address);
+        if (!bindTo) {
+          bindTo = listener->localAddress();
+        }
+        listeners.push_back(listener);
+      }
+
+      // The CPU each thread's accept loop pins it to, or -1 to leave it be.
+      std::vector<int> cpus(threads.size(), -1);
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      if (steerByCpu) {
+        // Thread i goes on the i'th CPU we may run on (round robin if there are more threads than CPUs), and
+        // socket i in the group (in bind order) takes the connections received on that CPU. Those received
+        // on any other CPU are spread by CPU number.
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        std::vector<int> available;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+          for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+              available.push_back(cpu);
+            }
+          }
+        }
+        std::vector<sock_filter> code;
+        code.push_back({BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)});
+        for (size_t i = 0; i < threads.size() && !available.empty(); ++i) {
+          cpus[i] = available[i % available.size()];
+          if (i < available.size()) {
+            code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<uint32_t>(cpus[i])});
+            code.push_back({BPF_RET | BPF_K, 0, 0, static_cast<uint32_t>(i)});
+          }
+        }
+        code.push_back({BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(listeners.size())});
+        code.push_back({BPF_RET | BPF_A, 0, 0, 0});
+        sock_fprog program;
+        program.len = static_cast<uint16_t>(code.size());
+        program.filter = &code[0];
+        // The group shares one program, so attaching it to any member will do.
+        listeners.front()->setOption(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+      }
+#else
+      if (steerByCpu) {
+        LOG(WARNING) << "listenSharded(" << address << "): can't steer connections by CPU here";
+      }
+#endif
+
+      for (size_t i = 0; i < listeners.size(); ++i) {
+        listeners[i]->listen(backlog);
+        ioManager->schedule(std::bind(&Socket::acceptLoop, listeners[i], onAccept, cpus[i]), threads[i]);
+      }
+      return listeners;
+    }
+
+    void Socket::acceptLoop(Socket::ptr listener, std::function<void(Socket::ptr)> onAccept, int cpu) {
+      std::thread::id thread = std::this_thread::get_id();
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc) {
+          LOG(WARNING) << listener.get() << " accept loop on " << listener->sock_ << " can't pin its thread to CPU "
+            << cpu << ": " << rc;
+        }
+      }
+#endif
+      while (true) {
+        std::vector<Socket::ptr> accepted;
+        try {
+          accepted = listener->acceptBatch();
+        } catch (std::runtime_error &) {
+          if (listener->cancelledReceive_) {
+            return;
+          }
+          // The kernel keeps handing this socket its share of connections, so the loop can't just stop.
+          LOG(ERROR) << listener.get() << " accept loop on " << listener->sock_ << " retrying";
+          span::sleep(listener->ioManager_, kAcceptRetryUs);
+          continue;
+        }
+        for (Socket::ptr &sock : accepted) {
+          listener->ioManager_->schedule(std::bind(onAccept, sock), thread);
+        }
+      }
+    }
+
+#if PLATFORM != PLATFORM_WIN32
+    socket_t Socket::acceptNow(Address::ptr *remote, error_t *error) {
+      sockaddr_storage name;
+      socklen_t nameLen = sizeof(name);
+      socket_t newsock;
+      do {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        newsock = ::accept4(sock_, reinterpret_cast<sockaddr *>(&name), &nameLen, kAcceptFlags);
+#else
+        newsock = ::accept(sock_, reinterpret_cast<sockaddr *>(&name), &nameLen);
+#endif
+        *error = lastError();
+      } while (newsock == -1 && isInterupted(*error));
+      if (newsock == -1) {
+        return -1;
+      }
+#if UNIX_FLAVOUR != UNIX_FLAVOUR_LINUX
+      if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
+        ::close(newsock);
+        throw std::runtime_error("fcntl");
+      }
+#endif
+      // Address::create() doesn't know AF_UNIX, whose peer remoteAddress() looks up when asked.
+      if (name.ss_family == AF_INET || name.ss_family == AF_INET6) {
+        *remote = Address::create(reinterpret_cast<sockaddr *>(&name), nameLen);
+      }
+      return newsock;
+    }
+#endif
+
     void Socket::accept(Socket::ptr target) {
 #if PLATFORM != PLATFORM_WIN32
       SPAN_ASSERT(target->sock_ == -1);
@@ -304,46 +543,44 @@ namespace span {
           &target << ")";
       } else {
 #if PLATFORM != PLATFORM_WIN32
-        int newsock;
         error_t error;
-        do {
-          newsock = ::accept(sock_, NULL, NULL);
-          error = errno;
-        } while (newsock == -1 && isInterupted(error));
+        socket_t newsock = acceptNow(&target->remoteAddress_, &error);
 
         while (newsock == -1 && error == EAGAIN) {
-          ioManager_->registerEvent(sock_, IOManager::READ);
+          bool completion = ioManager_->completionIO();
+          if (!completion) {
+            ioManager_->registerEvent(sock_, IOManager::READ, NULL, exclusiveAccept_);
+          }
           if (cancelledReceive_) {
             LOG(ERROR) << this << " accept(" << sock_ << "): (" << cancelledReceive_ << ")";
-            ioManager_->cancelEvent(sock_, IOManager::READ);
-            ::span::fibers::Scheduler::yieldTo();
+            if (!completion) {
+              ioManager_->cancelEvent(sock_, IOManager::READ);
+              ::span::fibers::Scheduler::yieldTo();
+            }
             throw std::runtime_error("accept");
           }
 
-          Timer::ptr timeout;
-          if (receiveTimeout_ != ~0ull) {
-            timeout = ioManager_->registerTimer(
-              receiveTimeout_,
-              std::bind(
-                &Socket::cancelIo,
-                this,
-                IOManager::READ,
-                &cancelledReceive_,
-                ETIMEDOUT));
-          }
-          ::span::fibers::Scheduler::yieldTo();
-          if (timeout) {
-            timeout->cancel();
+          armTimeout(IOManager::READ);
+          if (completion) {
+            // io_uring won't hand back the peer here, so remoteAddress() looks it up if it's wanted.
+            newsock = ioManager_->accept(sock_, kAcceptFlags);
+            error = lastError();
+          } else {
+            ::span::fibers::Scheduler::yieldTo();
           }
+          disarmTimeout(IOManager::READ);
           if (cancelledReceive_) {
             LOG(ERROR) << this << " accept(" << sock_ << "): (" << cancelledReceive_ << ")";
+            if (newsock != -1) {
+              ::close(newsock);
+            }
             throw std::runtime_error("accept");
           }
+          if (completion) {
+            continue;
+          }
 
-          do {
-            newsock = ::accept(sock_, NULL, NULL);
-            error = lastError();
-          } while (newsock == -1 && isInterupted(error));
+          newsock = acceptNow(&target->remoteAddress_, &error);
         }
 
         if (newsock == -1) {
@@ -351,12 +588,10 @@ namespace span {
           throw std::runtime_error("accept");
         }
 
-        if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
-          ::close(newsock);
-          throw std::runtime_error("fcntl");
-        }
-
         target->sock_ = newsock;
+        if (target->ioManager_) {
+          target->ioManager_->keepRegistered(newsock);
+        }
         DLOG(INFO) << this << " accept(" << sock_ << "): " << newsock << " (" << *(target->remoteAddress()) << ", " <<
           &target << ")";
 #endif
@@ -401,7 +636,8 @@ namespace span {
   }
 
     template<bool isSend>
-    size_t Socket::doIO(iovec *buffers, size_t len, int *flags, Address *address) {
+    size_t Socket::doIO(iovec *buffers, size_t len, int *flags, Address *address, void *control,
+      size_t *controlLen) {
 #if PLATFORM == PLATFORM_UNIX && UNIX_FLAVOUR != UNIX_FLAVOUR_OSX
       *flags |= MSG_NOSIGNAL;
 #endif
@@ -410,7 +646,6 @@ namespace span {
       const char *api = isSend ? "sendmsg" : "recvmsg";
 #endif
       error_t &cancelled = isSend ? cancelledSend_ : cancelledReceive_;
-      uint64 &timeout = isSend ? sendTimeout_ : receiveTimeout_;
 
 #if PLATFORM != PLATFORM_WIN32
       msghdr msg;
@@ -421,6 +656,10 @@ namespace span {
         msg.msg_name = static_cast<sockaddr *>(address->name());
         msg.msg_namelen = address->nameLen();
       }
+      if (control) {
+        msg.msg_control = control;
+        msg.msg_controllen = *controlLen;
+      }
       IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
       if (ioManager_) {
         if (cancelled) {
@@ -437,22 +676,27 @@ namespace span {
       } while (rc == -1 && isInterupted(error));
 
       while (ioManager_ && rc == -1 && error == EAGAIN) {
-        ioManager_->registerEvent(sock_, event);
-        Timer::ptr timer;
-        if (timeout != ~0ull) {
-          timer = ioManager_->registerTimer(
-            timeout,
-            std::bind(&Socket::cancelIo, this, event, &cancelled, ETIMEDOUT));
+        bool completion = ioManager_->completionIO();
+        if (!completion) {
+          ioManager_->registerEvent(sock_, event);
         }
-        ::span::fibers::Scheduler::yieldTo();
-
-        if (timer) {
-          timer->cancel();
+        armTimeout(event);
+        if (completion) {
+          // Rather than waiting to be told to try again, have the kernel do it and hand back the result.
+          rc = isSend ? ioManager_->sendmsg(sock_, &msg, *flags) : ioManager_->recvmsg(sock_, &msg, *flags);
+          error = lastError();
+        } else {
+          ::span::fibers::Scheduler::yieldTo();
         }
+
+        disarmTimeout(event);
         if (cancelled) {
           SPAN_SOCKET_LOG(-1, cancelled);
           throw std::runtime_error(api);
         }
+        if (completion) {
+          continue;
+        }
 
         do {
           rc = isSend ? sendmsg(sock_, &msg, *flags) : recvmsg(sock_, &msg, *flags);
@@ -465,6 +709,9 @@ namespace span {
       }
       if (!isSend) {
         flags = &msg.msg_flags;
+        if (control) {
+          *controlLen = msg.msg_controllen;
+        }
       }
       return rc;
 #endif
@@ -500,7 +747,7 @@ namespace span {
       if (!flags) {
         flags = &flagStorage;
       }
-      return doIO<false>(&buffers, len, flags);
+      return doIO<false>(&buffers, 1, flags);
     }
 
     size_t Socket::receive(iovec *buffers, size_t len, int *flags) {
@@ -530,6 +777,421 @@ namespace span {
       return doIO<false>(buffers, len, flags, from);
     }
 
+    template<bool isSend>
+    size_t Socket::doBatchIO(Datagram *datagrams, size_t count, int flags) {
+      SPAN_ASSERT(count);
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      const char *api = isSend ? "sendmmsg" : "recvmmsg";
+      error_t &cancelled = isSend ? cancelledSend_ : cancelledReceive_;
+      // Don't wait for more than the first: for blocking sockets; non-blocking ones never do.
+      flags |= isSend ? MSG_NOSIGNAL : MSG_WAITFORONE;
+
+      mmsghdr msgs[kMaxBatch];
+      count = std::min(count, kMaxBatch);
+      memset(msgs, 0, sizeof(mmsghdr) * count);
+      for (size_t i = 0; i < count; ++i) {
+        msghdr &msg = msgs[i].msg_hdr;
+        msg.msg_iov = datagrams[i].buffers;
+        msg.msg_iovlen = std::min(datagrams[i].count, static_cast<size_t>(IOV_MAX));
+        if (datagrams[i].address) {
+          msg.msg_name = static_cast<sockaddr *>(datagrams[i].address->name());
+          msg.msg_namelen = datagrams[i].address->nameLen();
+        }
+      }
+      IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
+      if (ioManager_ && cancelled) {
+        LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << count << "): (" << cancelled << ")";
+        throw std::runtime_error(api);
+      }
+      int rc;
+      error_t error;
+
+      do {
+        rc = isSend ? sendmmsg(sock_, msgs, count, flags) : recvmmsg(sock_, msgs, count, flags, NULL);
+        error = lastError();
+      } while (rc == -1 && isInterupted(error));
+
+      // There's no io_uring op for these, so this waits for readiness even with completionIO().
+      while (ioManager_ && rc == -1 && error == EAGAIN) {
+        ioManager_->registerEvent(sock_, event);
+        armTimeout(event);
+        ::span::fibers::Scheduler::yieldTo();
+        disarmTimeout(event);
+        if (cancelled) {
+          LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << count << "): (" << cancelled << ")";
+          throw std::runtime_error(api);
+        }
+
+        do {
+          rc = isSend ? sendmmsg(sock_, msgs, count, flags) : recvmmsg(sock_, msgs, count, flags, NULL);
+          error = lastError();
+        } while (rc == -1 && isInterupted(error));
+      }
+      if (rc == -1) {
+        LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << count << "): (" << error << ")";
+        throw std::runtime_error(api);
+      }
+      DLOG(INFO) << this << " " << api << "(" << sock_ << ", " << count << "): " << rc;
+      for (int i = 0; i < rc; ++i) {
+        datagrams[i].length = msgs[i].msg_len;
+        datagrams[i].flags = msgs[i].msg_hdr.msg_flags;
+      }
+      return rc;
+#else
+      // One at a time; and only one received, as there's no telling whether another has arrived without
+      // possibly waiting for it.
+      size_t done = 0;
+      do {
+        Datagram &datagram = datagrams[done];
+        datagram.flags = flags;
+        datagram.length = doIO<isSend>(datagram.buffers, datagram.count, &datagram.flags, datagram.address);
+      } while (isSend && ++done < count);
+      return isSend ? done : 1;
+#endif
+    }
+
+    size_t Socket::sendBatch(Datagram *datagrams, size_t count, int flags) {
+      return doBatchIO<true>(datagrams, count, flags);
+    }
+
+    size_t Socket::receiveBatch(Datagram *datagrams, size_t count, int flags) {
+      return doBatchIO<false>(datagrams, count, flags);
+    }
+
+    size_t Socket::sendSegments(const void *buffer, size_t len, uint16 segmentSize, int flags, const Address *to) {
+      SPAN_ASSERT(segmentSize);
+      iovec buffers;
+      buffers.iov_base = const_cast<void *>(buffer);
+      buffers.iov_len = len;
+#ifdef UDP_SEGMENT
+      union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        cmsghdr align;
+      } control;
+      memset(&control, 0, sizeof(control));
+      cmsghdr *cmsg = &control.align;
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t size = segmentSize;
+      memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+      size_t controlLen = sizeof(control.buf);
+      return doIO<true>(&buffers, 1, &flags, const_cast<Address *>(to), control.buf, &controlLen);
+#else
+      std::vector<iovec> segments;
+      std::vector<Datagram> datagrams;
+      for (size_t offset = 0; offset < len; offset += segmentSize) {
+        iovec segment;
+        segment.iov_base = static_cast<char *>(buffers.iov_base) + offset;
+        segment.iov_len = std::min<size_t>(segmentSize, len - offset);
+        segments.push_back(segment);
+      }
+      for (iovec &segment : segments) {
+        datagrams.push_back({&segment, 1, const_cast<Address *>(to), 0, 0});
+      }
+      size_t sent = 0;
+      while (sent < datagrams.size()) {
+        sent += sendBatch(&datagrams[sent], datagrams.size() - sent, flags);
+      }
+      return len;
+#endif
+    }
+
+    bool Socket::receiveCoalescing(bool enable) {
+#ifdef UDP_GRO
+      int value = enable ? 1 : 0;
+      if (setsockopt(sock_, SOL_UDP, UDP_GRO, &value, sizeof(value))) {
+        error_t error = lastError();
+        LOG(WARNING) << this << " setsockopt(" << sock_ << ", SOL_UDP, UDP_GRO, " << value << "): (" << error << ")";
+        return false;
+      }
+      return true;
+#else
+      return !enable;
+#endif
+    }
+
+    size_t Socket::receiveSegments(void *buffer, size_t len, std::vector<size_t> *datagrams, Address *from,
+      int *flags) {
+      iovec buffers;
+      buffers.iov_base = buffer;
+      buffers.iov_len = len;
+      int flagStorage = 0;
+      if (!flags) {
+        flags = &flagStorage;
+      }
+      datagrams->clear();
+#ifdef UDP_GRO
+      union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+      } control;
+      size_t controlLen = sizeof(control.buf);
+      size_t received = doIO<false>(&buffers, 1, flags, from, control.buf, &controlLen);
+      size_t segmentSize = received;
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = controlLen;
+      for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int size;
+          memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+          segmentSize = size;
+        }
+      }
+#else
+      size_t received = doIO<false>(&buffers, 1, flags, from);
+      size_t segmentSize = received;
+#endif
+      if (!received) {
+        datagrams->push_back(0);
+      }
+      for (size_t offset = 0; offset < received; offset += segmentSize) {
+        datagrams->push_back(std::min(segmentSize, received - offset));
+      }
+      return received;
+    }
+
+    bool Socket::zeroCopy(size_t threshold) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+      int value = 1;
+      if (setsockopt(sock_, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value))) {
+        error_t error = lastError();
+        LOG(WARNING) << this << " setsockopt(" << sock_ << ", SOL_SOCKET, SO_ZEROCOPY, 1): (" << error << ")";
+        return false;
+      }
+      zeroCopyThreshold_ = threshold;
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    size_t Socket::sendZeroCopy(const iovec *buffers, size_t len, int flags) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+      size_t total = 0;
+      for (size_t i = 0; i < len && total < zeroCopyThreshold_; ++i) {
+        total += buffers[i].iov_len;
+      }
+      // Under the threshold (always, with zeroCopy() off) copying is cheaper.
+      if (total >= zeroCopyThreshold_) {
+        int zeroCopyFlags = flags | MSG_ZEROCOPY;
+        try {
+          size_t result = doIO<true>(const_cast<iovec *>(buffers), len, &zeroCopyFlags);
+          // The kernel numbers every zero-copy send that gets anything out, from 0.
+          if (result) {
+            ++zeroCopySends_;
+          }
+          return result;
+        } catch (std::runtime_error &) {
+          // Past optmem_max of notifications waiting to be reaped; this one can be copied instead.
+          if (lastError() != ENOBUFS) {
+            throw;
+          }
+        }
+      }
+#endif
+      return doIO<true>(const_cast<iovec *>(buffers), len, &flags);
+    }
+
+    uint32 Socket::zeroCopyCompletions() {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+      while (zeroCopyCompletions_ != zeroCopySends_) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        int rc;
+        error_t error;
+        do {
+          rc = recvmsg(sock_, &msg, MSG_ERRQUEUE);
+          error = lastError();
+        } while (rc == -1 && isInterupted(error));
+        if (rc == -1) {
+          if (error == EAGAIN) {
+            break;
+          }
+          LOG(ERROR) << this << " recvmsg(" << sock_ << ", MSG_ERRQUEUE): (" << error << ")";
+          throw std::runtime_error("recvmsg");
+        }
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+          if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+            continue;
+          }
+          sock_extended_err err;
+          memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+          // Sends ee_info through ee_data (inclusive) are done with; for TCP they finish in order.
+          if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY && err.ee_errno == 0) {
+            zeroCopyCompletions_ += err.ee_data - err.ee_info + 1;
+          }
+        }
+      }
+#endif
+      return zeroCopyCompletions_;
+    }
+
+    void Socket::flushZeroCopy() {
+      while (zeroCopyCompletions() != zeroCopySends_) {
+#if PLATFORM != PLATFORM_WIN32
+        if (!ioManager_) {
+          // Errors are always reported, so there's nothing to ask for.
+          pollfd pfd = {sock_, 0, 0};
+          ::poll(&pfd, 1, -1);
+          continue;
+        }
+        // Notifications come with EPOLLERR, which wakes anything waiting on the socket.
+        ioManager_->registerEvent(sock_, IOManager::WRITE);
+        armTimeout(IOManager::WRITE);
+        ::span::fibers::Scheduler::yieldTo();
+        disarmTimeout(IOManager::WRITE);
+        if (cancelledSend_) {
+          LOG(ERROR) << this << " recvmsg(" << sock_ << ", MSG_ERRQUEUE): (" << cancelledSend_ << ")";
+          throw std::runtime_error("recvmsg");
+        }
+#endif
+      }
+    }
+
+    template<class IO>
+    size_t Socket::doKernelIO(bool isSend, const char *api, size_t len, IO io) {
+      error_t &cancelled = isSend ? cancelledSend_ : cancelledReceive_;
+      IOManager::Event event = isSend ? IOManager::WRITE : IOManager::READ;
+      if (ioManager_ && cancelled) {
+        LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << len << "): (" << cancelled << ")";
+        throw std::runtime_error(api);
+      }
+      ssize_t rc;
+      error_t error;
+      do {
+        rc = io();
+        error = lastError();
+      } while (rc == -1 && isInterupted(error));
+
+      while (ioManager_ && rc == -1 && error == EAGAIN) {
+        ioManager_->registerEvent(sock_, event);
+        armTimeout(event);
+        ::span::fibers::Scheduler::yieldTo();
+        disarmTimeout(event);
+        if (cancelled) {
+          LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << len << "): (" << cancelled << ")";
+          throw std::runtime_error(api);
+        }
+        do {
+          rc = io();
+          error = lastError();
+        } while (rc == -1 && isInterupted(error));
+      }
+      if (rc == -1) {
+        LOG(ERROR) << this << " " << api << "(" << sock_ << ", " << len << "): (" << error << ")";
+        throw std::runtime_error(api);
+      }
+      DLOG(INFO) << this << " " << api << "(" << sock_ << ", " << len << "): " << rc;
+      return rc;
+    }
+
+    size_t Socket::splice(int pipe, size_t len, bool toPipe) {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      return doKernelIO(!toPipe, "splice", len, [&]() {
+        return toPipe ? ::splice(sock_, NULL, pipe, NULL, len, SPLICE_F_MOVE) :
+          ::splice(pipe, NULL, sock_, NULL, len, SPLICE_F_MOVE);
+      });
+#else
+      errno = ENOSYS;
+      throw std::runtime_error("splice");
+#endif
+    }
+
+    size_t Socket::sendFile(int fd, size_t len) {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      return doKernelIO(true, "sendfile", len, [&]() {
+        return ::sendfile(sock_, fd, NULL, len);
+      });
+#else
+      errno = ENOSYS;
+      throw std::runtime_error("sendfile");
+#endif
+    }
+
+    bool Socket::kernelTLS(int direction, const void *cryptoInfo, size_t len) {
+#if defined(TLS_TX) && defined(SOL_TLS)
+      // The "tls" upper layer protocol can only be attached once, for both directions.
+      if (setsockopt(sock_, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) && lastError() != EEXIST) {
+        error_t error = lastError();
+        LOG(WARNING) << this << " setsockopt(" << sock_ << ", IPPROTO_TCP, TCP_ULP, tls): (" << error << ")";
+        return false;
+      }
+      if (setsockopt(sock_, SOL_TLS, direction, cryptoInfo, len)) {
+        error_t error = lastError();
+        LOG(WARNING) << this << " setsockopt(" << sock_ << ", SOL_TLS, " << direction << "): (" << error << ")";
+        return false;
+      }
+      DLOG(INFO) << this << " setsockopt(" << sock_ << ", SOL_TLS, " << direction << "): 0";
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    size_t Socket::sendRecord(const void *buffer, size_t len, uint8 type) {
+#if defined(TLS_SET_RECORD_TYPE) && defined(SOL_TLS)
+      iovec buffers;
+      buffers.iov_base = const_cast<void *>(buffer);
+      buffers.iov_len = len;
+      union {
+        char buf[CMSG_SPACE(sizeof(uint8))];
+        cmsghdr align;
+      } control;
+      memset(&control, 0, sizeof(control));
+      cmsghdr *cmsg = &control.align;
+      cmsg->cmsg_level = SOL_TLS;
+      cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint8));
+      memcpy(CMSG_DATA(cmsg), &type, sizeof(type));
+      size_t controlLen = sizeof(control.buf);
+      int flags = 0;
+      return doIO<true>(&buffers, 1, &flags, NULL, control.buf, &controlLen);
+#else
+      errno = ENOSYS;
+      throw std::runtime_error("sendmsg");
+#endif
+    }
+
+    size_t Socket::receiveRecord(void *buffer, size_t len, uint8 *type, int *flags) {
+#if defined(TLS_GET_RECORD_TYPE) && defined(SOL_TLS)
+      iovec buffers;
+      buffers.iov_base = buffer;
+      buffers.iov_len = len;
+      int flagStorage = 0;
+      if (!flags) {
+        flags = &flagStorage;
+      }
+      union {
+        char buf[CMSG_SPACE(sizeof(uint8))];
+        cmsghdr align;
+      } control;
+      size_t controlLen = sizeof(control.buf);
+      size_t received = doIO<false>(&buffers, 1, flags, NULL, control.buf, &controlLen);
+      // Application data, unless the kernel says otherwise.
+      *type = 23;
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = controlLen;
+      for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+          memcpy(type, CMSG_DATA(cmsg), sizeof(*type));
+        }
+      }
+      return received;
+#else
+      errno = ENOSYS;
+      throw std::runtime_error("recvmsg");
+#endif
+    }
+
     void Socket::getOption(int level, int option, void *result, size_t *len) {
       int ret = getsockopt(sock_, level, option, static_cast<char *>(result), reinterpret_cast<socklen_t *>(len));
       if (ret) {
@@ -588,6 +1250,28 @@ namespace span {
       *cancelled = error;
       ioManager_->cancelEvent(sock_, static_cast<IOManager::Event>(event));
     }
+
+    void Socket::armTimeout(int event) {
+      uint64 timeout = event == IOManager::READ ? receiveTimeout_ : sendTimeout_;
+      if (timeout == ~0ull) {
+        return;
+      }
+      Timer::ptr &deadline = event == IOManager::READ ? receiveDeadline_ : sendDeadline_;
+      if (!deadline) {
+        // Small enough for std::function to keep inline, so firing doesn't allocate either.
+        deadline = ioManager_->createDeadline([this, event]() {
+          cancelIo(event, event == IOManager::READ ? &cancelledReceive_ : &cancelledSend_, ETIMEDOUT);
+        });
+      }
+      deadline->arm(timeout);
+    }
+
+    void Socket::disarmTimeout(int event) {
+      Timer::ptr &deadline = event == IOManager::READ ? receiveDeadline_ : sendDeadline_;
+      if (deadline) {
+        deadline->disarm();
+      }
+    }
 #endif
 
     Address::ptr Socket::emptyAddress() {
@@ -1,6 +1,7 @@
 #ifndef SPAN_SRC_SPAN_IO_SOCKET_HH_
 #define SPAN_SRC_SPAN_IO_SOCKET_HH_
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <stdexcept>
@@ -27,6 +28,8 @@
 #endif
 
 namespace span {
+  class Timer;
+
   namespace io {
     class IOManager;
 
@@ -57,9 +60,27 @@ namespace span {
       void connect(const Address &to);
       void connect(const std::shared_ptr<Address> addr) { connect(*addr.get()); }
 
-      void listen(int backlog = SOMAXCONN);
+      /// With @p exclusive, IOManagers waiting to accept on this socket (or a share() of it) are woken one per
+      /// connection rather than all at once (EPOLLEXCLUSIVE, on Linux). A connection can then wake one that
+      /// isn't waiting right then, to be picked up by its next accept(), so keep something accepting on each.
+      void listen(int backlog = SOMAXCONN, bool exclusive = false);
+      /// Another Socket on @p ioManager for this listening one (a dup() of its fd, sharing its queue of
+      /// connections), for several IOManagers to accept from.
+      Socket::ptr share(IOManager *ioManager);
 
       Socket::ptr accept();
+      /// Waits like accept() for a connection, then takes whatever else is already queued without waiting
+      /// again, up to @p max in all. One wakeup can then drain a backlog built up during a connection storm.
+      std::vector<Socket::ptr> acceptBatch(size_t max = SOMAXCONN);
+
+      /// Listens on @p address with one SO_REUSEPORT socket per @p ioManager thread, each with an accept loop
+      /// pinned to its thread that runs @p onAccept there for every connection, so connections stay on the
+      /// thread the kernel handed them to. With @p steerByCpu (Linux) each thread is also pinned to a CPU of
+      /// its own (for good, and for everything else it runs), and the kernel hands connections to the socket
+      /// of the thread on the CPU that received them. cancelAccept() on the returned sockets stops the loops.
+      static std::vector<Socket::ptr> listenSharded(IOManager *ioManager, const Address &address,
+        std::function<void(Socket::ptr)> onAccept, bool steerByCpu = false, int type = SOCK_STREAM,
+        int backlog = SOMAXCONN);
 
       void shutdown(int how = SHUT_RDWR);
 
@@ -99,6 +120,68 @@ namespace span {
       size_t receiveFrom(void *buffer, size_t length, Address *from, int *flags = NULL);
       size_t receiveFrom(iovec *buffers, size_t length, Address *from, int *flags = NULL);
 
+      /// One datagram for sendBatch() and receiveBatch(): the buffers it's gathered from or scattered into, and
+      /// where it goes or came from (NULL when connected, or not wanted). receiveBatch() fills in length and
+      /// flags.
+      struct Datagram {
+        iovec *buffers;
+        size_t count;
+        Address *address;
+        size_t length;
+        int flags;
+      };
+
+      /// Sends datagrams with as few syscalls as it can (sendmmsg() on Linux), waiting like sendTo() until
+      /// the first can go. Returns how many went, which may be fewer than @p count.
+      size_t sendBatch(Datagram *datagrams, size_t count, int flags = 0);
+      /// Receives whatever datagrams have arrived, up to @p count, in as few syscalls as it can (recvmmsg() on
+      /// Linux), waiting like receiveFrom() for the first but no longer. Returns how many it got.
+      size_t receiveBatch(Datagram *datagrams, size_t count, int flags = 0);
+
+      /// Sends @p length bytes as datagrams of @p segmentSize bytes each (the last may be shorter), handing the
+      /// kernel them all at once to be split up as late as possible (UDP_SEGMENT, on Linux; otherwise they go
+      /// through sendBatch()). Linux takes up to 64KiB and 64 segments at a time.
+      size_t sendSegments(const void *buffer, size_t length, uint16 segmentSize, int flags = 0,
+        const Address *to = NULL);
+      /// Has the kernel coalesce datagrams arriving back to back from the same sender into one receive
+      /// (UDP_GRO), for receiveSegments() to split up again. Returns false where it can't.
+      bool receiveCoalescing(bool enable);
+      /// Receives a datagram, or with receiveCoalescing() a run of them, into @p buffer (which wants to take
+      /// 64KiB then), setting @p datagrams to the length of each. Returns the total.
+      size_t receiveSegments(void *buffer, size_t length, std::vector<size_t> *datagrams, Address *from = NULL,
+        int *flags = NULL);
+
+      /// Lets sendZeroCopy() hand the kernel user memory to send from in place, rather than copying it in
+      /// (SO_ZEROCOPY, Linux 4.14+), for sends of at least @p threshold bytes; the page pinning costs more than
+      /// copying a few KiB. Returns false where it can't, and sendZeroCopy() goes on copying.
+      bool zeroCopy(size_t threshold);
+      size_t zeroCopyThreshold() { return zeroCopyThreshold_; }
+      /// Like send(), but once zeroCopy() is on, and @p buffers add up to zeroCopyThreshold(), the kernel may
+      /// still be reading them after it returns. They must stay untouched until zeroCopyCompletions() catches
+      /// up with the zeroCopySends() this made.
+      size_t sendZeroCopy(const iovec *buffers, size_t length, int flags = 0);
+      /// How many zero-copy sends have gone out, and how many the kernel has said it's done with.
+      uint32 zeroCopySends() { return zeroCopySends_; }
+      uint32 zeroCopyCompletions();
+      /// Waits (like send(), with sendTimeout()) for the kernel to be done with every zero-copy send.
+      void flushZeroCopy();
+
+      /// Kernel-side copies for transferStream(), which wait like receive() and send() when they would block:
+      /// splice() up to @p length bytes from this socket into @p pipe (@p toPipe) or from @p pipe into it, and
+      /// sendfile() up to @p length bytes from @p fd's current position.
+      size_t splice(int pipe, size_t length, bool toPipe);
+      size_t sendFile(int fd, size_t length);
+
+      /// Kernel TLS (kTLS; Linux 4.13+ to send, 4.17+ to receive), for TLSStream::offload(): installs
+      /// @p cryptoInfo (one of linux/tls.h's tls12_crypto_info_*) for @p direction (TLS_TX or TLS_RX), after
+      /// which plain sends go out, and receives come in, as TLS records. Returns false where it can't.
+      bool kernelTLS(int direction, const void *cryptoInfo, size_t length);
+      /// Sends @p length bytes through kTLS as one record of TLS content type @p type, such as an alert.
+      size_t sendRecord(const void *buffer, size_t length, uint8 type);
+      /// Receives through kTLS, setting @p type to the content type of the record(s) it came from; anything
+      /// but application data comes a record at a time.
+      size_t receiveRecord(void *buffer, size_t length, uint8 *type, int *flags = NULL);
+
       std::shared_ptr<Address> emptyAddress();
       std::shared_ptr<Address> remoteAddress();
       std::shared_ptr<Address> localAddress();
@@ -115,18 +198,38 @@ namespace span {
       int family_, protocol_;
       IOManager *ioManager_;
       error_t cancelledSend_, cancelledReceive_;
+      // Armed around each wait while a timeout is set, created the first time one is needed.
+      std::shared_ptr<Timer> sendDeadline_, receiveDeadline_;
       std::shared_ptr<Address> localAddress_, remoteAddress_;
-      bool isConnected_, isRegisteredForRemoteClose_;
+      bool isConnected_, isRegisteredForRemoteClose_, exclusiveAccept_;
+      // ~0 while zero-copy sends are off.
+      size_t zeroCopyThreshold_;
+      uint32 zeroCopySends_, zeroCopyCompletions_;
       slimsig::signal_t<void()> onRemoteClose_;
 
       Socket(IOManager *ioManager, int family, int type, int protocol, int initialize);
 
       template<bool isSend>
-      size_t doIO(iovec *buffers, size_t len, int *flags, Address *address = NULL);
+      // @p control, if given, goes in the msghdr as is, with @p controlLen set to what came back on receive.
+      size_t doIO(iovec *buffers, size_t len, int *flags, Address *address = NULL, void *control = NULL,
+        size_t *controlLen = NULL);
+      template<bool isSend>
+      size_t doBatchIO(Datagram *datagrams, size_t count, int flags);
+      // Runs @p io (a syscall on sock_ returning -1 and errno on failure) until it doesn't say EAGAIN, waiting
+      // for the socket in between.
+      template<class IO>
+      size_t doKernelIO(bool isSend, const char *api, size_t len, IO io);
       static void callOnRemoteClose(Socket *self);
       void registerForRemoteClose();
       void accept(Socket::ptr target);
+      // One non-blocking accept, setting @p remote from the peer address it comes with. -1 with @p error set if
+      // there's nothing to take.
+      socket_t acceptNow(std::shared_ptr<Address> *remote, error_t *error);
+      // Pins the calling thread to @p cpu first, unless it's negative.
+      static void acceptLoop(Socket::ptr listener, std::function<void(Socket::ptr)> onAccept, int cpu);
       void cancelIo(int event, error_t *cancelled, error_t error);
+      void armTimeout(int event);
+      void disarmTimeout(int event);
       Socket(const Socket&) = delete;
     };
 
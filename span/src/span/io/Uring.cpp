@@ -0,0 +1,141 @@
+#include "span/io/Uring.hh"
+
+#if PLATFORM == PLATFORM_UNIX && UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "span/exceptions/Assert.hh"
+
+#include "glog/logging.h"
+
+namespace span {
+  namespace io {
+    // Every suspended fiber can have an operation in flight, far more than we'd submit in one go, so
+    // give completions plenty of room before they spill into the kernel's overflow list.
+    static const unsigned kCompletionsPerEntry = 16;
+
+    template<class T>
+    static T *at(void *base, unsigned offset) {
+      return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+    Uring::Uring(unsigned entries) : ringFd(-1), rings(MAP_FAILED), ringsSize(0), sqes(nullptr), sqesSize(0),
+      unsubmitted(0) {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+      params.cq_entries = entries * kCompletionsPerEntry;
+
+      ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (ringFd < 0) {
+        LOG(WARNING) << this << " io_uring_setup(" << entries << "): " << ringFd << " (" << errno << ")";
+        throw std::runtime_error("io_uring_setup");
+      }
+      const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+      if ((params.features & required) != required) {
+        LOG(WARNING) << this << " io_uring features " << params.features << " lack " << required;
+        close(ringFd);
+        throw std::runtime_error("io_uring_setup");
+      }
+
+      ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+      rings = mmap(nullptr, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+        IORING_OFF_SQ_RING);
+      if (rings == MAP_FAILED) {
+        LOG(ERROR) << this << " mmap(" << ringFd << ", IORING_OFF_SQ_RING): (" << errno << ")";
+        close(ringFd);
+        throw std::runtime_error("mmap");
+      }
+      sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+      void *sqeMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+        IORING_OFF_SQES);
+      if (sqeMap == MAP_FAILED) {
+        LOG(ERROR) << this << " mmap(" << ringFd << ", IORING_OFF_SQES): (" << errno << ")";
+        munmap(rings, ringsSize);
+        close(ringFd);
+        throw std::runtime_error("mmap");
+      }
+      sqes = static_cast<io_uring_sqe *>(sqeMap);
+
+      sqHead = at<unsigned>(rings, params.sq_off.head);
+      sqTail = at<unsigned>(rings, params.sq_off.tail);
+      sqFlags = at<unsigned>(rings, params.sq_off.flags);
+      sqArray = at<unsigned>(rings, params.sq_off.array);
+      sqMask = *at<unsigned>(rings, params.sq_off.ring_mask);
+      sqEntries = params.sq_entries;
+
+      cqHead = at<unsigned>(rings, params.cq_off.head);
+      cqTail = at<unsigned>(rings, params.cq_off.tail);
+      cqMask = *at<unsigned>(rings, params.cq_off.ring_mask);
+      cqes = at<io_uring_cqe>(rings, params.cq_off.cqes);
+
+      LOG(INFO) << this << " io_uring_setup(" << entries << "): " << ringFd << ", " << params.sq_entries << "/"
+        << params.cq_entries << " entries";
+    }
+
+    Uring::~Uring() {
+      munmap(sqes, sqesSize);
+      munmap(rings, ringsSize);
+      close(ringFd);
+    }
+
+    int Uring::enter(unsigned toSubmit, unsigned flags) {
+      int rc;
+      do {
+        rc = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, flags, NULL, 0));
+      } while (rc < 0 && errno == EINTR);
+      return rc < 0 ? -errno : rc;
+    }
+
+    bool Uring::overflowed() const {
+      return __atomic_load_n(sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW;
+    }
+
+    size_t Uring::push(const io_uring_sqe &sqe) {
+      absl::MutexLock lock(&sqMutex);
+      unsigned tail = *sqTail;
+      while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+        // Without SQPOLL the kernel consumes everything we submit before io_uring_enter returns.
+        SPAN_ASSERT(unsubmitted);
+        int rc = enter(unsubmitted, 0);
+        if (rc < 0) {
+          LOG(ERROR) << this << " io_uring_enter(" << ringFd << ", " << unsubmitted << "): (" << -rc << ")";
+          throw std::runtime_error("io_uring_enter");
+        }
+        unsubmitted -= rc;
+      }
+      unsigned index = tail & sqMask;
+      sqes[index] = sqe;
+      sqArray[index] = index;
+      __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+      return ++unsubmitted;
+    }
+
+    void Uring::submit() {
+      absl::MutexLock lock(&sqMutex);
+      if (!unsubmitted) {
+        return;
+      }
+      int rc = enter(unsubmitted, 0);
+      if (rc < 0) {
+        // EBUSY/EAGAIN: out of room for completions or memory, which reaping sorts out; the queue
+        // goes with the next submit.
+        LOG(WARNING) << this << " io_uring_enter(" << ringFd << ", " << unsubmitted << "): (" << -rc << ")";
+        SPAN_ASSERT(rc == -EBUSY || rc == -EAGAIN);
+        return;
+      }
+      LOG(INFO) << this << " io_uring_enter(" << ringFd << ", " << unsubmitted << "): " << rc;
+      unsubmitted -= rc;
+    }
+  }  // namespace io
+}  // namespace span
+
+#endif
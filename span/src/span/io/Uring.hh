@@ -0,0 +1,88 @@
+#ifndef SPAN_SRC_SPAN_IO_URING_HH_
+#define SPAN_SRC_SPAN_IO_URING_HH_
+
+#include "span/Common.hh"
+
+#if PLATFORM == PLATFORM_UNIX && UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#include "absl/synchronization/mutex.h"
+
+namespace span {
+  namespace io {
+    /// A bare io_uring: the submission and completion rings mapped straight from the kernel, with nothing
+    /// but the two syscalls underneath.
+    ///
+    /// Any thread may push() and submit(), and any thread may reap(). Each side has its own lock, so
+    /// submitting never waits on whoever is draining completions.
+    class Uring {
+    public:
+      /// Throws std::runtime_error when the kernel has no io_uring, or one too old for sockets to be
+      /// worth it (IORING_FEAT_FAST_POLL arrived in 5.7, after everything else we use).
+      explicit Uring(unsigned entries);
+      ~Uring();
+      Uring(const Uring &rhs) = delete;
+
+      /// Polls readable whenever completions are waiting to be reaped.
+      int fd() const {
+        return ringFd;
+      }
+
+      /// Queues @p sqe, handing the queue to the kernel first if it's full. Returns how many are now
+      /// queued but not yet submitted.
+      size_t push(const io_uring_sqe &sqe);
+      /// Hands everything queued so far to the kernel.
+      void submit();
+      /// Calls `fn(user_data, res)` for every completion, returning how many there were.
+      template<class Fn>
+      size_t reap(Fn fn);
+
+    private:
+      // Returns -errno on failure.
+      int enter(unsigned toSubmit, unsigned flags);
+      bool overflowed() const;
+
+      int ringFd;
+      void *rings;
+      size_t ringsSize;
+      io_uring_sqe *sqes;
+      size_t sqesSize;
+
+      absl::Mutex sqMutex;
+      unsigned *sqHead, *sqTail, *sqFlags, *sqArray;
+      unsigned sqMask, sqEntries;
+      unsigned unsubmitted;
+
+      absl::Mutex cqMutex;
+      unsigned *cqHead, *cqTail;
+      unsigned cqMask;
+      io_uring_cqe *cqes;
+    };
+
+    template<class Fn>
+    size_t Uring::reap(Fn fn) {
+      absl::MutexLock lock(&cqMutex);
+      size_t reaped = 0;
+      while (true) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++reaped) {
+          const io_uring_cqe &cqe = cqes[head & cqMask];
+          fn(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        // Completions that didn't fit are parked in the kernel until we ask for them.
+        if (!overflowed()) {
+          return reaped;
+        }
+        enter(0, IORING_ENTER_GETEVENTS);
+      }
+    }
+  }  // namespace io
+}  // namespace span
+
+#endif
+
+#endif  // SPAN_SRC_SPAN_IO_URING_HH_
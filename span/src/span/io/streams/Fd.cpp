@@ -37,12 +37,19 @@ namespace span {
             }
             throw std::runtime_error("fcntl");
           }
+          // We unregister fd before closing it; anyone else's might be closed behind our back.
+          if (own) {
+            ioManager_->keepRegistered(fd_);
+          }
         }
       }
 
       FDStream::~FDStream() {
         if (own_ && fd_ >= 0) {
           ::span::fibers::SchedulerSwitcher switcher(scheduler_);
+          if (ioManager_) {
+            ioManager_->unregisterFd(fd_);
+          }
           int rc = ::close(fd_);
           if (rc) {
             LOG(ERROR) << this << " close(" << fd_ << "): " << rc << "(" << lastError() << ")";
@@ -57,6 +64,9 @@ namespace span {
 
         if (fd_ > 0 && own_) {
           ::span::fibers::SchedulerSwitcher switcher(scheduler_);
+          if (ioManager_) {
+            ioManager_->unregisterFd(fd_);
+          }
           int rc = ::close(fd_);
           error_t error = lastError();
           if (rc) {
@@ -81,6 +91,13 @@ namespace span {
         int rc = readv(fd_, &iovs[0], iovs.size());
         while (rc < 0 && lastError() == EAGAIN && ioManager_) {
           DLOG(INFO) << this << " readv(" << fd_ << ", " << len << "): " << rc << " (EGAIN)";
+          if (ioManager_->completionIO()) {
+            rc = ioManager_->readv(fd_, &iovs[0], iovs.size());
+            if (cancelledRead_) {
+              throw std::runtime_error("Operation aborted exception");
+            }
+            continue;
+          }
           ioManager_->registerEvent(fd_, IOManager::READ);
           ::span::fibers::Scheduler::yieldTo();
           if (cancelledRead_) {
@@ -109,6 +126,16 @@ namespace span {
         int rc = ::read(fd_, buff, len);
         while (rc < 0 && lastError() == EAGAIN && ioManager_) {
           DLOG(INFO) << this << " read(" << fd_ << ", " << len << "): " << rc << " (EAGAIN)";
+          if (ioManager_->completionIO()) {
+            iovec iov;
+            iov.iov_base = buff;
+            iov.iov_len = len;
+            rc = ioManager_->readv(fd_, &iov, 1);
+            if (cancelledRead_) {
+              throw std::runtime_error("Operation Aborted Exception");
+            }
+            continue;
+          }
           ioManager_->registerEvent(fd_, IOManager::READ);
           ::span::fibers::Scheduler::yieldTo();
           if (cancelledRead_) {
@@ -128,7 +155,7 @@ namespace span {
       void FDStream::cancelRead() {
         cancelledRead_ = true;
         if (ioManager_) {
-          ioManager_->cancelEvent(fd_, IOManager::WRITE);
+          ioManager_->cancelEvent(fd_, IOManager::READ);
         }
       }
 
@@ -140,17 +167,27 @@ namespace span {
         SPAN_ASSERT(fd_ >= 0);
         len = std::min(len, static_cast<size_t>(std::numeric_limits<ssize_t>::max()));
         const std::vector<iovec> iovs = buff->readBuffers(len);
-        ssize_t rc = 0;
         const int count = std::min(iovs.size(), static_cast<size_t>(IOV_MAX));
+        ssize_t rc = writev(fd_, &iovs[0], count);
 
-        while ((rc = writev(fd_, &iovs[0], count)) < 0 && lastError() == EAGAIN && ioManager_) {
+        while (rc < 0 && lastError() == EAGAIN && ioManager_) {
           DLOG(INFO) << this << " writev(" << fd_ << ", " << len << "): " << rc << " (EAGAIN)";
+          if (ioManager_->completionIO()) {
+            rc = ioManager_->writev(fd_, &iovs[0], count);
+            if (cancelledWrite_) {
+              throw std::runtime_error("Operation aborted exception");
+            }
+            if (rc >= 0 || lastError() != EAGAIN) {
+              break;
+            }
+            continue;
+          }
           ioManager_->registerEvent(fd_, IOManager::WRITE);
           ::span::fibers::Scheduler::yieldTo();
           if (cancelledWrite_) {
             throw std::runtime_error("Operation aborted exception");
           }
-          rc = writev(fd_, &iovs[0], iovs.size());
+          rc = writev(fd_, &iovs[0], count);
         }
         error_t error = lastError();
 
@@ -178,6 +215,16 @@ namespace span {
         int rc = ::write(fd_, buff, len);
         while (rc < 0 && lastError() == EAGAIN && ioManager_) {
           DLOG(INFO) << this << " write(" << fd_ << ", " << len << "): " << rc << " (EAGAIN)";
+          if (ioManager_->completionIO()) {
+            iovec iov;
+            iov.iov_base = const_cast<void *>(buff);
+            iov.iov_len = len;
+            rc = ioManager_->writev(fd_, &iov, 1);
+            if (cancelledWrite_) {
+              throw std::runtime_error("Operation aborted exception!");
+            }
+            continue;
+          }
           ioManager_->registerEvent(fd_, IOManager::WRITE);
           ::span::fibers::Scheduler::yieldTo();
           if (cancelledWrite_) {
@@ -250,6 +297,41 @@ namespace span {
         DLOG(INFO) << this << " ftruncate(" << fd_ << ", " << size << "): " << rc << " (" << error << ")";
       }
 
+      size_t FDStream::splice(int pipe, size_t len, bool toPipe) {
+        bool &cancelled = toPipe ? cancelledRead_ : cancelledWrite_;
+        if (ioManager_ && cancelled) {
+          throw std::runtime_error("Operation aborted exception");
+        }
+        ::span::fibers::SchedulerSwitcher switcher(ioManager_ ? NULL : scheduler_);
+        SPAN_ASSERT(fd_ >= 0);
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        auto io = [&]() {
+          return toPipe ? ::splice(fd_, NULL, pipe, NULL, len, SPLICE_F_MOVE) :
+            ::splice(pipe, NULL, fd_, NULL, len, SPLICE_F_MOVE);
+        };
+        ssize_t rc = io();
+        while (rc < 0 && lastError() == EAGAIN && ioManager_) {
+          DLOG(INFO) << this << " splice(" << fd_ << ", " << len << "): " << rc << " (EAGAIN)";
+          ioManager_->registerEvent(fd_, toPipe ? IOManager::READ : IOManager::WRITE);
+          ::span::fibers::Scheduler::yieldTo();
+          if (cancelled) {
+            throw std::runtime_error("Operation aborted exception");
+          }
+          rc = io();
+        }
+        error_t error = lastError();
+        if (rc < 0) {
+          LOG(ERROR) << this << " splice(" << fd_ << ", " << len << "): " << rc << " (" << error << ")";
+          throw std::runtime_error("splice");
+        }
+        DLOG(INFO) << this << " splice(" << fd_ << ", " << len << "): " << rc << " (" << error << ")";
+        return rc;
+#else
+        errno = ENOSYS;
+        throw std::runtime_error("splice");
+#endif
+      }
+
       void FDStream::flush(bool flushParent) {
         ::span::fibers::SchedulerSwitcher switcher(scheduler_);
         SPAN_ASSERT(fd_ >= 0);
@@ -42,6 +42,9 @@ namespace span {
         int64 size();
         void truncate(int64 size);
         void flush(bool flushParent = true);
+        /// For transferStream(): splice() up to @p len bytes from this fd into @p pipe (@p toPipe) or from
+        /// @p pipe into it, waiting like read() and write() when it would block.
+        size_t splice(int pipe, size_t len, bool toPipe);
 
         int fd() { return fd_; }
 
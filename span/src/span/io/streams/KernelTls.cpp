@@ -0,0 +1,200 @@
+#include "span/io/streams/KernelTls.hh"
+
+#include <cstring>
+#include <string>
+
+#include "span/io/streams/Tls.hh"
+
+#include "glog/logging.h"
+#include "openssl/crypto.h"
+#include "openssl/hmac.h"
+
+namespace span {
+  namespace io {
+    namespace streams {
+      namespace ktls {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        // Every AEAD kTLS takes uses a 12 byte nonce, some of it (the salt) fixed for the connection.
+        static const size_t kNonceLength = 12;
+
+        namespace {
+          // A cipher suite kTLS can take over, by its IANA id.
+          struct KernelCipher {
+            uint16 suite;
+            uint16 type;
+            size_t keyLength;
+            size_t saltLength;
+            const EVP_MD *(*digest)();
+          };
+
+          static const KernelCipher kKernelCiphers[] = {
+            {0x1301, TLS_CIPHER_AES_GCM_128, 16, 4, EVP_sha256},
+            {0x1302, TLS_CIPHER_AES_GCM_256, 32, 4, EVP_sha384},
+            {0x1303, TLS_CIPHER_CHACHA20_POLY1305, 32, 0, EVP_sha256},
+            {0x009c, TLS_CIPHER_AES_GCM_128, 16, 4, EVP_sha256},
+            {0xc02b, TLS_CIPHER_AES_GCM_128, 16, 4, EVP_sha256},
+            {0xc02f, TLS_CIPHER_AES_GCM_128, 16, 4, EVP_sha256},
+            {0x009d, TLS_CIPHER_AES_GCM_256, 32, 4, EVP_sha384},
+            {0xc02c, TLS_CIPHER_AES_GCM_256, 32, 4, EVP_sha384},
+            {0xc030, TLS_CIPHER_AES_GCM_256, 32, 4, EVP_sha384},
+            {0xcca8, TLS_CIPHER_CHACHA20_POLY1305, 32, 0, EVP_sha256},
+            {0xcca9, TLS_CIPHER_CHACHA20_POLY1305, 32, 0, EVP_sha256},
+          };
+        }  // namespace
+#endif
+
+        static std::string hmac(const EVP_MD *digest, const std::string &key, const std::string &data) {
+          uint8 md[EVP_MAX_MD_SIZE];
+          unsigned int length = 0;
+          HMAC(digest, key.data(), key.size(), reinterpret_cast<const uint8 *>(data.data()), data.size(), md,
+            &length);
+          std::string result(reinterpret_cast<char *>(md), length);
+          OPENSSL_cleanse(md, sizeof(md));
+          return result;
+        }
+
+        void cleanse(std::string *secret) {
+          if (!secret->empty()) {
+            OPENSSL_cleanse(&(*secret)[0], secret->size());
+          }
+          secret->clear();
+        }
+
+        std::string expandLabel(const EVP_MD *digest, const std::string &secret, const std::string &label,
+          size_t length) {
+          const std::string fullLabel = "tls13 " + label;
+          std::string info;
+          info += static_cast<char>(length >> 8);
+          info += static_cast<char>(length);
+          info += static_cast<char>(fullLabel.size());
+          info += fullLabel;
+          info += '\0';
+          info += '\1';
+          std::string result = hmac(digest, secret, info);
+          result.resize(length);
+          return result;
+        }
+
+        std::string prf(const EVP_MD *digest, const std::string &secret, const std::string &seed, size_t length) {
+          std::string result, a = seed;
+          while (result.size() < length) {
+            a = hmac(digest, secret, a);
+            std::string block = hmac(digest, secret, a + seed);
+            result += block;
+            cleanse(&block);
+          }
+          cleanse(&a);
+          result.resize(length);
+          return result;
+        }
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        static std::string bigEndian(uint64 value) {
+          std::string result(sizeof(value), '\0');
+          for (size_t i = 0; i < sizeof(value); ++i) {
+            result[i] = static_cast<char>(value >> (8 * (sizeof(value) - 1 - i)));
+          }
+          return result;
+        }
+
+        template<class Info>
+        static size_t fillCryptoInfo(Info *info, uint16 version, uint16 type, const std::string &key,
+          const std::string &salt, const std::string &iv, uint64 sequence) {
+          memset(info, 0, sizeof(*info));
+          info->info.version = version;
+          info->info.cipher_type = type;
+          memcpy(info->key, key.data(), sizeof(info->key));
+          memcpy(info->salt, salt.data(), sizeof(info->salt));
+          memcpy(info->iv, iv.data(), sizeof(info->iv));
+          memcpy(info->rec_seq, bigEndian(sequence).data(), sizeof(info->rec_seq));
+          return sizeof(*info);
+        }
+
+        size_t cryptoInfo(uint16 suite, uint16 version, bool client, uint64 sequence, const std::string &secret,
+          const std::string &randoms, CryptoInfo *info) {
+          const KernelCipher *kernelCipher = NULL;
+          for (const KernelCipher &candidate : kKernelCiphers) {
+            if (candidate.suite == suite) {
+              kernelCipher = &candidate;
+            }
+          }
+          if (!kernelCipher || secret.empty()) {
+            return 0;
+          }
+          const EVP_MD *digest = kernelCipher->digest();
+          const size_t keyLength = kernelCipher->keyLength, saltLength = kernelCipher->saltLength;
+
+          std::string key, salt, iv;
+          if (version == TLS_1_3_VERSION) {
+            key = expandLabel(digest, secret, "key", keyLength);
+            std::string nonce = expandLabel(digest, secret, "iv", kNonceLength);
+            salt = nonce.substr(0, saltLength);
+            iv = nonce.substr(saltLength);
+            cleanse(&nonce);
+          } else if (version == TLS_1_2_VERSION) {
+            // The client's key, the server's key, then their fixed IVs; AEADs have no MAC keys.
+            const size_t fixedLength = saltLength ? saltLength : kNonceLength;
+            std::string block = prf(digest, secret, "key expansion" + randoms, 2 * (keyLength + fixedLength));
+            key = block.substr(client ? 0 : keyLength, keyLength);
+            std::string fixed = block.substr(2 * keyLength + (client ? 0 : fixedLength), fixedLength);
+            if (saltLength) {
+              // AES-GCM's explicit nonce is the sequence number, which the kernel counts up from here.
+              salt = fixed;
+              iv = bigEndian(sequence);
+            } else {
+              iv = fixed;
+            }
+            cleanse(&block);
+            cleanse(&fixed);
+          } else {
+            return 0;
+          }
+
+          size_t length;
+          switch (kernelCipher->type) {
+            case TLS_CIPHER_AES_GCM_128:
+              length = fillCryptoInfo(&info->aesGcm128, version, kernelCipher->type, key, salt, iv, sequence);
+              break;
+            case TLS_CIPHER_AES_GCM_256:
+              length = fillCryptoInfo(&info->aesGcm256, version, kernelCipher->type, key, salt, iv, sequence);
+              break;
+            default:
+              length = fillCryptoInfo(&info->chacha20Poly1305, version, kernelCipher->type, key, salt, iv,
+                sequence);
+              break;
+          }
+          cleanse(&key);
+          cleanse(&salt);
+          cleanse(&iv);
+          return length;
+        }
+#endif
+
+        Record classify(uint8 type, const void *buffer, size_t length) {
+          const uint8 *record = static_cast<const uint8 *>(buffer);
+          switch (type) {
+            case kApplicationData:
+              return DATA;
+            case kAlert:
+              // A warning close_notify; anything else is fatal.
+              if (length >= 2 && record[1] == 0) {
+                return CLOSE;
+              }
+              LOG(ERROR) << "kTLS alert " << (length >= 2 ? record[1] : -1);
+              throw BoringSSLException("TLS alert");
+            case kHandshake:
+              // Session tickets can be dropped; new keys the kernel can't be told about.
+              if (length >= 1 && record[0] == kKeyUpdate) {
+                LOG(ERROR) << "kTLS key update";
+                throw BoringSSLException("TLS key update after offload");
+              }
+              return SKIP;
+            default:
+              LOG(ERROR) << "kTLS record type " << static_cast<int>(type);
+              throw BoringSSLException("Unexpected TLS record");
+          }
+        }
+      }  // namespace ktls
+    }  // namespace streams
+  }  // namespace io
+}  // namespace span
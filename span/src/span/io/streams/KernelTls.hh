@@ -0,0 +1,73 @@
+#ifndef SPAN_SRC_SPAN_IO_STREAMS_KERNELTLS_HH_
+#define SPAN_SRC_SPAN_IO_STREAMS_KERNELTLS_HH_
+
+#include <string>
+
+#include "span/Common.hh"
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+#include <linux/tls.h>
+#endif
+
+#include "openssl/evp.h"
+
+namespace span {
+  namespace io {
+    namespace streams {
+      /**
+       * What TLSStream::offload() hands the kernel (kTLS), and makes of the records it hands back, apart from
+       * any connection.
+       */
+      namespace ktls {
+        // TLS record content types, and the handshake message type, that kTLS hands back to us.
+        static const uint8 kAlert = 21;
+        static const uint8 kHandshake = 22;
+        static const uint8 kApplicationData = 23;
+        static const uint8 kKeyUpdate = 24;
+
+        /// Zeroes @p secret before emptying it.
+        void cleanse(std::string *secret);
+
+        /// HKDF-Expand-Label with no context (RFC 8446 7.1), for no more than a hash's worth.
+        std::string expandLabel(const EVP_MD *digest, const std::string &secret, const std::string &label,
+          size_t length);
+        /// The TLS 1.2 PRF (RFC 5246 5); @p seed is the label followed by the seed proper.
+        std::string prf(const EVP_MD *digest, const std::string &secret, const std::string &seed, size_t length);
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        union CryptoInfo {
+          tls12_crypto_info_aes_gcm_128 aesGcm128;
+          tls12_crypto_info_aes_gcm_256 aesGcm256;
+          tls12_crypto_info_chacha20_poly1305 chacha20Poly1305;
+        };
+
+        /**
+         * Fills in what kTLS needs to take over the client's (@p client) or the server's records on cipher
+         * suite @p suite (its IANA id) and @p version (TLS1_2_VERSION or TLS1_3_VERSION), the next of them
+         * being @p sequence. Returns its length, or 0 where kTLS can't.
+         *
+         * @p secret is their application traffic secret for TLS 1.3, and the master secret for TLS 1.2, where
+         * @p randoms is the server's random followed by the client's.
+         */
+        size_t cryptoInfo(uint16 suite, uint16 version, bool client, uint64 sequence, const std::string &secret,
+          const std::string &randoms, CryptoInfo *info);
+#endif
+
+        enum Record {
+          /// Application data, for the reader.
+          DATA,
+          /// close_notify.
+          CLOSE,
+          /// Nothing the reader needs, such as a session ticket.
+          SKIP
+        };
+
+        /// What a @p type record, the @p length bytes at @p buffer, means to a reader; throws BoringSSLException
+        /// on any the kernel's keys can't carry on past.
+        Record classify(uint8 type, const void *buffer, size_t length);
+      }  // namespace ktls
+    }  // namespace streams
+  }  // namespace io
+}  // namespace span
+
+#endif  // SPAN_SRC_SPAN_IO_STREAMS_KERNELTLS_HH_
@@ -13,6 +13,9 @@ namespace span {
         SPAN_ASSERT(socket);
       }
 
+      // Out of line, for the pinned_ Buffers.
+      SocketStream::~SocketStream() {}
+
       void SocketStream::close(CloseType type) {
         if (socket_ && own_) {
           int how;
@@ -48,8 +51,21 @@ namespace span {
 
       size_t SocketStream::write(const Buffer *buff, size_t len) {
         const std::vector<iovec> iovs = buff->readBuffers(len);
-        size_t result = socket_->send(&iovs[0], iovs.size());
+        if (len < socket_->zeroCopyThreshold()) {
+          size_t result = socket_->send(&iovs[0], iovs.size());
+          SPAN_ASSERT(result > 0);
+          return result;
+        }
+        releaseZeroCopied();
+        uint32 sends = socket_->zeroCopySends();
+        size_t result = socket_->sendZeroCopy(&iovs[0], iovs.size());
         SPAN_ASSERT(result > 0);
+        if (socket_->zeroCopySends() != sends) {
+          // Shares the segments rather than copying them.
+          std::unique_ptr<Buffer> pinned(new Buffer());
+          pinned->copyIn(buff, result);
+          pinned_.emplace_back(socket_->zeroCopySends(), std::move(pinned));
+        }
         return result;
       }
 
@@ -61,6 +77,25 @@ namespace span {
         socket_->cancelSend();
       }
 
+      void SocketStream::flush(bool flushParent) {
+        if (!pinned_.empty()) {
+          socket_->flushZeroCopy();
+          pinned_.clear();
+        }
+      }
+
+      bool SocketStream::zeroCopy(size_t threshold) {
+        return socket_->zeroCopy(threshold);
+      }
+
+      void SocketStream::releaseZeroCopied() {
+        uint32 completions = socket_->zeroCopyCompletions();
+        // Counters, so compared by difference to survive wrapping.
+        while (!pinned_.empty() && static_cast<int32>(completions - pinned_.front().first) >= 0) {
+          pinned_.pop_front();
+        }
+      }
+
       slimsig::signal_t<void()>::connection SocketStream::onRemoteClose(const std::function<void()> slot) {
         return socket_->onRemoteClose(slot);
       }
@@ -1,7 +1,9 @@
 #ifndef SPAN_SRC_SPAN_IO_STREAMS_SOCKETSTREAM_HH_
 #define SPAN_SRC_SPAN_IO_STREAMS_SOCKETSTREAM_HH_
 
+#include <deque>
 #include <memory>
+#include <utility>
 
 #include "span/io/streams/Stream.hh"
 #include "span/third_party/slimsig/slimsig.hh"
@@ -16,6 +18,7 @@ namespace span {
         typedef std::shared_ptr<SocketStream> ptr;
 
         explicit SocketStream(std::shared_ptr<span::io::Socket> socket, bool own = true);
+        ~SocketStream();
 
         bool supportsHalfClose() { return true; }
         bool supportsRead() { return true; }
@@ -31,14 +34,27 @@ namespace span {
         size_t write(const Buffer *buff, size_t len);
         size_t write(const void *buff, size_t len);
         void cancelWrite();
+        /// Waits for the kernel to be done with every Buffer zero-copy writes gave it.
+        void flush(bool flushParent = true);
+
+        /// Writes of a Buffer with at least @p threshold bytes go out with Socket::sendZeroCopy(), keeping hold
+        /// of what they sent until the kernel is done with it, so the caller may consume() it as usual. Memory
+        /// the Buffer adopt()ed isn't the Buffer's to keep alive; leave it be until flush(). Writes of raw
+        /// memory always copy. Returns false where the socket can't.
+        bool zeroCopy(size_t threshold);
 
         slimsig::signal_t<void()>::connection onRemoteClose(const std::function<void()>);
 
         std::shared_ptr<span::io::Socket> socket() { return socket_; }
 
       private:
+        // Lets go of the pinned_ Buffers the kernel is done with.
+        void releaseZeroCopied();
+
         std::shared_ptr<span::io::Socket> socket_;
         bool own_;
+        // What zero-copy writes sent, after the zero-copy send each was (Socket::zeroCopySends()).
+        std::deque<std::pair<uint32, std::unique_ptr<Buffer>>> pinned_;
       };
     }  // namespace streams
   }  // namespace io
@@ -1,12 +1,16 @@
 #include "span/io/streams/Tls.hh"
 
 #include <algorithm>
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
 
 #include "span/Common.hh"
 #include "span/exceptions/Assert.hh"
+#include "span/io/Socket.hh"
+#include "span/io/streams/KernelTls.hh"
+#include "span/io/streams/SocketStream.hh"
 
 #include "glog/logging.h"
 #include "openssl/err.h"
@@ -48,6 +52,48 @@ namespace span {
         return os.str();
       }
 
+      static int exDataIndex() {
+        static const int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        return index;
+      }
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      // ktls::cryptoInfo() for the client's (@p client) or the server's records on @p ssl, the next of them
+      // being @p sequence. @p trafficSecret is theirs, for TLS 1.3.
+      static size_t kernelCryptoInfo(SSL *ssl, bool client, uint64 sequence, const std::string &trafficSecret,
+        ktls::CryptoInfo *info) {
+        const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+        if (!cipher) {
+          return 0;
+        }
+        const uint16 suite = SSL_CIPHER_get_protocol_id(cipher);
+        if (SSL_version(ssl) != TLS1_2_VERSION) {
+          return ktls::cryptoInfo(suite, SSL_version(ssl), client, sequence, trafficSecret, std::string(), info);
+        }
+        std::string master(SSL_MAX_MASTER_KEY_LENGTH, '\0');
+        master.resize(SSL_SESSION_get_master_key(SSL_get_session(ssl), reinterpret_cast<uint8 *>(&master[0]),
+          master.size()));
+        std::string randoms(2 * SSL3_RANDOM_SIZE, '\0');
+        SSL_get_server_random(ssl, reinterpret_cast<uint8 *>(&randoms[0]), SSL3_RANDOM_SIZE);
+        SSL_get_client_random(ssl, reinterpret_cast<uint8 *>(&randoms[SSL3_RANDOM_SIZE]), SSL3_RANDOM_SIZE);
+        const size_t length = ktls::cryptoInfo(suite, TLS1_2_VERSION, client, sequence, master, randoms, info);
+        ktls::cleanse(&master);
+        return length;
+      }
+
+      // Where the record sequence numbers have got to each way, which kTLS has to carry on from; only BoringSSL
+      // says.
+      static bool recordSequences(SSL *ssl, uint64 *read, uint64 *write) {
+#ifdef OPENSSL_IS_BORINGSSL
+        *read = SSL_get_read_sequence(ssl);
+        *write = SSL_get_write_sequence(ssl);
+        return true;
+#else
+        return false;
+#endif
+      }
+#endif
+
       BoringSSLException::BoringSSLException() : std::runtime_error(getBoringSSLErrorMessage()) {}
 
       std::string CertificateVerificationException::constructMessage(int32 verifyResult) {
@@ -131,7 +177,7 @@ namespace span {
       }
 
       TLSStream::TLSStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx) :
-        MutatingFilterStream(parent, own) {
+        MutatingFilterStream(parent, own), secretsKept_(false), kernelSend_(false), kernelReceive_(false) {
         SPAN_ASSERT(parent);
         clearTLSError();
         if (ctx) {
@@ -147,6 +193,10 @@ namespace span {
           SPAN_ASSERT(hasBoringSSLError());
           throw BoringSSLException(getBoringSSLErrorMessage());
         }
+        if (!ctx) {
+          // Ours alone, so nobody else's keys end up in keyLog().
+          enableOffload(ctx_.get());
+        }
 
         ssl_.reset(SSL_new(ctx_.get()), &SSL_free);
 
@@ -171,6 +221,38 @@ namespace span {
         BIO_set_mem_eof_return(readBio, -1);
 
         SSL_set_bio(ssl_.get(), readBio, writeBio);
+
+        // Where keyLog() keeps the TLS 1.3 secrets offload() needs, if enableOffload() was called on ctx_.
+        SSL_set_ex_data(ssl_.get(), exDataIndex(), this);
+      }
+
+      TLSStream::~TLSStream() {
+        forgetSecrets();
+      }
+
+      void TLSStream::enableOffload(SSL_CTX *ctx) {
+        SSL_CTX_set_keylog_callback(ctx, &TLSStream::keyLog);
+      }
+
+      void TLSStream::forgetSecrets() {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        if (secretsKept_.load(std::memory_order_acquire)) {
+          absl::MutexLock _lock(&mutex_);
+          ktls::cleanse(&clientSecret_);
+          ktls::cleanse(&serverSecret_);
+          secretsKept_.store(false, std::memory_order_release);
+        }
+#endif
+      }
+
+      void TLSStream::refuseAfterOffload(const char *api) {
+        // The kernel has the send side's keys and sequence numbers; anything the library wrote (its answer to
+        // a KeyUpdate, an alert) would go out as application data under them.
+        if (kernelSend_ && BIO_ctrl_pending(writeBio)) {
+          LOG(ERROR) << this << " " << api << "(" << ssl_.get() << "): " << BIO_ctrl_pending(writeBio)
+            << " bytes to send after offload";
+          throw BoringSSLException("TLS record to send after offload");
+        }
       }
 
       void TLSStream::clearTLSError() {
@@ -179,6 +261,27 @@ namespace span {
 
       void TLSStream::close(CloseType type) {
         SPAN_ASSERT(type == BOTH);
+        if (kernelSend_) {
+          bool sendCloseNotify;
+          {
+            absl::MutexLock _lock(&mutex_);
+            sendCloseNotify = !(SSL_get_shutdown(ssl_.get()) & SSL_SENT_SHUTDOWN);
+            SSL_set_shutdown(ssl_.get(), SSL_get_shutdown(ssl_.get()) | SSL_SENT_SHUTDOWN);
+          }
+          // Not under the lock, sending can suspend this fiber. The library is records behind the kernel now,
+          // so close_notify has to go out through it.
+          if (sendCloseNotify) {
+            static const uint8 kCloseNotify[] = {1, 0};
+            kernel_->sendRecord(kCloseNotify, sizeof(kCloseNotify), ktls::kAlert);
+          }
+        }
+        if (kernelReceive_) {
+          char discard[4096];
+          while (kernelRead(discard, sizeof(discard)) > 0) {}
+          parent()->close();
+          return;
+        }
+
         if (!(sslCallWithLock(std::bind(SSL_get_shutdown, ssl_.get()), NULL) & SSL_SENT_SHUTDOWN)) {
           uint32 error = SSL_ERROR_NONE;
           const int32 result = sslCallWithLock(std::bind(SSL_shutdown, ssl_.get()), &error);
@@ -244,9 +347,14 @@ namespace span {
 
       size_t TLSStream::read(void *buff, size_t len) {
         const size_t toRead = std::min<size_t>(0x0fffffff, len);
+        if (kernelReceive_) {
+          return kernelRead(buff, toRead);
+        }
+        forgetSecrets();
         while (true) {
           uint32 error = SSL_ERROR_NONE;
           const int32 result = sslCallWithLock(std::bind(SSL_read, ssl_.get(), buff, toRead), &error);
+          refuseAfterOffload("SSL_read");
           if (result > 0) {
             return result;
           }
@@ -302,11 +410,18 @@ namespace span {
         // server-side, so we want to provide it with as much data as possible,
         // even if that means reallocating.  That's why we use pass the flag to
         // coalesce small segments, instead of only doing the first available
-        // segment.
+        // segment. The kernel, once it has them, makes records as big as it can anyway.
+        if (kernelSend_) {
+          return parent()->write(buff, len);
+        }
         return Stream::write(buff, len, true);
       }
 
       size_t TLSStream::write(const void *buff, size_t len) {
+        if (kernelSend_) {
+          return parent()->write(buff, len);
+        }
+        forgetSecrets();
         flush(false);
 
         if (len == 0) {
@@ -362,6 +477,7 @@ namespace span {
       }
 
       void TLSStream::flush(bool flushParent) {
+        refuseAfterOffload("flush");
         static const int32 WRITE_BUF_LENGTH = 4096;
         char writeBuff[WRITE_BUF_LENGTH];
         int32 toWrite = 0;
@@ -491,6 +607,68 @@ namespace span {
         }
       }
 
+      bool TLSStream::offload(bool receive) {
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        if (kernelSend_) {
+          return true;
+        }
+        SocketStream *socketStream = dynamic_cast<SocketStream *>(parent().get());
+        if (!socketStream) {
+          forgetSecrets();
+          return false;
+        }
+        // The end of the handshake has to be on the wire before the kernel's records.
+        flush(false);
+
+        absl::MutexLock _lock(&mutex_);
+        if (!SSL_is_init_finished(ssl_.get())) {
+          return false;
+        }
+        uint64 readSequence, writeSequence;
+        if (recordSequences(ssl_.get(), &readSequence, &writeSequence)) {
+          const bool client = !SSL_is_server(ssl_.get());
+          std::shared_ptr<Socket> socket = socketStream->socket();
+          ktls::CryptoInfo info;
+          size_t length = kernelCryptoInfo(ssl_.get(), client, writeSequence,
+            client ? clientSecret_ : serverSecret_, &info);
+          kernelSend_ = length && socket->kernelTLS(TLS_TX, &info, length);
+          if (kernelSend_) {
+            kernel_ = socket;
+            // Records already read off the socket are the library's to decrypt, so receiving stays with it.
+            if (receive && !readBuff_.readAvailable() && !BIO_ctrl_pending(readBio) && !SSL_pending(ssl_.get())) {
+              length = kernelCryptoInfo(ssl_.get(), !client, readSequence, client ? serverSecret_ : clientSecret_,
+                &info);
+              kernelReceive_ = length && socket->kernelTLS(TLS_RX, &info, length);
+            }
+          }
+          OPENSSL_cleanse(&info, sizeof(info));
+        }
+        // Whichever way it went, they're no use from here on.
+        ktls::cleanse(&clientSecret_);
+        ktls::cleanse(&serverSecret_);
+        secretsKept_.store(false, std::memory_order_release);
+        DLOG(INFO) << this << " offload(" << receive << "): " << kernelSend_ << ", " << kernelReceive_;
+        return kernelSend_;
+#else
+        return false;
+#endif
+      }
+
+      size_t TLSStream::kernelRead(void *buff, size_t len) {
+        while (true) {
+          uint8 type;
+          const size_t result = kernel_->receiveRecord(buff, len, &type);
+          switch (ktls::classify(type, buff, result)) {
+            case ktls::DATA:
+              return result;
+            case ktls::CLOSE:
+              return 0;
+            case ktls::SKIP:
+              continue;
+          }
+        }
+      }
+
       void TLSStream::serverNameIndication(std::string hostname) {
         absl::MutexLock _lock(&mutex_);
         // Ensure we have null terminator.
@@ -560,6 +738,31 @@ namespace span {
         DLOG(INFO) << this << " wantRead(): " << written;
       }
 
+      void TLSStream::keyLog(const SSL *ssl, const char *line) {
+        TLSStream *self = static_cast<TLSStream *>(SSL_get_ex_data(ssl, exDataIndex()));
+        if (!self) {
+          return;
+        }
+        // "<label> <client random> <secret>", the last two in hex.
+        std::istringstream is(line);
+        std::string label, random, hex;
+        is >> label >> random >> hex;
+        std::string *secret = NULL;
+        if (label == "CLIENT_TRAFFIC_SECRET_0") {
+          secret = &self->clientSecret_;
+        } else if (label == "SERVER_TRAFFIC_SECRET_0") {
+          secret = &self->serverSecret_;
+        } else {
+          return;
+        }
+        secret->clear();
+        for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+          secret->push_back(static_cast<char>(std::stoi(hex.substr(i, 2), NULL, 16)));
+        }
+        OPENSSL_cleanse(&hex[0], hex.size());
+        self->secretsKept_.store(true, std::memory_order_release);
+      }
+
       int TLSStream::sslCallWithLock(std::function<int()> dg, uint32 *error) {
         absl::MutexLock _lock(&mutex_);
 
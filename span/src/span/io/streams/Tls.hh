@@ -1,6 +1,7 @@
 #ifndef SPAN_SRC_SPAN_IO_STREAMS_TLS_HH_
 #define SPAN_SRC_SPAN_IO_STREAMS_TLS_HH_
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -14,6 +15,8 @@
 
 namespace span {
   namespace io {
+    class Socket;
+
     namespace streams {
       class BoringSSLException : public std::runtime_error {
       public:
@@ -43,6 +46,7 @@ namespace span {
           std::string commonName = std::string("localhost"));
 
         explicit TLSStream(Stream::ptr parent, bool client = true, bool own = true, SSL_CTX *ctx = NULL);
+        ~TLSStream();
 
         bool supportsHalfClose() { return false; }
 
@@ -56,6 +60,20 @@ namespace span {
         void accept();
         void connect();
 
+        /// Lets streams on @p ctx, a context the caller passes in, offload() TLS 1.3: it replaces any keylog
+        /// callback with one that hands each stream its traffic secrets. Call it while setting ctx up, before
+        /// it's shared; streams that make their own context have this already.
+        static void enableOffload(SSL_CTX *ctx);
+
+        /// Straight after accept() or connect(), hands encrypting records, and with @p receive decrypting them,
+        /// to the kernel (kTLS) when the parent is a SocketStream. Plaintext then goes straight to the socket,
+        /// and transferStream() can sendfile() and splice() through this stream. Returns false, carrying on in
+        /// user space, where the kernel, the negotiated cipher or the TLS library can't, and once anything has
+        /// been read or written: the TLS 1.3 secrets it needs are forgotten by then.
+        bool offload(bool receive = true);
+        /// Whether offload() handed sending (@p send), or receiving, to the kernel.
+        bool offloaded(bool send) const { return send ? kernelSend_ : kernelReceive_; }
+
         void serverNameIndication(const std::string hostname);
 
         void verifyPeerCertificate();
@@ -65,12 +83,23 @@ namespace span {
       private:
         void wantRead();
         int sslCallWithLock(std::function<int()> dg, uint32 *error);
+        static void keyLog(const SSL *ssl, const char *line);
+        void forgetSecrets();
+        size_t kernelRead(void *buff, size_t len);
+        // Throws if the library has something to send once the kernel is sending instead.
+        void refuseAfterOffload(const char *api);
 
         absl::Mutex mutex_;
         std::shared_ptr<SSL_CTX> ctx_;
         std::shared_ptr<SSL> ssl_;
         Buffer readBuff_, writeBuff_;
         BIO *readBio, *writeBio;
+        // TLS 1.3 application traffic secrets, from keyLog(), for offload() to derive keys from; only kept
+        // until it runs, or the stream is first used without it.
+        std::string clientSecret_, serverSecret_;
+        std::atomic<bool> secretsKept_;
+        std::shared_ptr<Socket> kernel_;
+        bool kernelSend_, kernelReceive_;
       };
     }  // namespace streams
   }  // namespace io
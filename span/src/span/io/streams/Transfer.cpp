@@ -1,13 +1,24 @@
 #include "span/io/streams/Transfer.hh"
 
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <vector>
 
 #include "span/Common.hh"
 #include "span/exceptions/Assert.hh"
 #include "span/fibers/Fiber.hh"
+#include "span/io/Socket.hh"
 #include "span/io/streams/Buffer.hh"
+#include "span/io/streams/Fd.hh"
 #include "span/io/streams/Null.hh"
+#include "span/io/streams/SocketStream.hh"
 #include "span/io/streams/Stream.hh"
+#include "span/io/streams/Tls.hh"
 #include "span/Parallel.hh"
 
 #include "glog/logging.h"
@@ -32,6 +43,167 @@ namespace span {
         }
       }
 
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+      // The most sendfile() and copy_file_range() will move in one call.
+      static const size_t kMaxKernelCopy = 0x7ffff000;
+      // What we ask for the pipe splice() goes through to hold, over the default 64KiB.
+      static const int kSplicePipeSize = 1 << 20;
+
+      namespace {
+        // A stream the kernel can move data to and from itself: a socket, or any other fd.
+        struct KernelEnd {
+          KernelEnd() : fdStream(NULL), socket(NULL), file(false) {}
+
+          size_t splice(int pipe, size_t len, bool toPipe) {
+            return socket ? socket->splice(pipe, len, toPipe) : fdStream->splice(pipe, len, toPipe);
+          }
+
+          FDStream *fdStream;
+          Socket *socket;
+          // A regular file, which never makes anyone wait.
+          bool file;
+        };
+
+        struct PipeCloser {
+          PipeCloser() {
+            fds[0] = fds[1] = -1;
+          }
+          ~PipeCloser() {
+            if (fds[0] >= 0) {
+              ::close(fds[0]);
+              ::close(fds[1]);
+            }
+          }
+          int fds[2];
+        };
+      }  // namespace
+
+      static bool kernelEnd(Stream *stream, bool write, KernelEnd *end) {
+        // TLS the kernel is doing this way is as good as the socket underneath.
+        if (TLSStream *tlsStream = dynamic_cast<TLSStream *>(stream)) {
+          if (!tlsStream->offloaded(write)) {
+            return false;
+          }
+          stream = tlsStream->parent().get();
+        }
+        if (SocketStream *socketStream = dynamic_cast<SocketStream *>(stream)) {
+          end->socket = socketStream->socket().get();
+          return true;
+        }
+        end->fdStream = dynamic_cast<FDStream *>(stream);
+        if (!end->fdStream || end->fdStream->fd() < 0) {
+          return false;
+        }
+        struct stat st;
+        end->file = !fstat(end->fdStream->fd(), &st) && S_ISREG(st.st_mode);
+        return true;
+      }
+
+      // What the kernel says when it can't copy between a pair of fds itself, rather than that it failed.
+      static bool refused(error_t error) {
+        return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP || error == EBADF ||
+          error == ESPIPE;
+      }
+
+      // Moves up to toTransfer bytes between kernel-backed streams without them coming up to user space:
+      // copy_file_range() between files, sendfile() from a file to a socket, and splice() through a pipe
+      // otherwise. Returns false, with whatever it managed in *totalRead, if either end isn't kernel-backed
+      // or the kernel won't; true once it has them all or hits EOF.
+      static bool kernelTransfer(Stream *src, Stream *dst, uint64 toTransfer, uint64 *totalRead) {
+        KernelEnd from, to;
+        if (!kernelEnd(src, false, &from) || !kernelEnd(dst, true, &to)) {
+          return false;
+        }
+
+        if (from.file && (to.file || to.socket)) {
+          while (*totalRead < toTransfer) {
+            size_t todo = static_cast<size_t>(std::min<uint64>(toTransfer - *totalRead, kMaxKernelCopy));
+            ssize_t result;
+            if (to.socket) {
+              try {
+                result = to.socket->sendFile(from.fdStream->fd(), todo);
+              } catch (std::runtime_error &) {
+                if (!refused(lastError())) {
+                  throw;
+                }
+                return false;
+              }
+            } else {
+              do {
+                result = copy_file_range(from.fdStream->fd(), NULL, to.fdStream->fd(), NULL, todo, 0);
+              } while (result < 0 && lastError() == EINTR);
+              if (result < 0) {
+                error_t error = lastError();
+                if (refused(error)) {
+                  return false;
+                }
+                LOG(ERROR) << "copy_file_range(" << from.fdStream->fd() << ", " << to.fdStream->fd() << ", "
+                  << todo << "): " << result << " (" << error << ")";
+                throw std::runtime_error("copy_file_range");
+              }
+            }
+            DLOG(INFO) << "kernel copied " << result << " bytes from " << src << " to " << dst;
+            if (result == 0) {
+              return true;
+            }
+            *totalRead += result;
+          }
+          return true;
+        }
+
+        PipeCloser pipe;
+        if (pipe2(pipe.fds, O_CLOEXEC)) {
+          return false;
+        }
+        // Best effort; fewer trips through a bigger one.
+        int pipeSize = fcntl(pipe.fds[1], F_SETPIPE_SZ, kSplicePipeSize);
+        if (pipeSize <= 0) {
+          pipeSize = fcntl(pipe.fds[1], F_GETPIPE_SZ);
+        }
+        while (*totalRead < toTransfer) {
+          size_t todo = static_cast<size_t>(std::min<uint64>(toTransfer - *totalRead, pipeSize));
+          size_t inPipe;
+          try {
+            inPipe = from.splice(pipe.fds[1], todo, true);
+          } catch (std::runtime_error &) {
+            if (!refused(lastError())) {
+              throw;
+            }
+            return false;
+          }
+          DLOG(INFO) << "spliced " << inPipe << " bytes from " << src;
+          if (inPipe == 0) {
+            return true;
+          }
+          size_t left = inPipe;
+          try {
+            while (left > 0) {
+              left -= to.splice(pipe.fds[0], left, false);
+            }
+          } catch (std::runtime_error &) {
+            if (!refused(lastError())) {
+              throw;
+            }
+            // Already out of src, so they go the long way.
+            Buffer stranded;
+            while (stranded.readAvailable() < left) {
+              iovec iov = stranded.writeBuffer(left - stranded.readAvailable(), false);
+              ssize_t result = ::read(pipe.fds[0], iov.iov_base, iov.iov_len);
+              SPAN_ASSERT(result > 0);
+              stranded.produce(result);
+            }
+            writeOne(dst, &stranded);
+            *totalRead += inPipe;
+            // Nothing left for the long way to do if those were the last of them.
+            return *totalRead == toTransfer;
+          }
+          DLOG(INFO) << "spliced " << inPipe << " bytes to " << dst;
+          *totalRead += inPipe;
+        }
+        return true;
+      }
+#endif
+
       uint64 transferStream(Stream *src, Stream *dst, uint64 toTransfer, ExactLength exactLength) {
         DLOG(INFO) << "transferring " << toTransfer << " bytes from " << src << " to " << dst;
         SPAN_ASSERT(src->supportsRead());
@@ -52,6 +224,20 @@ namespace span {
         }
         SPAN_ASSERT(exactLength == EXACT || exactLength == UNTILEOF);
 
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+        if (kernelTransfer(src, dst, toTransfer, &totalRead)) {
+          if (totalRead == 0 && exactLength == EXACT) {
+            throw std::runtime_error("Unexepected Eof Exception");
+          }
+          if (totalRead < toTransfer && exactLength == EXACT) {
+            LOG(ERROR) << "only read " << totalRead << "/" << toTransfer << " from " << src;
+          }
+          DLOG(INFO) << "transferred " << totalRead << "/" << toTransfer << " from " << src << " to " << dst;
+          return totalRead;
+        }
+        // Whatever the kernel refused to move, including anything it moved first, goes the long way.
+#endif
+
         readBuffer = &buff;
         todo = chunkSize;
 
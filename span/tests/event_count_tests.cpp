@@ -0,0 +1,109 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "span/fibers/EventCount.hh"
+#include "span/fibers/WorkerPool.hh"
+
+using span::fibers::AdaptiveSpin;
+using span::fibers::EventCount;
+using span::fibers::WorkerPool;
+
+namespace {
+  TEST(EventCount, notifyWithoutWaitersIsForgotten) {
+    EventCount events;
+    events.notify();
+    EventCount::Key key = events.prepareWait();
+    events.cancelWait();
+    // Notified after prepareWait, so this doesn't block.
+    key = events.prepareWait();
+    events.notify();
+    events.wait(key);
+  }
+
+  TEST(EventCount, wakesParkedThread) {
+    EventCount events;
+    std::atomic<bool> ready(false);
+    std::thread waiter([&]() {
+      while (!ready) {
+        EventCount::Key key = events.prepareWait();
+        if (ready) {
+          events.cancelWait();
+          break;
+        }
+        events.wait(key);
+      }
+    });
+    ready = true;
+    events.notify();
+    waiter.join();
+  }
+
+  TEST(EventCount, noLostWakeups) {
+    static const size_t kRounds = 20000;
+    EventCount events;
+    std::atomic<size_t> produced(0), consumed(0);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < 2; ++i) {
+      consumers.emplace_back([&]() {
+        while (true) {
+          size_t seen = consumed;
+          if (seen == kRounds) {
+            return;
+          }
+          if (seen < produced) {
+            consumed.compare_exchange_strong(seen, seen + 1);
+            continue;
+          }
+          EventCount::Key key = events.prepareWait();
+          if (consumed < produced || consumed == kRounds) {
+            events.cancelWait();
+            continue;
+          }
+          events.wait(key);
+        }
+      });
+    }
+    for (size_t i = 0; i < kRounds; ++i) {
+      ++produced;
+      events.notify();
+      while (consumed <= i) {
+        std::this_thread::yield();
+      }
+    }
+    events.notifyAll();
+    for (std::thread &consumer : consumers) {
+      consumer.join();
+    }
+    EXPECT_EQ(consumed, kRounds);
+  }
+
+  TEST(AdaptiveSpin, stopsWhenReady) {
+    AdaptiveSpin spinner(100);
+    size_t calls = 0;
+    EXPECT_TRUE(spinner.spin([&]() { return ++calls == 10; }));
+    EXPECT_EQ(calls, 10u);
+    EXPECT_FALSE(spinner.spin([]() { return false; }));
+    spinner.maxSpins(0);
+    calls = 0;
+    EXPECT_FALSE(spinner.spin([&]() { ++calls; return false; }));
+    EXPECT_EQ(calls, 1u);
+  }
+
+  static void doNothing() {}
+
+  TEST(EventCount, workerPoolWithSpinning) {
+    std::atomic<size_t> ran(0);
+    WorkerPool pool(4, false);
+    pool.maxIdleSpins(10000);
+    for (int i = 0; i < 1000; ++i) {
+      pool.schedule([&ran]() { doNothing(); ++ran; });
+    }
+    while (ran != 1000) {
+      std::this_thread::yield();
+    }
+    pool.stop();
+  }
+}  // namespace
@@ -1,4 +1,11 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -6,6 +13,7 @@
 #include "span/Timer.hh"
 
 using span::Timer;
+using span::fibers::Scheduler;
 using span::io::IOManager;
 
 namespace {
@@ -63,8 +71,209 @@ TEST(IoManagerTests, laterTimer) {
   EXPECT_EQ(sequence, 2);
 }
 
+static void chainTimer(IOManager *manager, int *remaining) {
+  if (--*remaining) {
+    manager->registerTimer(200, std::bind(&chainTimer, manager, remaining));
+  }
+}
+
+TEST(IoManagerTests, subMillisecondTimers) {
+  // Rounded up to whole milliseconds for epoll_wait, these would take at least 20ms.
+  int remaining = 20;
+  IOManager manager;
+  uint64 start = span::TimerManager::now();
+  manager.registerTimer(200, std::bind(&chainTimer, &manager, &remaining));
+  manager.dispatch();
+  uint64 elapsed = span::TimerManager::now() - start;
+  EXPECT_EQ(remaining, 0);
+  EXPECT_GE(elapsed, 20 * 200u);
+  EXPECT_LT(elapsed, 20 * 1000u);
+}
+
 TEST(IoManagerTests, timerRefCountNotExpired) {
   IOManager manager;
   manager.schedule(std::bind(testTimerNoExpire, &manager));
   manager.dispatch();
 }
+
+TEST(IoManagerTests, burstOfTicklesFromOutside) {
+  static const size_t kTasks = 10000;
+  std::atomic<size_t> ran(0);
+  IOManager manager(4, false);
+  for (size_t i = 0; i < kTasks; ++i) {
+    manager.schedule([&ran]() { ++ran; });
+  }
+  while (ran != kTasks) {
+    std::this_thread::yield();
+  }
+  manager.stop();
+}
+
+TEST(IoManagerTests, readinessWhileNobodyWaits) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  bool fired = false;
+  IOManager manager;
+  manager.schedule([&]() {
+    // Puts fds[0] in the epoll set; an empty socket is writable straight away.
+    manager.registerEvent(fds[0], IOManager::WRITE);
+    Scheduler::yieldTo();
+    // The readable edge arrives with nobody waiting; a later wait must still see it.
+    ASSERT_EQ(write(fds[1], "x", 1), 1);
+    manager.registerTimer(10000, [&]() {
+      manager.registerEvent(fds[0], IOManager::READ, [&fired]() { fired = true; });
+    });
+  });
+  manager.stop();
+  EXPECT_TRUE(fired);
+  manager.unregisterFd(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoManagerTests, fdReusedAfterUnregisterFd) {
+  bool fired = false;
+  IOManager manager;
+  manager.schedule([&]() {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    manager.registerEvent(fds[0], IOManager::WRITE);
+    Scheduler::yieldTo();
+    manager.unregisterFd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+
+    // Most likely gets the same numbers back, which epoll must be told about afresh.
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    manager.schedule([&fds]() { ASSERT_EQ(write(fds[1], "x", 1), 1); });
+    manager.registerEvent(fds[0], IOManager::READ);
+    Scheduler::yieldTo();
+    fired = true;
+    manager.unregisterFd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+  });
+  manager.stop();
+  EXPECT_TRUE(fired);
+}
+
+TEST(IoManagerTests, fdReusedAfterClose) {
+  bool fired = false, timedOut = false;
+  IOManager manager;
+  manager.schedule([&]() {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    manager.registerEvent(fds[0], IOManager::WRITE);
+    Scheduler::yieldTo();
+    // Closed behind the IOManager's back, as a raw or unowned fd would be.
+    close(fds[0]);
+    close(fds[1]);
+
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    manager.schedule([&fds]() { ASSERT_EQ(write(fds[1], "x", 1), 1); });
+    Timer::ptr timeout = manager.registerTimer(1000000, [&]() {
+      timedOut = true;
+      manager.cancelEvent(fds[0], IOManager::READ);
+    });
+    manager.registerEvent(fds[0], IOManager::READ);
+    Scheduler::yieldTo();
+    timeout->cancel();
+    fired = !timedOut;
+    manager.unregisterFd(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+  });
+  manager.stop();
+  EXPECT_TRUE(fired);
+}
+
+TEST(IoManagerTests, unregisterClosedFd) {
+  bool fired = false;
+  IOManager manager;
+  manager.schedule([&]() {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    manager.registerEvent(fds[0], IOManager::READ, [&fired]() { fired = true; });
+    // Gone from epoll before unregisterFd() gets to it, which has to cope (it runs in destructors).
+    close(fds[0]);
+    EXPECT_NO_THROW(manager.unregisterFd(fds[0]));
+    close(fds[1]);
+  });
+  manager.stop();
+  EXPECT_TRUE(fired);
+}
+
+TEST(IoManagerTests, sparseFdNumbers) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  // Well past the first chunk of the fd table, and with nothing registered in between.
+  int high = dup2(fds[0], 5000);
+  ASSERT_EQ(high, 5000);
+  int fired = 0;
+  IOManager manager;
+  manager.schedule([&]() {
+    manager.registerEvent(high, IOManager::WRITE, [&fired]() { ++fired; });
+    manager.registerEvent(fds[0], IOManager::WRITE, [&fired]() { ++fired; });
+  });
+  manager.stop();
+  EXPECT_EQ(fired, 2);
+  manager.unregisterFd(high);
+  manager.unregisterFd(fds[0]);
+  close(high);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoManagerTests, shardedTimersAcrossThreads) {
+  static const int kTimers = 200;
+  std::atomic<int> fired(0);
+  IOManager manager(4, false);
+  manager.shardByThread();
+  std::vector<Timer::ptr> timers(kTimers);
+  std::atomic<int> registered(0);
+  for (int i = 0; i < kTimers; ++i) {
+    manager.schedule([&manager, &timers, &fired, &registered, i]() {
+      timers[i] = manager.registerTimer(1000000 + i * 10, [&fired]() { ++fired; });
+      ++registered;
+    });
+  }
+  while (registered != kTimers) {
+    std::this_thread::yield();
+  }
+  // From whichever threads the fibers land on: every other one cancelled, the rest pulled in.
+  for (int i = 0; i < kTimers; ++i) {
+    manager.schedule([&timers, i]() {
+      if (i % 2) {
+        EXPECT_TRUE(timers[i]->cancel());
+      } else {
+        EXPECT_TRUE(timers[i]->reset(100, true));
+      }
+    });
+  }
+  manager.stop();
+  EXPECT_EQ(fired, kTimers / 2);
+}
+
+TEST(IoManagerTests, subMillisecondTimersAcrossThreads) {
+  static const int kTimers = 64;
+  std::atomic<int> early(0), fired(0);
+  IOManager manager(4, false);
+  manager.shardByThread();
+  for (int i = 0; i < kTimers; ++i) {
+    // Each thread waiting for a different fraction of a millisecond, however the timers are shared out.
+    manager.schedule([&manager, &early, &fired, i]() {
+      uint64 delayUs = 1500 + i * 37;
+      std::chrono::steady_clock::time_point due =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(delayUs);
+      manager.registerTimer(delayUs, [&early, &fired, due]() {
+        if (std::chrono::steady_clock::now() < due) {
+          ++early;
+        }
+        ++fired;
+      });
+    });
+  }
+  manager.stop();
+  EXPECT_EQ(fired, kTimers);
+  EXPECT_EQ(early, 0);
+}
@@ -1,4 +1,9 @@
 #include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "span/fibers/Fiber.hh"
@@ -93,4 +98,134 @@ namespace {
     pool.stop();
     EXPECT_TRUE(doNothingFiber->state() == Fiber::TERM);
   }
+
+  static void useSomeStack() {
+    volatile char buffer[4096];
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+      buffer[i] = static_cast<char>(i);
+    }
+  }
+
+  TEST(SchedulerTests, stackClassesWithTelemetry) {
+    Fiber::clearStackUsage();
+    Fiber::stackTelemetry(true);
+    {
+      WorkerPool pool;
+      pool.schedule(&useSomeStack, std::thread::id(), Scheduler::TINY_STACK);
+      pool.dispatch();
+    }
+    Fiber::stackTelemetry(false);
+
+    // The scheduler's own run/idle fibers are recorded too.
+    bool found = false;
+    for (const Fiber::StackUsage &usage : Fiber::stackUsage()) {
+      if (usage.stackSize != 16u * 1024) {
+        continue;
+      }
+      found = true;
+      EXPECT_EQ(usage.fibers, 1u);
+      EXPECT_GT(usage.highWaterMark, 4096u);
+      EXPECT_LT(usage.highWaterMark, 16u * 1024);
+    }
+    EXPECT_TRUE(found);
+    Fiber::clearStackUsage();
+  }
+
+  TEST(SchedulerTests, pinnedWorkRunsOnItsThread) {
+    static const size_t kPerThread = 10000;
+    std::atomic<size_t> ranOnMain(0), ranOnWorker(0), ranElsewhere(0);
+    WorkerPool pool(2);
+    std::thread::id mainThread = std::this_thread::get_id();
+    std::thread::id workerThread = pool.Threads()[0]->get_id();
+    for (size_t i = 0; i < kPerThread; ++i) {
+      pool.schedule([&]() {
+        ++(std::this_thread::get_id() == workerThread ? ranOnWorker : ranElsewhere);
+      }, workerThread);
+      pool.schedule([&]() {
+        ++(std::this_thread::get_id() == mainThread ? ranOnMain : ranElsewhere);
+      }, mainThread);
+    }
+    pool.stop();
+    EXPECT_EQ(ranOnMain, kPerThread);
+    EXPECT_EQ(ranOnWorker, kPerThread);
+    EXPECT_EQ(ranElsewhere, 0u);
+  }
+
+  TEST(SchedulerTests, pinnedWorkWakesParkedThread) {
+    WorkerPool pool(4, false);
+    // Straight to sleep, so each piece of work has to wake the one thread that can run it.
+    pool.maxIdleSpins(0);
+    for (size_t round = 0; round < 100; ++round) {
+      for (const std::shared_ptr<std::thread> &thread : pool.Threads()) {
+        std::atomic<bool> ran(false);
+        std::thread::id id = thread->get_id();
+        pool.schedule([&ran, id]() {
+          EXPECT_EQ(std::this_thread::get_id(), id);
+          ran = true;
+        }, id);
+        while (!ran) {
+          std::this_thread::yield();
+        }
+      }
+    }
+    pool.stop();
+  }
+
+  TEST(SchedulerTests, restartsReuseQueues) {
+    // More threads over the pool's life than it has queues (256) to give them.
+    static const size_t kRestarts = 150;
+    WorkerPool pool(2, false);
+    std::set<std::thread::id> seen;
+    std::atomic<bool> done(false);
+    std::vector<std::thread> holders;
+    for (size_t i = 0; i < kRestarts; ++i) {
+      for (const std::shared_ptr<std::thread> &thread : pool.Threads()) {
+        seen.insert(thread->get_id());
+      }
+      std::atomic<bool> ran(false);
+      pool.schedule([&ran]() { ran = true; });
+      pool.stop();
+      EXPECT_TRUE(ran);
+      // Keep hold of what the stopped threads were, or the new ones would just be given the same ids.
+      for (size_t j = 0; j < 2; ++j) {
+        holders.emplace_back([&done]() {
+          while (!done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        });
+      }
+      pool.start();
+    }
+    pool.stop();
+    done = true;
+    for (std::thread &holder : holders) {
+      holder.join();
+    }
+    EXPECT_GT(seen.size(), 256u);
+  }
+
+  TEST(SchedulerTests, blockedWorkersQueueIsStolen) {
+    static const size_t kTasks = 100;
+    WorkerPool pool(2, false);
+    std::atomic<size_t> done(0), ranOnBlocked(0);
+    pool.schedule([&]() {
+      // All on this worker's own queue, which it then sits on until someone else has run it all.
+      std::thread::id blocked = std::this_thread::get_id();
+      for (size_t i = 0; i < kTasks; ++i) {
+        Scheduler::getThis()->schedule([&, blocked]() {
+          if (std::this_thread::get_id() == blocked) {
+            ++ranOnBlocked;
+          }
+          ++done;
+        });
+      }
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (done < kTasks && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+    pool.stop();
+    EXPECT_EQ(done, kTasks);
+    EXPECT_EQ(ranOnBlocked, 0u);
+  }
 }  // namespace
@@ -1,15 +1,25 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "span/Common.hh"
+#include "span/Sleep.hh"
 #include "span/Timer.hh"
 #include "span/exceptions/Assert.hh"
 #include "span/fibers/Fiber.hh"
 #include "span/io/IOManager.hh"
 #include "span/io/Socket.hh"
+#include "span/io/streams/Buffer.hh"
+#include "span/io/streams/SocketStream.hh"
 
 namespace {
   struct Connection {
@@ -300,4 +310,340 @@ namespace {
     ioManager.dispatch();
     ASSERT_TRUE(remoteClosed);
   }
+
+  static void sendOne(span::io::Socket::ptr sock) {
+    ASSERT_EQ(sock->send("x", 1), 1u);
+  }
+
+  // Same as above, but through io_uring where the kernel has one.
+  TEST(Socket, completionIOReceive) {
+    span::io::IOManager ioManager(1, true, true, true);
+    Connection conns = establishConn(&ioManager);
+    ioManager.schedule(std::bind(&acceptOne, &conns));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    // Nothing to read yet, so this waits for sendOne's byte to turn up.
+    ioManager.schedule(std::bind(&sendOne, conns.connect));
+    char buf = 0;
+    ASSERT_EQ(conns.accept->receive(&buf, 1), 1u);
+    ASSERT_EQ(buf, 'x');
+  }
+
+  TEST(Socket, completionIOReceiveTimeout) {
+    span::io::IOManager ioManager(1, true, true, true);
+    Connection conns = establishConn(&ioManager);
+    conns.connect->receiveTimeout(1000);
+    ioManager.schedule(std::bind(&acceptOne, &conns));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    char buf;
+    uint64 start = span::TimerManager::now();
+    ASSERT_THROW(conns.connect->receive(&buf, 1), std::runtime_error);
+    ASSERT_GT((span::TimerManager::now() - start), 1000);
+  }
+
+  TEST(Socket, completionIOCancelAccept) {
+    span::io::IOManager ioManager(1, true, true, true);
+    Connection conns = establishConn(&ioManager);
+    ioManager.schedule(std::bind(&cancelMe, conns.listen));
+    ASSERT_THROW(conns.listen->accept(), std::runtime_error);
+  }
+
+  TEST(Socket, acceptBatch) {
+    static const size_t kConnections = 4;
+    span::io::IOManager ioManager;
+    Connection conns = establishConn(&ioManager);
+    // The kernel finishes handshakes without waiting to be accepted, so these all queue up.
+    std::vector<span::io::Socket::ptr> connects(1, conns.connect);
+    while (connects.size() < kConnections) {
+      connects.push_back(conns.address->createSocket(&ioManager, SOCK_STREAM));
+    }
+    for (span::io::Socket::ptr &connect : connects) {
+      connect->connect(conns.address);
+    }
+
+    std::vector<span::io::Socket::ptr> accepted = conns.listen->acceptBatch();
+    ASSERT_EQ(accepted.size(), kConnections);
+    for (size_t i = 0; i < kConnections; ++i) {
+      EXPECT_EQ(*accepted[i]->remoteAddress(), *connects[i]->localAddress());
+      EXPECT_EQ(fcntl(accepted[i]->socket(), F_GETFL) & O_NONBLOCK, O_NONBLOCK);
+    }
+
+    conns.listen->receiveTimeout(1000);
+    ASSERT_THROW(conns.listen->acceptBatch(), std::runtime_error);
+  }
+
+  TEST(Socket, exclusiveSharedAccept) {
+    static const size_t kConnections = 8;
+    span::io::IOManager ioManager, other(1, false);
+    Connection conns = establishConn(&ioManager);
+    conns.listen->listen(SOMAXCONN, true);
+    span::io::Socket::ptr shared = conns.listen->share(&other);
+    std::atomic<size_t> accepted(0);
+    auto acceptAll = [&accepted](span::io::Socket::ptr listener) {
+      try {
+        while (true) {
+          listener->accept();
+          ++accepted;
+        }
+      } catch (std::runtime_error &) {}
+    };
+    ioManager.schedule(std::bind(acceptAll, conns.listen));
+    other.schedule(std::bind(acceptAll, shared));
+
+    std::vector<span::io::Socket::ptr> connects(1, conns.connect);
+    while (connects.size() < kConnections) {
+      connects.push_back(conns.address->createSocket(&ioManager, SOCK_STREAM));
+    }
+    for (span::io::Socket::ptr &connect : connects) {
+      connect->connect(conns.address);
+    }
+    while (accepted < kConnections) {
+      span::fibers::Scheduler::yield();
+    }
+    conns.listen->cancelAccept();
+    shared->cancelAccept();
+    ioManager.dispatch();
+  }
+
+  static void listenSharded() {
+    static const size_t kConnections = 16;
+    span::io::IOManager ioManager(4);
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    std::atomic<size_t> accepted(0);
+    std::vector<span::io::Socket::ptr> listeners = span::io::Socket::listenSharded(&ioManager, *address,
+      [&](span::io::Socket::ptr sock) {
+        EXPECT_EQ(*sock->localAddress(), *address);
+        // On the thread that accepted it, by now pinned to a single CPU.
+        cpu_set_t pinned;
+        EXPECT_EQ(sched_getaffinity(0, sizeof(pinned), &pinned), 0);
+        EXPECT_EQ(CPU_COUNT(&pinned), 1);
+        ++accepted;
+      }, true);
+    ASSERT_EQ(listeners.size(), 4u);
+    // Picked once by the first socket, and shared with the rest.
+    address = listeners.front()->localAddress();
+    for (span::io::Socket::ptr &listener : listeners) {
+      EXPECT_EQ(*listener->localAddress(), *address);
+    }
+
+    std::vector<span::io::Socket::ptr> connects;
+    while (connects.size() < kConnections) {
+      connects.push_back(address->createSocket(&ioManager, SOCK_STREAM));
+      connects.back()->connect(address);
+    }
+    while (accepted < kConnections) {
+      span::fibers::Scheduler::yield();
+    }
+    // Lets the accept loops finish, for the IOManager to stop.
+    for (span::io::Socket::ptr &listener : listeners) {
+      listener->cancelAccept();
+    }
+  }
+
+  TEST(Socket, listenSharded) {
+    // Steering pins this (the hijacked) thread too; put it back for the tests after.
+    cpu_set_t original;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(original), &original), 0);
+    listenSharded();
+    ASSERT_EQ(sched_setaffinity(0, sizeof(original), &original), 0);
+  }
+
+  TEST(Socket, listenShardedOutlivesAcceptFailure) {
+    span::io::IOManager ioManager;
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    std::atomic<size_t> accepted(0);
+    std::vector<span::io::Socket::ptr> listeners = span::io::Socket::listenSharded(&ioManager, *address,
+      [&](span::io::Socket::ptr) { ++accepted; });
+    address = listeners.front()->localAddress();
+    span::io::Socket::ptr connect = address->createSocket(&ioManager, SOCK_STREAM);
+
+    // No fd left for accept() to hand out until the limit goes back up.
+    rlimit original;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &original), 0);
+    int next = dup(0);
+    ASSERT_GE(next, 0);
+    close(next);
+    rlimit exhausted = original;
+    exhausted.rlim_cur = next;
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &exhausted), 0);
+    connect->connect(address);
+    span::sleep(&ioManager, 50000);
+    EXPECT_EQ(accepted, 0u);
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &original), 0);
+
+    // Sleeping rather than yielding, for the loop's retry timer to get a look in.
+    while (accepted == 0) {
+      span::sleep(&ioManager, 1000);
+    }
+    for (span::io::Socket::ptr &listener : listeners) {
+      listener->cancelAccept();
+    }
+    ioManager.dispatch();
+  }
+
+  TEST(Socket, zeroCopyWrite) {
+    static const size_t kLength = 4 << 20;
+    span::io::IOManager ioManager;
+    Connection conns = establishConn(&ioManager);
+    ioManager.schedule(std::bind(&acceptOne, &conns));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    span::io::streams::SocketStream stream(conns.connect);
+    if (!stream.zeroCopy(4096)) {
+      // No SO_ZEROCOPY in this kernel, writes just copy.
+      return;
+    }
+
+    std::string data(kLength, 0);
+    for (size_t i = 0; i < kLength; ++i) {
+      data[i] = static_cast<char>(i * 7);
+    }
+    std::string received;
+    ioManager.schedule([&]() {
+      char buf[65536];
+      while (received.size() < kLength) {
+        received.append(buf, conns.accept->receive(buf, sizeof(buf)));
+      }
+    });
+    span::io::streams::Buffer out;
+    out.copyIn(data);
+    while (out.readAvailable()) {
+      out.consume(stream.write(&out, out.readAvailable()));
+    }
+    stream.flush();
+    EXPECT_GT(conns.connect->zeroCopySends(), 0u);
+    EXPECT_EQ(conns.connect->zeroCopyCompletions(), conns.connect->zeroCopySends());
+    ioManager.dispatch();
+    EXPECT_EQ(received, data);
+  }
+
+  TEST(Socket, zeroCopyThreshold) {
+    span::io::IOManager ioManager;
+    Connection conns = establishConn(&ioManager);
+    ioManager.schedule(std::bind(&acceptOne, &conns));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    if (!conns.connect->zeroCopy(4096)) {
+      return;
+    }
+
+    std::string data(5500, 'x');
+    std::string received;
+    ioManager.schedule([&]() {
+      char buf[4096];
+      while (received.size() < data.size()) {
+        received.append(buf, conns.accept->receive(buf, sizeof(buf)));
+      }
+    });
+    iovec small[1] = {{&data[0], 1000}};
+    EXPECT_EQ(conns.connect->sendZeroCopy(small, 1), 1000u);
+    EXPECT_EQ(conns.connect->zeroCopySends(), 0u);
+    // None big enough alone, but together over the threshold.
+    iovec large[3] = {{&data[1000], 1500}, {&data[2500], 1500}, {&data[4000], 1500}};
+    EXPECT_EQ(conns.connect->sendZeroCopy(large, 3), 4500u);
+    EXPECT_EQ(conns.connect->zeroCopySends(), 1u);
+    conns.connect->flushZeroCopy();
+    ioManager.dispatch();
+    EXPECT_EQ(received, data);
+  }
+
+  TEST(Socket, batchDatagrams) {
+    static const size_t kDatagrams = 10;
+    span::io::IOManager ioManager;
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    span::io::Socket::ptr receiver = address->createSocket(&ioManager, SOCK_DGRAM);
+    receiver->bind(address);
+    span::io::Address::ptr to = receiver->localAddress();
+    span::io::Socket::ptr sender = address->createSocket(&ioManager, SOCK_DGRAM);
+    sender->bind(address);
+
+    char out[kDatagrams];
+    iovec outBuffers[kDatagrams];
+    span::io::Socket::Datagram outgoing[kDatagrams];
+    for (size_t i = 0; i < kDatagrams; ++i) {
+      out[i] = static_cast<char>('0' + i);
+      outBuffers[i].iov_base = &out[i];
+      outBuffers[i].iov_len = 1;
+      outgoing[i] = {&outBuffers[i], 1, to.get(), 0, 0};
+    }
+    // Scheduled for once we're waiting on an empty socket.
+    ioManager.schedule([&]() {
+      size_t sent = 0;
+      while (sent < kDatagrams) {
+        sent += sender->sendBatch(outgoing + sent, kDatagrams - sent);
+      }
+    });
+
+    char in[kDatagrams][4];
+    iovec inBuffers[kDatagrams];
+    std::vector<span::io::Address::ptr> from;
+    span::io::Socket::Datagram incoming[kDatagrams];
+    for (size_t i = 0; i < kDatagrams; ++i) {
+      inBuffers[i].iov_base = in[i];
+      inBuffers[i].iov_len = sizeof(in[i]);
+      from.push_back(receiver->emptyAddress());
+      incoming[i] = {&inBuffers[i], 1, from.back().get(), 0, 0};
+    }
+    size_t received = 0;
+    while (received < kDatagrams) {
+      received += receiver->receiveBatch(incoming + received, kDatagrams - received);
+    }
+    for (size_t i = 0; i < kDatagrams; ++i) {
+      EXPECT_EQ(incoming[i].length, 1u);
+      EXPECT_EQ(in[i][0], static_cast<char>('0' + i));
+      EXPECT_EQ(*from[i], *sender->localAddress());
+    }
+  }
+
+  TEST(Socket, batchReceiveTimeout) {
+    span::io::IOManager ioManager;
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    span::io::Socket::ptr receiver = address->createSocket(&ioManager, SOCK_DGRAM);
+    receiver->bind(address);
+    receiver->receiveTimeout(1000);
+    char buf;
+    iovec buffer = {&buf, 1};
+    span::io::Socket::Datagram datagram = {&buffer, 1, NULL, 0, 0};
+    uint64 start = span::TimerManager::now();
+    ASSERT_THROW(receiver->receiveBatch(&datagram, 1), std::runtime_error);
+    ASSERT_GT((span::TimerManager::now() - start), 1000);
+  }
+
+  TEST(Socket, segmentedDatagrams) {
+    static const size_t kLength = 950, kSegment = 100;
+    span::io::IOManager ioManager;
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    span::io::Socket::ptr receiver = address->createSocket(&ioManager, SOCK_DGRAM);
+    receiver->bind(address);
+    // Where the kernel can't coalesce, each datagram just comes back on its own.
+    receiver->receiveCoalescing(true);
+    span::io::Address::ptr to = receiver->localAddress();
+    span::io::Socket::ptr sender = address->createSocket(&ioManager, SOCK_DGRAM);
+
+    char out[kLength];
+    for (size_t i = 0; i < kLength; ++i) {
+      out[i] = static_cast<char>(i / kSegment);
+    }
+    // Scheduled for once we're waiting on an empty socket.
+    ioManager.schedule([&]() {
+      ASSERT_EQ(sender->sendSegments(out, kLength, kSegment, 0, to.get()), kLength);
+    });
+
+    std::vector<char> in(65536);
+    std::vector<size_t> datagrams, lengths;
+    std::string received;
+    while (lengths.size() < 10) {
+      size_t length = receiver->receiveSegments(&in[0], in.size(), &datagrams);
+      received.append(&in[0], length);
+      lengths.insert(lengths.end(), datagrams.begin(), datagrams.end());
+    }
+    ASSERT_EQ(lengths.size(), 10u);
+    for (size_t i = 0; i < 9; ++i) {
+      EXPECT_EQ(lengths[i], kSegment);
+    }
+    EXPECT_EQ(lengths[9], 50u);
+    EXPECT_EQ(received, std::string(out, kLength));
+  }
 }  // namespace
@@ -0,0 +1,82 @@
+#include <functional>
+
+#include "gtest/gtest.h"
+
+#include "span/fibers/Fiber.hh"
+#include "span/fibers/base/StackPool.hh"
+
+using span::fibers::Fiber;
+using span::fibers::base::StackPool;
+
+namespace {
+  TEST(StackPool, roundsToPages) {
+    size_t size = 1;
+    void *stack = StackPool::allocate(&size);
+    EXPECT_EQ(size, StackPool::pageSize());
+    StackPool::release(stack, size);
+    StackPool::trim();
+  }
+
+  TEST(StackPool, recyclesStacks) {
+    size_t size = 64 * 1024;
+    void *first = StackPool::allocate(&size);
+    StackPool::release(first, size);
+    void *second = StackPool::allocate(&size);
+    EXPECT_EQ(first, second);
+    StackPool::release(second, size);
+    StackPool::trim();
+  }
+
+  TEST(StackPool, recyclesBySize) {
+    size_t small = 16 * 1024;
+    size_t large = 64 * 1024;
+    void *first = StackPool::allocate(&small);
+    StackPool::release(first, small);
+    void *second = StackPool::allocate(&large);
+    EXPECT_NE(first, second);
+    StackPool::release(second, large);
+    StackPool::trim();
+  }
+
+  TEST(StackPool, decommitOnRelease) {
+    StackPool::decommitOnRelease(true);
+    size_t size = StackPool::pageSize();
+    char *stack = static_cast<char *>(StackPool::allocate(&size));
+    stack[0] = 'x';
+    StackPool::release(stack, size);
+    stack = static_cast<char *>(StackPool::allocate(&size));
+    EXPECT_EQ(stack[0], 0);
+    StackPool::release(stack, size);
+    StackPool::decommitOnRelease(false);
+    StackPool::trim();
+  }
+
+  static void recordStack(const volatile char **where) {
+    volatile char local = 0;
+    *where = &local;
+  }
+
+  TEST(StackPool, fibersShareStacks) {
+    const volatile char *first = nullptr, *second = nullptr;
+    {
+      Fiber::ptr fiber(new Fiber(std::bind(&recordStack, &first), 32 * 1024));
+      fiber->call();
+      EXPECT_EQ(fiber->state(), Fiber::TERM);
+    }
+    // Started on the stack the first released, it gets just as far down it.
+    Fiber::ptr fiber(new Fiber(std::bind(&recordStack, &second), 32 * 1024));
+    fiber->call();
+    EXPECT_EQ(fiber->state(), Fiber::TERM);
+    EXPECT_NE(first, nullptr);
+    EXPECT_EQ(first, second);
+    fiber.reset();
+    StackPool::trim();
+  }
+
+  TEST(StackPoolDeathTest, guardPage) {
+    size_t size = StackPool::pageSize();
+    volatile char *stack = static_cast<volatile char *>(StackPool::allocate(&size));
+    EXPECT_DEATH(stack[-1] = 'x', "");
+    StackPool::release(const_cast<char *>(stack), size);
+  }
+}  // namespace
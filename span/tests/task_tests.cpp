@@ -0,0 +1,88 @@
+#include <functional>
+#include <memory>
+#include <typeinfo>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "span/fibers/Task.hh"
+
+using span::fibers::Task;
+
+namespace {
+  static int calls = 0;
+  static void countCall() {
+    ++calls;
+  }
+
+  TEST(Task, emptyByDefault) {
+    Task task;
+    EXPECT_FALSE(task);
+    Task fromNull(nullptr);
+    EXPECT_FALSE(fromNull);
+    Task fromEmptyFunction = std::function<void()>();
+    EXPECT_FALSE(fromEmptyFunction);
+    void (*nullFunction)() = nullptr;
+    Task fromNullFunction(nullFunction);
+    EXPECT_FALSE(fromNullFunction);
+  }
+
+  TEST(Task, smallCallablesAreInline) {
+    int a = 0, b = 0, c = 0;
+    Task task([&a, &b, &c]() { a = b = c = 1; });
+    EXPECT_TRUE(task.isInline());
+    task();
+    EXPECT_EQ(a + b + c, 3);
+
+    Task bound(std::bind(&countCall));
+    EXPECT_TRUE(bound.isInline());
+  }
+
+  TEST(Task, largeCallablesGoOnTheHeap) {
+    char big[Task::INLINE_SIZE + 1] = {1};
+    int result = 0;
+    Task task([big, &result]() { result = big[0]; });
+    EXPECT_FALSE(task.isInline());
+    Task moved(std::move(task));
+    EXPECT_FALSE(task);
+    moved();
+    EXPECT_EQ(result, 1);
+  }
+
+  TEST(Task, movesOnlyCaptures) {
+    std::unique_ptr<int> value(new int(5));
+    int result = 0;
+    Task task([value = std::move(value), &result]() { result = *value; });
+    Task other;
+    other = std::move(task);
+    other();
+    EXPECT_EQ(result, 5);
+  }
+
+  TEST(Task, destroysCapturesOnce) {
+    std::shared_ptr<int> value(new int(0));
+    {
+      Task task([value]() {});
+      EXPECT_EQ(value.use_count(), 2);
+      Task moved(std::move(task));
+      EXPECT_EQ(value.use_count(), 2);
+      moved = nullptr;
+      EXPECT_EQ(value.use_count(), 1);
+    }
+    EXPECT_EQ(value.use_count(), 1);
+  }
+
+  TEST(Task, reportsTarget) {
+    Task plain(&countCall);
+    EXPECT_TRUE(plain.target_type() == typeid(void (*)()));
+    EXPECT_EQ(plain.functionPointer(), reinterpret_cast<void *>(&countCall));
+
+    Task wrapped = std::function<void()>(&countCall);
+    EXPECT_TRUE(wrapped.target_type() == typeid(void (*)()));
+    EXPECT_EQ(wrapped.functionPointer(), reinterpret_cast<void *>(&countCall));
+
+    calls = 0;
+    wrapped();
+    EXPECT_EQ(calls, 1);
+  }
+}  // namespace
@@ -1,3 +1,10 @@
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "span/Common.hh"
@@ -162,4 +169,416 @@ namespace {
 
     TimerManager::setClock();
   }
+
+  TEST(Timer, wheelSingle) {
+    int sequence = 0;
+    int expected = 1;
+    TimerManager manager;
+    manager.useTimingWheel(1000);
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    manager.registerTimer(0, std::bind(&singleTimer, &sequence, &expected));
+    EXPECT_EQ(manager.nextTimer(), 0u);
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 1);
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+  }
+
+  TEST(Timer, wheelFiresOnTickAfterDeadline) {
+    static uint64 clock = 1000500;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    manager.useTimingWheel(1000);
+    Timer::ptr timer = manager.registerTimer(2000, std::bind(&singleTimer, &sequence, &sequence));
+    // Due at 1002500, so the tick ending at 1003000.
+    EXPECT_EQ(manager.nextTimer(), 2500ull);
+    clock += 2499;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 0);
+    clock += 1;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 1);
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    EXPECT_FALSE(timer->cancel());
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, wheelCancelAndRecurring) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int cancelled = 0, recurring = 0;
+    TimerManager manager;
+    manager.useTimingWheel(1000);
+    Timer::ptr timer1 = manager.registerTimer(5000, std::bind(&singleTimer, &cancelled, &cancelled));
+    Timer::ptr timer2 = manager.registerTimer(3000, std::bind(&singleTimer, &recurring, &recurring), true);
+    EXPECT_TRUE(timer1->cancel());
+    for (int i = 0; i < 10; ++i) {
+      clock += 1000;
+      manager.executeTimers();
+    }
+    EXPECT_EQ(cancelled, 0);
+    EXPECT_EQ(recurring, 3);
+    EXPECT_TRUE(timer2->reset(500000, true));
+    // Past level 0, so what's next is cascading it down.
+    EXPECT_EQ(manager.nextTimer(), 256000ull - clock);
+    EXPECT_TRUE(timer2->cancel());
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, wheelCascadesFarTimers) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    manager.useTimingWheel(1);
+    // One per level, one past the last.
+    const std::vector<uint64> delays = {100, 70000, 20000000, 5000000000ull, 10000000000ull};
+    std::vector<Timer::ptr> timers;
+    for (uint64 us : delays) {
+      timers.push_back(manager.registerTimer(us, std::bind(&singleTimer, &sequence, &sequence)));
+    }
+    int fired = 0;
+    while (manager.nextTimer() != ~0ull) {
+      uint64 next = manager.nextTimer();
+      clock += next ? next : 1;
+      manager.executeTimers();
+      if (sequence != fired) {
+        EXPECT_EQ(clock, delays[fired]);
+        fired = sequence;
+      }
+    }
+    EXPECT_EQ(sequence, 5);
+
+    TimerManager::setClock();
+  }
+
+  // The wheel fires exactly what the set does, give or take a tick.
+  TEST(Timer, wheelMatchesSet) {
+    static uint64 clock = 123456789;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+    const uint64 tick = 100;
+
+    std::mt19937_64 random(42);
+    std::set<int> firedSet, firedWheel;
+    TimerManager set, wheel;
+    wheel.useTimingWheel(tick);
+    std::vector<Timer::ptr> setTimers, wheelTimers;
+    for (int i = 0; i < 2000; ++i) {
+      uint64 us = random() % (1 << (random() % 24));
+      setTimers.push_back(set.registerTimer(us, [&firedSet, i]() { firedSet.insert(i); }));
+      wheelTimers.push_back(wheel.registerTimer(us, [&firedWheel, i]() { firedWheel.insert(i); }));
+      if (random() % 4 == 0) {
+        size_t victim = random() % setTimers.size();
+        EXPECT_EQ(setTimers[victim]->cancel(), wheelTimers[victim]->cancel());
+      }
+      if (random() % 8 == 0) {
+        clock += random() % 5000;
+        set.executeTimers();
+        wheel.executeTimers();
+        std::set<int> early;
+        // Never early.
+        std::set_difference(firedWheel.begin(), firedWheel.end(), firedSet.begin(), firedSet.end(),
+          std::inserter(early, early.end()));
+        EXPECT_TRUE(early.empty());
+      }
+    }
+    while (set.nextTimer() != ~0ull || wheel.nextTimer() != ~0ull) {
+      clock += tick;
+      set.executeTimers();
+      wheel.executeTimers();
+    }
+    EXPECT_EQ(firedSet, firedWheel);
+
+    TimerManager::setClock();
+  }
+
+  static void deadlineTest(bool useWheel) {
+    static uint64 clock = 1000000;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int fired = 0;
+    TimerManager manager;
+    if (useWheel) {
+      manager.useTimingWheel(100);
+    }
+    Timer::ptr deadline = manager.createDeadline(std::bind(&singleTimer, &fired, &fired));
+    EXPECT_FALSE(deadline->disarm());
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+
+    // Disarmed before it's due.
+    deadline->arm(5000);
+    EXPECT_NE(manager.nextTimer(), ~0ull);
+    clock += 4000;
+    manager.executeTimers();
+    EXPECT_TRUE(deadline->disarm());
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    clock += 4000;
+    manager.executeTimers();
+    EXPECT_EQ(fired, 0);
+
+    // Re-arming restarts the countdown.
+    deadline->arm(5000);
+    clock += 4000;
+    deadline->arm(5000);
+    clock += 4000;
+    manager.executeTimers();
+    EXPECT_EQ(fired, 0);
+    clock += TimerManager::DEADLINE_TICK_US + 1000;
+    manager.executeTimers();
+    EXPECT_EQ(fired, 1);
+    EXPECT_FALSE(deadline->disarm());
+
+    // And it can be used again after firing.
+    deadline->arm(0);
+    EXPECT_EQ(manager.nextTimer(), 0u);
+    manager.executeTimers();
+    EXPECT_EQ(fired, 2);
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, deadline) {
+    deadlineTest(false);
+  }
+
+  TEST(Timer, wheelDeadline) {
+    deadlineTest(true);
+  }
+
+  TEST(Timer, deadlineAlongsideTimers) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    Timer::ptr deadline = manager.createDeadline(std::bind(&singleTimer, &sequence, &sequence));
+    deadline->arm(10000);
+    Timer::ptr timer = manager.registerTimer(20000, std::bind(&singleTimer, &sequence, &sequence));
+    EXPECT_EQ(manager.nextTimer(), 10000ull);
+    clock += 10000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 1);
+    EXPECT_EQ(manager.nextTimer(), 10000ull);
+    clock += 10000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 2);
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, shardedNextTimerIsPerThread) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    manager.shardByThread();
+    manager.attachThread();
+    Timer::ptr mine = manager.registerTimer(100000, std::bind(&singleTimer, &sequence, &sequence));
+    std::thread other([&manager, &sequence]() {
+      manager.attachThread();
+      manager.registerTimer(10000, std::bind(&singleTimer, &sequence, &sequence));
+      EXPECT_EQ(manager.nextTimer(), 10000ull);
+      clock += 10000;
+      manager.executeTimers();
+      EXPECT_EQ(sequence, 1);
+      EXPECT_EQ(manager.nextTimer(), ~0ull);
+      manager.detachThread();
+    });
+    other.join();
+    EXPECT_EQ(manager.nextTimer(), 90000ull);
+    // Unattached threads share theirs with everyone.
+    std::thread unattached([&manager, &sequence]() {
+      manager.registerTimer(5000, std::bind(&singleTimer, &sequence, &sequence));
+    });
+    unattached.join();
+    EXPECT_EQ(manager.nextTimer(), 5000ull);
+    clock += 90000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 3);
+    manager.detachThread();
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, shardedCancelFromAnotherThread) {
+    int sequence = 0;
+    int expected = 1;
+    std::shared_ptr<int> captured(new int(0));
+    TimerManager manager;
+    manager.shardByThread();
+    manager.attachThread();
+    Timer::ptr timer = manager.registerTimer(1000000, [&sequence, &expected, captured]() {
+      singleTimer(&sequence, &expected);
+    });
+    EXPECT_NE(manager.nextTimer(), ~0ull);
+    std::thread other([&timer]() {
+      EXPECT_TRUE(timer->cancel());
+      EXPECT_FALSE(timer->cancel());
+    });
+    other.join();
+    // The callback goes straight away, and the owner lets go of the timer next time it looks.
+    EXPECT_TRUE(captured.unique());
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    EXPECT_FALSE(timer->refresh());
+    manager.detachThread();
+  }
+
+  TEST(Timer, shardedResetFromAnotherThread) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    manager.shardByThread();
+    manager.attachThread();
+    Timer::ptr later = manager.registerTimer(10000, std::bind(&singleTimer, &sequence, &sequence));
+    Timer::ptr sooner = manager.registerTimer(1000000, std::bind(&singleTimer, &sequence, &sequence));
+    EXPECT_EQ(manager.nextTimer(), 10000ull);
+    std::thread other([&manager, &later, &sequence, &sooner]() {
+      manager.attachThread();
+      // Due after the owner wakes up anyway: left to it.
+      EXPECT_TRUE(later->refresh());
+      EXPECT_TRUE(later->reset(50000, true));
+      // Due before: moves here.
+      EXPECT_TRUE(sooner->reset(1000, true));
+      EXPECT_EQ(manager.nextTimer(), 1000ull);
+      clock += 1000;
+      manager.executeTimers();
+      EXPECT_EQ(sequence, 1);
+      manager.detachThread();
+    });
+    other.join();
+    EXPECT_EQ(manager.nextTimer(), 49000ull);
+    clock += 49000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 2);
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    manager.detachThread();
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, shardedDeadlinesAndDetach) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    manager.shardByThread();
+    Timer::ptr deadline = manager.createDeadline(std::bind(&singleTimer, &sequence, &sequence));
+    std::thread other([&manager, &deadline]() {
+      manager.attachThread();
+      deadline->arm(10000);
+      EXPECT_EQ(manager.nextTimer(), 10000ull);
+      // Leaves it to be shared.
+      manager.detachThread();
+    });
+    other.join();
+    EXPECT_EQ(manager.nextTimer(), 10000ull);
+    EXPECT_TRUE(deadline->disarm());
+    EXPECT_EQ(manager.nextTimer(), ~0ull);
+    deadline->arm(2000);
+    clock += 2000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 1);
+    EXPECT_FALSE(deadline->disarm());
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, slackCoalesces) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    int sequence = 0;
+    TimerManager manager;
+    for (uint64 us : {1000, 3000, 5000, 7000}) {
+      manager.registerTimer(us, std::bind(&singleTimer, &sequence, &sequence), false, 8192);
+    }
+    // All put off to the last multiple of 8192us within their slack, which they share.
+    EXPECT_EQ(manager.nextTimer(), 8192ull);
+    clock = 8191;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 0);
+    clock = 8192;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 4);
+    TimerManager::Stats stats = manager.stats();
+    EXPECT_EQ(stats.wakeups, 1u);
+    EXPECT_EQ(stats.expired, 4u);
+    EXPECT_EQ(stats.wakeupsSaved, 3u);
+
+    // One due on time means that wakeup was needed anyway.
+    manager.registerTimer(100, std::bind(&singleTimer, &sequence, &sequence), false, 50);
+    manager.registerTimer(10000, std::bind(&singleTimer, &sequence, &sequence));
+    manager.registerTimer(10, std::bind(&singleTimer, &sequence, &sequence), false, 8192);
+    EXPECT_EQ(manager.nextTimer(), 128ull);
+    clock += 10000;
+    manager.executeTimers();
+    EXPECT_EQ(sequence, 7);
+    stats = manager.stats();
+    EXPECT_EQ(stats.wakeups, 2u);
+    EXPECT_EQ(stats.wakeupsSaved, 5u);
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, slackNeverEarlyOrTooLate) {
+    static uint64 clock = 0;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    std::mt19937 random(1);
+    TimerManager manager;
+    for (int i = 0; i < 1000; ++i) {
+      uint64 us = random() % 100000;
+      uint64 slack = random() % 20000;
+      uint64 due = clock + us;
+      bool fired = false;
+      Timer::ptr timer = manager.registerTimer(us, [&fired]() { fired = true; }, false, slack);
+      uint64 next = clock + manager.nextTimer();
+      EXPECT_GE(next, due);
+      EXPECT_LE(next, due + slack);
+      clock = next;
+      manager.executeTimers();
+      EXPECT_TRUE(fired);
+    }
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, coarseNow) {
+    static uint64 clock = 1000;
+    TimerManager::setClock(std::bind(&fakeClock, &clock));
+
+    EXPECT_EQ(TimerManager::coarseNow(), 1000u);
+    EXPECT_EQ(TimerManager::preciseNow(), 1000u);
+    EXPECT_EQ(TimerManager::updateLoopTime(), 1000u);
+    clock += 500;
+    // Stays put until the loop comes round again.
+    EXPECT_EQ(TimerManager::coarseNow(), 1000u);
+    EXPECT_EQ(TimerManager::now(), 1500u);
+    EXPECT_EQ(TimerManager::updateLoopTime(), 1500u);
+    EXPECT_EQ(TimerManager::coarseNow(), 1500u);
+    TimerManager::clearLoopTime();
+    clock += 500;
+    EXPECT_EQ(TimerManager::coarseNow(), 2000u);
+
+    TimerManager::setClock();
+  }
+
+  TEST(Timer, preciseNowTracksNow) {
+    uint64 before = TimerManager::now();
+    uint64 precise = TimerManager::preciseNow();
+    uint64 after = TimerManager::now();
+    EXPECT_LE(before, precise + 1000);
+    EXPECT_LE(precise, after + 1000);
+  }
 }  // namespace
@@ -1,13 +1,31 @@
 #include "gtest/gtest.h"
 
+#include <string>
 #include <utility>
 
 #include "span/fibers/WorkerPool.hh"
+#include "span/io/IOManager.hh"
+#include "span/io/Socket.hh"
+#include "span/io/streams/KernelTls.hh"
 #include "span/io/streams/Pipe.hh"
+#include "span/io/streams/SocketStream.hh"
 #include "span/io/streams/Stream.hh"
 #include "span/io/streams/Tls.hh"
 
 namespace {
+  static std::string unhex(const std::string &hex) {
+    std::string result;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+      result.push_back(static_cast<char>(std::stoi(hex.substr(i, 2), NULL, 16)));
+    }
+    return result;
+  }
+
+  template<size_t N>
+  static std::string bytes(const unsigned char (&array)[N]) {
+    return std::string(reinterpret_cast<const char *>(array), N);
+  }
+
   static void test_accept(span::io::streams::TLSStream::ptr server) {
     server->accept();
     server->flush();
@@ -40,4 +58,137 @@ namespace {
     ASSERT_EQ(client->read(&buff, 5), 5u);
     ASSERT_STREQ(buff, "world");
   }
+
+  TEST(TlsStream, offload) {
+    span::io::IOManager ioManager;
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    span::io::Socket::ptr listen = address->createSocket(&ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    span::io::Socket::ptr connect = address->createSocket(&ioManager, SOCK_STREAM);
+    connect->connect(listen->localAddress());
+
+    span::io::streams::TLSStream::ptr sslServer(new span::io::streams::TLSStream(
+      span::io::streams::Stream::ptr(new span::io::streams::SocketStream(listen->accept())), false));
+    span::io::streams::TLSStream::ptr sslClient(new span::io::streams::TLSStream(
+      span::io::streams::Stream::ptr(new span::io::streams::SocketStream(connect)), true));
+
+    ioManager.schedule(std::bind(&test_accept, sslServer));
+    sslClient->connect();
+    ioManager.dispatch();
+
+    // Wherever the kernel can't take over, everything carries on in user space.
+    ASSERT_EQ(sslServer->offload(), sslServer->offloaded(true));
+    ASSERT_EQ(sslClient->offload(), sslClient->offloaded(true));
+    ASSERT_TRUE(sslServer->offloaded(true) || !sslServer->offloaded(false));
+
+    span::io::streams::Stream::ptr server = sslServer, client = sslClient;
+
+    char buff[6];
+    buff[5] = '\0';
+    client->write("hello");
+    client->flush(false);
+    ASSERT_EQ(server->read(&buff, 5), 5u);
+    ASSERT_STREQ(buff, "hello");
+    server->write("world");
+    server->flush(false);
+    ASSERT_EQ(client->read(&buff, 5), 5u);
+    ASSERT_STREQ(buff, "world");
+  }
+
+  // RFC 8448 3, a simple 1-RTT handshake on TLS_AES_128_GCM_SHA256.
+  static const char kServerHandshakeSecret[] = "b67b7d690cc16c4e75e54213cb2d37b4e9c912bcded9105d42befd59d391ad38";
+  static const char kServerTrafficSecret[] = "a11af9f05531f856ad47116b45a950328204b4f44bfb6b3a4b4f1f3fcb631643";
+  static const char kClientHandshakeSecret[] = "b3eddb126e067f35a780b3abf45e2d8f3b1a950738f52e9600746a0e27a55a21";
+
+  TEST(TlsStream, expandLabel) {
+    ASSERT_EQ(span::io::streams::ktls::expandLabel(EVP_sha256(), unhex(kServerHandshakeSecret), "key", 16),
+      unhex("3fce516009c21727d0f2e4e86ee403bc"));
+    ASSERT_EQ(span::io::streams::ktls::expandLabel(EVP_sha256(), unhex(kServerHandshakeSecret), "iv", 12),
+      unhex("5d313eb2671276ee13000b30"));
+    ASSERT_EQ(span::io::streams::ktls::expandLabel(EVP_sha256(), unhex(kClientHandshakeSecret), "key", 16),
+      unhex("dbfaa693d1762c5b666af5d950258d01"));
+    ASSERT_EQ(span::io::streams::ktls::expandLabel(EVP_sha256(), unhex(kClientHandshakeSecret), "iv", 12),
+      unhex("5bd3c71b836e0b76bb73265f"));
+  }
+
+  // The TLS 1.2 PRF vectors posted to the IETF TLS list for SHA-256 and SHA-384.
+  TEST(TlsStream, prf) {
+    ASSERT_EQ(span::io::streams::ktls::prf(EVP_sha256(), unhex("9bbe436ba940f017b17652849a71db35"),
+      "test label" + unhex("a0ba9f936cda311827a6f796ffd5198c"), 100),
+      unhex("e3f229ba727be17b8d122620557cd453c2aab21d07c3d495329b52d4e61edb5a6b301791e90d35c9c9a46b4e14baf9af"
+        "0fa022f7077def17abfd3797c0564bab4fbc91666e9def9b97fce34f796789baa48082d122ee42c5a72e5a5110fff70187"
+        "347b66"));
+    ASSERT_EQ(span::io::streams::ktls::prf(EVP_sha384(), unhex("b80b733d6ceefcdc71566ea48e5567df"),
+      "test label" + unhex("cd665cf6a8447dd6ff8b27555edb7465"), 148),
+      unhex("7b0c18e9ced410ed1804f2cfa34a336a1c14dffb4900bb5fd7942107e81c83cde9ca0faa60be9fe34f82b1233c9146a0"
+        "e534cb400fed2700884f9dc236f80edd8bfa961144c9e8d792eca722a7b32fc3d416d473ebc2c5fd4abfdad05d9184259b"
+        "5bf8cd4d90fa0d31e2dec479e4f1a26066f2eea9a69236a3e52655c9e9aee691c8f3a26854308d5eaa3be85e0990703d73"
+        "e56f"));
+  }
+
+#if UNIX_FLAVOUR == UNIX_FLAVOUR_LINUX
+  TEST(TlsStream, cryptoInfo13) {
+    span::io::streams::ktls::CryptoInfo info;
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0x1301, TLS1_3_VERSION, false, 5, unhex(kServerTrafficSecret),
+      std::string(), &info), sizeof(info.aesGcm128));
+    ASSERT_EQ(info.aesGcm128.info.version, TLS_1_3_VERSION);
+    ASSERT_EQ(info.aesGcm128.info.cipher_type, TLS_CIPHER_AES_GCM_128);
+    ASSERT_EQ(bytes(info.aesGcm128.key), unhex("9f02283b6c9c07efc26bb9f2ac92e356"));
+    // The RFC's write_iv, split where the kernel wants it.
+    ASSERT_EQ(bytes(info.aesGcm128.salt), unhex("cf782b88"));
+    ASSERT_EQ(bytes(info.aesGcm128.iv), unhex("dd83549aadf1e984"));
+    ASSERT_EQ(bytes(info.aesGcm128.rec_seq), unhex("0000000000000005"));
+
+    // Nothing to take over without a secret, or on a cipher the kernel doesn't know.
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0x1301, TLS1_3_VERSION, false, 0, std::string(), std::string(),
+      &info), 0u);
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0x1304, TLS1_3_VERSION, false, 0, unhex(kServerTrafficSecret),
+      std::string(), &info), 0u);
+  }
+
+  TEST(TlsStream, cryptoInfo12) {
+    const std::string master(48, '\x0b'), randoms = std::string(32, '\x5e') + std::string(32, '\xc1');
+    const std::string block = span::io::streams::ktls::prf(EVP_sha256(), master, "key expansion" + randoms, 88);
+    span::io::streams::ktls::CryptoInfo info;
+
+    // AES-GCM: the client's key and salt come first, and the explicit nonce starts at the sequence number.
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0xc02f, TLS1_2_VERSION, true, 1, master, randoms, &info),
+      sizeof(info.aesGcm128));
+    ASSERT_EQ(info.aesGcm128.info.version, TLS_1_2_VERSION);
+    ASSERT_EQ(bytes(info.aesGcm128.key), block.substr(0, 16));
+    ASSERT_EQ(bytes(info.aesGcm128.salt), block.substr(32, 4));
+    ASSERT_EQ(bytes(info.aesGcm128.iv), unhex("0000000000000001"));
+    ASSERT_EQ(bytes(info.aesGcm128.rec_seq), unhex("0000000000000001"));
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0xc02f, TLS1_2_VERSION, false, 0, master, randoms, &info),
+      sizeof(info.aesGcm128));
+    ASSERT_EQ(bytes(info.aesGcm128.key), block.substr(16, 16));
+    ASSERT_EQ(bytes(info.aesGcm128.salt), block.substr(36, 4));
+
+    // ChaCha20-Poly1305: a whole 12 byte fixed IV each, after the keys.
+    ASSERT_EQ(span::io::streams::ktls::cryptoInfo(0xcca8, TLS1_2_VERSION, false, 0, master, randoms, &info),
+      sizeof(info.chacha20Poly1305));
+    ASSERT_EQ(info.chacha20Poly1305.info.cipher_type, TLS_CIPHER_CHACHA20_POLY1305);
+    ASSERT_EQ(bytes(info.chacha20Poly1305.key), block.substr(32, 32));
+    ASSERT_EQ(bytes(info.chacha20Poly1305.iv), block.substr(76, 12));
+  }
+#endif
+
+  TEST(TlsStream, classifyRecords) {
+    using span::io::streams::ktls::classify;
+    static const unsigned char kCloseNotify[] = {1, 0}, kBadRecordMac[] = {2, 20};
+    static const unsigned char kNewSessionTicket[] = {4, 0, 0, 0}, kKeyUpdate[] = {24, 0, 0, 1, 0};
+
+    ASSERT_EQ(classify(span::io::streams::ktls::kApplicationData, "hello", 5), span::io::streams::ktls::DATA);
+    ASSERT_EQ(classify(span::io::streams::ktls::kAlert, kCloseNotify, sizeof(kCloseNotify)),
+      span::io::streams::ktls::CLOSE);
+    ASSERT_THROW(classify(span::io::streams::ktls::kAlert, kBadRecordMac, sizeof(kBadRecordMac)),
+      span::io::streams::BoringSSLException);
+    ASSERT_EQ(classify(span::io::streams::ktls::kHandshake, kNewSessionTicket, sizeof(kNewSessionTicket)),
+      span::io::streams::ktls::SKIP);
+    ASSERT_THROW(classify(span::io::streams::ktls::kHandshake, kKeyUpdate, sizeof(kKeyUpdate)),
+      span::io::streams::BoringSSLException);
+    // change_cipher_spec, which has no business turning up after the handshake.
+    ASSERT_THROW(classify(20, kCloseNotify, 1), span::io::streams::BoringSSLException);
+  }
 }  /// namespace
@@ -0,0 +1,172 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+
+#include "gtest/gtest.h"
+
+#include "span/Common.hh"
+#include "span/exceptions/Assert.hh"
+#include "span/io/IOManager.hh"
+#include "span/io/Socket.hh"
+#include "span/io/streams/Buffer.hh"
+#include "span/io/streams/Fd.hh"
+#include "span/io/streams/File.hh"
+#include "span/io/streams/Pipe.hh"
+#include "span/io/streams/SocketStream.hh"
+#include "span/io/streams/Transfer.hh"
+
+namespace {
+  // Big enough to take more than one trip through the kernel, and a socket's buffers.
+  static const size_t kLength = 4 * 1024 * 1024 + 17;
+
+  static std::string pattern(size_t length) {
+    std::string result(length, '\0');
+    for (size_t i = 0; i < length; ++i) {
+      result[i] = static_cast<char>(i * 31 + i / 4096);
+    }
+    return result;
+  }
+
+  static void writeAll(span::io::streams::Stream *stream, const std::string &contents) {
+    span::io::streams::Buffer buffer(contents);
+    while (buffer.readAvailable() > 0) {
+      buffer.consume(stream->write(&buffer, buffer.readAvailable()));
+    }
+  }
+
+  static span::io::streams::FileStream::ptr tempFile(const std::string &contents) {
+    char path[] = "/tmp/span_transfer_XXXXXX";
+    int fd = mkstemp(path);
+    SPAN_ASSERT(fd >= 0);
+    close(fd);
+    span::io::streams::FileStream::ptr result(new span::io::streams::FileStream(path,
+      span::io::streams::FileStream::READWRITE,
+      static_cast<span::io::streams::FileStream::CreateFlags>(
+        span::io::streams::FileStream::OVERWRITE | span::io::streams::FileStream::DELETE_ON_CLOSE)));
+    writeAll(result.get(), contents);
+    result->seek(0);
+    return result;
+  }
+
+  static void readAll(span::io::streams::Stream *stream, span::io::streams::Buffer *buffer) {
+    while (stream->read(buffer, 65536) > 0) {}
+  }
+
+  static std::pair<span::io::Socket::ptr, span::io::Socket::ptr> connectedPair(span::io::IOManager *ioManager) {
+    span::io::Address::ptr address = span::io::Address::lookup("127.0.0.1").front();
+    span::io::Socket::ptr listen = address->createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    span::io::Socket::ptr connect = address->createSocket(ioManager, SOCK_STREAM);
+    connect->connect(listen->localAddress());
+    return std::make_pair(connect, listen->accept());
+  }
+
+  TEST(Transfer, fileToFile) {
+    std::string data = pattern(kLength);
+    span::io::streams::FileStream::ptr src = tempFile(data);
+    span::io::streams::FileStream::ptr dst = tempFile("");
+
+    ASSERT_EQ(span::io::streams::transferStream(src, dst), kLength);
+    dst->seek(0);
+    span::io::streams::Buffer result;
+    readAll(dst.get(), &result);
+    ASSERT_TRUE(result == data);
+  }
+
+  TEST(Transfer, fileToFileExactEof) {
+    span::io::streams::FileStream::ptr src = tempFile("");
+    span::io::streams::FileStream::ptr dst = tempFile("");
+
+    ASSERT_THROW(span::io::streams::transferStream(src, dst, 10, span::io::streams::EXACT), std::runtime_error);
+  }
+
+  TEST(Transfer, fileToSocket) {
+    span::io::IOManager ioManager;
+    std::string data = pattern(kLength);
+    span::io::streams::FileStream::ptr src = tempFile(data);
+    std::pair<span::io::Socket::ptr, span::io::Socket::ptr> sockets = connectedPair(&ioManager);
+    span::io::streams::SocketStream dst(sockets.first);
+    span::io::streams::SocketStream received(sockets.second);
+
+    span::io::streams::Buffer result;
+    ioManager.schedule([&]() { readAll(&received, &result); });
+    ASSERT_EQ(span::io::streams::transferStream(src.get(), &dst, kLength, span::io::streams::EXACT), kLength);
+    dst.close();
+    ioManager.dispatch();
+    ASSERT_TRUE(result == data);
+  }
+
+  TEST(Transfer, socketToSocket) {
+    span::io::IOManager ioManager;
+    std::string data = pattern(kLength);
+    std::pair<span::io::Socket::ptr, span::io::Socket::ptr> in = connectedPair(&ioManager);
+    std::pair<span::io::Socket::ptr, span::io::Socket::ptr> out = connectedPair(&ioManager);
+    span::io::streams::SocketStream sent(in.first), src(in.second), dst(out.first), received(out.second);
+
+    span::io::streams::Buffer result;
+    ioManager.schedule([&]() {
+      writeAll(&sent, data);
+      sent.close();
+    });
+    ioManager.schedule([&]() { readAll(&received, &result); });
+    ASSERT_EQ(span::io::streams::transferStream(&src, &dst), kLength);
+    dst.close();
+    ioManager.dispatch();
+    ASSERT_TRUE(result == data);
+  }
+
+  TEST(Transfer, pipeToFile) {
+    span::io::IOManager ioManager;
+    std::string data = pattern(kLength);
+    std::pair<span::io::streams::NativeStream::ptr, span::io::streams::NativeStream::ptr> pipe =
+      span::io::streams::anonymousPipe(&ioManager);
+    span::io::streams::FileStream::ptr dst = tempFile("");
+
+    ioManager.schedule([&]() {
+      writeAll(pipe.second.get(), data);
+      pipe.second->close();
+    });
+    ASSERT_EQ(span::io::streams::transferStream(pipe.first, dst), kLength);
+    ioManager.dispatch();
+    dst->seek(0);
+    span::io::streams::Buffer result;
+    readAll(dst.get(), &result);
+    ASSERT_TRUE(result == data);
+  }
+
+  TEST(Transfer, dstRefusesSplice) {
+    span::io::IOManager ioManager;
+    std::string data = pattern(8);
+    std::pair<span::io::Socket::ptr, span::io::Socket::ptr> in = connectedPair(&ioManager);
+    span::io::streams::SocketStream sent(in.first), src(in.second);
+    // Only takes 8 byte writes, and never through splice(), so what's already in the pipe is stranded.
+    int efd = eventfd(0, EFD_CLOEXEC);
+    ASSERT_GE(efd, 0);
+    span::io::streams::FDStream dst(efd, &ioManager);
+
+    ioManager.schedule([&]() { writeAll(&sent, data); });
+    ASSERT_EQ(span::io::streams::transferStream(&src, &dst, 8, span::io::streams::EXACT), 8u);
+    ioManager.dispatch();
+    uint64_t value;
+    ASSERT_EQ(read(efd, &value, sizeof(value)), static_cast<ssize_t>(sizeof(value)));
+    ASSERT_EQ(std::string(reinterpret_cast<const char *>(&value), sizeof(value)), data);
+  }
+
+  TEST(Transfer, userSpaceFallback) {
+    span::io::IOManager ioManager;
+    std::string data = pattern(kLength);
+    span::io::streams::FileStream::ptr src = tempFile(data);
+    std::pair<span::io::streams::Stream::ptr, span::io::streams::Stream::ptr> pipe =
+      span::io::streams::pipeStream();
+
+    span::io::streams::Buffer result;
+    ioManager.schedule([&]() { readAll(pipe.second.get(), &result); });
+    ASSERT_EQ(span::io::streams::transferStream(src, pipe.first), kLength);
+    pipe.first->close();
+    ioManager.dispatch();
+    ASSERT_TRUE(result == data);
+  }
+}  // namespace